@@ -0,0 +1,28 @@
+# Objects allocated per write_tag_to_string and read_tag_from_string.
+# Float and Integer coordinates are converted natively, Rational ones go
+# through the generic Ruby calls and serve as the comparison.
+#
+#   ruby -Ilib -Itest bench/coordinates.rb
+require 'exif_geo_tag'
+require 'jpeg_factory'
+
+N = 10_000
+jpeg = JPEGFactory.jpeg(gps: false)
+
+def allocated
+  before = GC.stat(:total_allocated_objects)
+  N.times { yield }
+  (GC.stat(:total_allocated_objects) - before).fdiv(N)
+end
+
+{
+  'Float' => { _latitude: -52.5708272, _longitude: 23.8014078 },
+  'Integer' => { _latitude: -52, _longitude: 23 },
+  'Rational' => { _latitude: Rational(-525_708_272, 10_000_000), _longitude: Rational(238_014_078, 10_000_000) }
+}.each do |name, tags|
+  out, = ExifGeoTag.write_tag_to_string(jpeg, tags)
+  write = allocated { ExifGeoTag.write_tag_to_string(jpeg, tags) }
+  read = allocated { ExifGeoTag.read_tag_from_string(out) }
+  gps = allocated { ExifGeoTag.read_tag_from_string(out, as: :gps)._latitude }
+  printf("%-8s  write %6.1f  read %6.1f  read as: :gps, _latitude %6.1f  objects per call\n", name, write, read, gps)
+end
@@ -0,0 +1,41 @@
+# Bytes read per tagged file, from the rchar counter of /proc/self/io,
+# and page faults per file, which count the parts of mapped photos that
+# are touched. write_tag parses the photo once, so a rewrite reads each
+# byte once, in the copy of the unchanged tail, where it used to read the
+# file twice; a patch in place reads the headers only. Linux only.
+#
+#   ruby -Ilib -Itest bench/read_bytes.rb
+require 'exif_geo_tag'
+require 'jpeg_factory'
+require 'tmpdir'
+
+abort 'needs /proc/self/io' unless File.readable?('/proc/self/io')
+
+N = 50
+TAGS = { _latitude: 52.5708272, _longitude: 23.8014078, _timestamp: Time.utc(2017, 5, 4, 10, 20, 30) }.freeze
+
+def counters
+  rchar = File.read('/proc/self/io')[/^rchar: (\d+)/, 1].to_i
+  stat = File.read('/proc/self/stat').split(') ').last.split
+  [rchar, stat[7].to_i + stat[9].to_i]
+end
+
+def measure(files)
+  GC.disable
+  before = counters
+  files.each { |file| yield file }
+  after = counters
+  GC.enable
+  after.zip(before).map { |a, b| (a - b).fdiv(files.size) }
+end
+
+Dir.mktmpdir('exif_geo_tag') do |dir|
+  files = Array.new(N) { |i| JPEGFactory.write_jpeg(File.join(dir, "#{i}.jpg"), gps: false, scan: 3 << 20) }
+  writer = ExifGeoTag::Writer.new
+  [['write_tag', ->(f) { ExifGeoTag.write_tag(f, TAGS.dup) }],
+   ['Writer#write_tag', ->(f) { writer.write_tag(f, TAGS.dup) }],
+   ['write_tag, in_place', ->(f) { ExifGeoTag.write_tag(f, TAGS.dup, in_place: true) }]].each do |name, tag|
+    rchar, faults = measure(files, &tag)
+    printf("%-22s %10.0f bytes read  %6.1f page faults  per %d KiB file\n", name, rchar, faults, File.size(files[0]) >> 10)
+  end
+end
@@ -0,0 +1,31 @@
+# Time per save of photos with many APPn and COM segments, through
+# write_tag_to_string and through write_tag. The output buffer is
+# presized from the sections and the sections array grows by doubling,
+# so the time should grow linearly with the number of segments.
+#
+#   ruby -Ilib -Itest bench/segments.rb
+require 'exif_geo_tag'
+require 'jpeg_factory'
+require 'tmpdir'
+
+TAGS = { _latitude: 52.5708272, _longitude: 23.8014078, _timestamp: Time.utc(2017, 5, 4, 10, 20, 30) }.freeze
+
+def per_call(n)
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  n.times { yield }
+  (Process.clock_gettime(Process::CLOCK_MONOTONIC) - started) * 1e6 / n
+end
+
+Dir.mktmpdir('exif_geo_tag') do |dir|
+  file = File.join(dir, 'photo.jpg')
+  [10, 100, 1000, 4000].each do |count|
+    segments = Array.new(count) { |i| [i.even? ? 0xfe : 0xe2 + i % 12, "segment #{i}".b * 64] }
+    jpeg = JPEGFactory.jpeg(gps: false, scan: 1 << 20, segments: segments)
+    n = [200_000 / count, 20].max
+    string = per_call(n) { ExifGeoTag.write_tag_to_string(jpeg, TAGS.dup) }
+    File.binwrite(file, jpeg)
+    rewrite = per_call(n) { ExifGeoTag.write_tag(file, TAGS.dup) }
+    printf("%5d segments, %5d KiB  write_tag_to_string %8.1f us  write_tag %8.1f us\n",
+           count, jpeg.bytesize >> 10, string, rewrite)
+  end
+end
@@ -0,0 +1,33 @@
+# Files tagged per second by 1, 2, 4... Ruby threads, each rewriting its
+# own photos with write_tag. The file I/O and EXIF work run without the
+# GVL, so the rate should grow with the threads up to the number of
+# cores.
+#
+#   ruby -Ilib -Itest bench/threads.rb
+require 'exif_geo_tag'
+require 'jpeg_factory'
+require 'etc'
+require 'tmpdir'
+
+ROUNDS = 20
+TAGS = { _latitude: 52.5708272, _longitude: 23.8014078, _timestamp: Time.utc(2017, 5, 4, 10, 20, 30) }.freeze
+
+cores = Etc.nprocessors
+counts = [1, 2, 4, 8, cores].select { |n| n <= [cores, 2].max }.uniq.sort
+puts "#{cores} cores"
+
+Dir.mktmpdir('exif_geo_tag') do |dir|
+  files = Array.new(counts.max) do |t|
+    Array.new(8) { |i| JPEGFactory.write_jpeg(File.join(dir, "#{t}-#{i}.jpg"), scan: 1 << 20) }
+  end
+  base = nil
+  counts.each do |n|
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    Array.new(n) do |t|
+      Thread.new { ROUNDS.times { files[t].each { |file| ExifGeoTag.write_tag(file, TAGS.dup) } } }
+    end.each(&:join)
+    rate = n * ROUNDS * files[0].size / (Process.clock_gettime(Process::CLOCK_MONOTONIC) - started)
+    base ||= rate
+    printf("%2d threads  %8.0f files/s  %5.2fx\n", n, rate, rate / base)
+  end
+end
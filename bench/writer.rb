@@ -0,0 +1,74 @@
+# malloc, calloc and realloc calls and Ruby objects per tagged file, for
+# write_tag and for a long-lived ExifGeoTag::Writer, which should make
+# next to no malloc calls once it has tagged a few files. The calls are
+# counted by a small LD_PRELOAD library built with the C compiler Ruby
+# was built with; without it (or without glibc) only objects are shown.
+#
+#   ruby -Ilib -Itest bench/writer.rb
+require 'exif_geo_tag'
+require 'jpeg_factory'
+require 'fiddle'
+require 'fileutils'
+require 'rbconfig'
+require 'tmpdir'
+
+COUNTER = <<~C.freeze
+  #include <stddef.h>
+  extern void *__libc_malloc(size_t);
+  extern void *__libc_calloc(size_t, size_t);
+  extern void *__libc_realloc(void *, size_t);
+  static unsigned long calls;
+  void *malloc(size_t s) { __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED); return __libc_malloc(s); }
+  void *calloc(size_t n, size_t s) { __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED); return __libc_calloc(n, s); }
+  void *realloc(void *p, size_t s) { __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED); return __libc_realloc(p, s); }
+  unsigned long egt_bench_malloc_calls(void) { return calls; }
+C
+
+unless ENV['EGT_BENCH_COUNTER']
+  dir = Dir.mktmpdir('exif_geo_tag')
+  File.write(File.join(dir, 'counter.c'), COUNTER)
+  so = File.join(dir, 'counter.so')
+  if system(RbConfig::CONFIG['CC'], '-shared', '-fPIC', '-O2', '-o', so, File.join(dir, 'counter.c'), err: File::NULL)
+    env = { 'LD_PRELOAD' => so, 'EGT_BENCH_COUNTER' => dir, 'RUBYLIB' => $LOAD_PATH.join(File::PATH_SEPARATOR) }
+    exec(env, RbConfig.ruby, __FILE__)
+  end
+  FileUtils.remove_entry(dir)
+end
+
+calls = begin
+          Fiddle::Function.new(Fiddle::Handle::DEFAULT['egt_bench_malloc_calls'], [], Fiddle::TYPE_LONG)
+        rescue Fiddle::DLError
+          nil
+        end
+at_exit { FileUtils.remove_entry(ENV['EGT_BENCH_COUNTER']) } if ENV['EGT_BENCH_COUNTER']
+
+N = 2000
+TAGS = { _latitude: 52.5708272, _longitude: 23.8014078, _timestamp: Time.utc(2017, 5, 4, 10, 20, 30) }.freeze
+
+def per_file(calls)
+  50.times { yield }
+  GC.disable
+  objects = GC.stat(:total_allocated_objects)
+  mallocs = calls&.call
+  N.times { yield }
+  mallocs = (calls.call - mallocs).fdiv(N) if mallocs
+  objects = (GC.stat(:total_allocated_objects) - objects).fdiv(N)
+  GC.enable
+  [mallocs, objects]
+end
+
+Dir.mktmpdir('exif_geo_tag') do |dir|
+  file = JPEGFactory.write_jpeg(File.join(dir, 'photo.jpg'), scan: 30_000)
+  writer = ExifGeoTag::Writer.new
+  in_place = ExifGeoTag::Writer.new(in_place: true)
+  gps = ExifGeoTag::Writer.new(as: :gps)
+  tags = TAGS.dup
+  [['write_tag', -> { ExifGeoTag.write_tag(file, tags) }],
+   ['Writer#write_tag', -> { writer.write_tag(file, tags) }],
+   ['write_tag, in_place', -> { ExifGeoTag.write_tag(file, tags, in_place: true) }],
+   ['Writer#write_tag, in_place', -> { in_place.write_tag(file, tags) }],
+   ['Writer#write_tag, as: :gps', -> { gps.write_tag(file, tags) }]].each do |name, tag|
+    mallocs, objects = per_file(calls, &tag)
+    printf("%-28s %s  %5.1f objects  per file\n", name, mallocs ? format('%5.1f malloc calls', mallocs) : '', objects)
+  end
+end
@@ -0,0 +1,211 @@
+#include "exif_geo_tag.h"
+
+VALUE egt_cCache;
+
+/* ExifGeoTag.cache, which read_tag reads through and the writes invalidate */
+VALUE egt_cache_current;
+
+/*
+ * ExifGeoTag::Cache maps the cache file shared by the processes, which
+ * keeps the GPS fields read by read_tag, packed, by the identity of the file.
+ */
+typedef struct {
+    GPSCache cache;
+} egt_cache_t;
+
+static void egt_cache_free(void *ptr)
+{
+    gps_cache_close(&((egt_cache_t *)ptr)->cache);
+    xfree(ptr);
+}
+
+static size_t egt_cache_memsize(const void *ptr)
+{
+    (void)ptr;
+    return sizeof(egt_cache_t);
+}
+
+static const rb_data_type_t egt_cache_type = {
+    "ExifGeoTag::Cache",
+    {NULL, egt_cache_free, egt_cache_memsize},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * The cache of ExifGeoTag.cache for a call, or NULL. The caller keeps the
+ * object on its stack until the native threads are done with it, so that
+ * the mapping outlives the call even if ExifGeoTag.cache is changed.
+ */
+GPSCache *egt_cache_get(VALUE cache)
+{
+    egt_cache_t *opened;
+
+    if (NIL_P(cache)) {
+        return NULL;
+    }
+    TypedData_Get_Struct(cache, egt_cache_t, &egt_cache_type, opened);
+    return &opened->cache;
+}
+
+/* The identity of the file, which the cache is keyed by. Returns 0 if it is not a regular file */
+int egt_cache_key(const char *path, GPSCacheKey *key)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    memset(key, 0, sizeof(GPSCacheKey));
+    key->dev = (uint64_t)st.st_dev;
+    key->ino = (uint64_t)st.st_ino;
+    key->size = (uint64_t)st.st_size;
+    key->mtime = (int64_t)st.st_mtim.tv_sec * GPS_TRACK_SECOND + st.st_mtim.tv_nsec;
+    key->ctime = (int64_t)st.st_ctim.tv_sec * GPS_TRACK_SECOND + st.st_ctim.tv_nsec;
+    return 1;
+}
+
+/*
+ * Packs the fields into GPS_CACHE_DATA_SIZE bytes: the byte order, then the
+ * index, format, components and data of each field. Returns the size, or 0
+ * if they do not fit.
+ */
+size_t egt_gps_pack(const egt_gps_t *gps, unsigned char *data)
+{
+    size_t size = 1;
+    uint32_t components;
+    int i;
+
+    data[0] = (unsigned char)gps->byte_order;
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        const egt_value_t *value = &gps->values[i];
+
+        if (!(gps->present & EGT_BIT(i))) {
+            continue;
+        }
+        if (value->components > UINT32_MAX || value->size > GPS_CACHE_DATA_SIZE - size - 6) {
+            return 0;
+        }
+        components = (uint32_t)value->components;
+        data[size] = (unsigned char)i;
+        data[size + 1] = (unsigned char)value->format;
+        memcpy(data + size + 2, &components, sizeof(components));
+        memcpy(data + size + 6, value->data, value->size);
+        size += 6 + value->size;
+    }
+    return size;
+}
+
+/* Unpacks the fields packed by egt_gps_pack, returns 0 if they are broken or it runs out of memory */
+int egt_gps_unpack(egt_gps_t *gps, const unsigned char *data, size_t size)
+{
+    size_t pos = 1, len;
+    uint32_t components;
+
+    egt_gps_reset(gps);
+    gps->byte_order = (ExifByteOrder)data[0];
+    while (pos < size) {
+        if (size - pos < 6 || data[pos] >= EGT_TAG_COUNT) {
+            return 0;
+        }
+        memcpy(&components, data + pos + 2, sizeof(components));
+        len = (size_t)exif_format_get_size((ExifFormat)data[pos + 1]) * components;
+        if (len > size - pos - 6 ||
+            !egt_gps_store(gps, data[pos], (ExifFormat)data[pos + 1], components, data + pos + 6)) {
+            return 0;
+        }
+        pos += 6 + len;
+    }
+    return 1;
+}
+
+static VALUE egt_cache_alloc(VALUE klass)
+{
+    egt_cache_t *cache;
+
+    return TypedData_Make_Struct(klass, egt_cache_t, &egt_cache_type, cache);
+}
+
+/*
+ * Cache.new(path, entries: 65536) maps the cache file, which is created for
+ * about that many files when it does not exist. An existing cache keeps its
+ * size. The file may be shared by any number of processes.
+ */
+static VALUE egt_cache_initialize(int argc, VALUE *argv, VALUE self)
+{
+    GPSCache *cache = egt_cache_get(self);
+    VALUE file_path, options, val = Qnil;
+    long entries = 65536;
+
+    rb_scan_args(argc, argv, "11", &file_path, &options);
+    Check_Type(file_path, T_STRING);
+    if (options != Qnil) {
+        Check_Type(options, T_HASH);
+        val = rb_hash_aref(options, egt_sym_entries);
+    }
+    if (val != Qnil) {
+        entries = NUM2LONG(val);
+        if (entries < 1) {
+            rb_raise(rb_eArgError, "entries must be positive, got %ld", entries);
+        }
+    }
+    /* native threads may be reading through the mapping */
+    if (cache->map) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Cache is already open");
+    }
+    if (!gps_cache_open(cache, StringValueCStr(file_path), (size_t)entries)) {
+        if (errno == EINVAL) {
+            rb_raise(rb_eArgError, "not an ExifGeoTag::Cache file: %s", StringValueCStr(file_path));
+        }
+        rb_syserr_fail(errno, StringValueCStr(file_path));
+    }
+    return self;
+}
+
+/* Cache#hits returns the number of read_tag calls answered from the cache by this process */
+static VALUE egt_cache_hits(VALUE self)
+{
+    return ULL2NUM(egt_cache_get(self)->hits);
+}
+
+/* Cache#misses returns the number of read_tag calls, which had to read the file */
+static VALUE egt_cache_misses(VALUE self)
+{
+    return ULL2NUM(egt_cache_get(self)->misses);
+}
+
+/* ExifGeoTag.cache returns the cache read_tag reads through, or nil */
+static VALUE egt_cache(VALUE self)
+{
+    (void)self;
+    return egt_cache_current;
+}
+
+/*
+ * ExifGeoTag.cache = cache makes read_tag read through the cache, and the
+ * write methods drop the entries of the files they write. nil turns it off.
+ */
+static VALUE egt_set_cache(VALUE self, VALUE cache)
+{
+    (void)self;
+    if (cache != Qnil && !egt_cache_get(cache)->map) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Cache is not open");
+    }
+    egt_cache_current = cache;
+    return cache;
+}
+
+void egt_init_cache(void)
+{
+    egt_cCache = rb_define_class_under(egt_mExifGeoTag, "Cache", rb_cObject);
+    rb_define_alloc_func(egt_cCache, egt_cache_alloc);
+    rb_define_method(egt_cCache, "initialize", egt_cache_initialize, -1);
+    rb_define_method(egt_cCache, "hits", egt_cache_hits, 0);
+    rb_define_method(egt_cCache, "misses", egt_cache_misses, 0);
+
+    egt_cache_current = Qnil;
+    rb_global_variable(&egt_cache_current);
+    rb_define_singleton_method(egt_mExifGeoTag, "cache", egt_cache, 0);
+    rb_define_singleton_method(egt_mExifGeoTag, "cache=", egt_set_cache, 1);
+}
@@ -0,0 +1,564 @@
+#include "exif_geo_tag.h"
+
+/*
+ * ExifGeoTag.write_tags_in_dir walks the tree on a pool of native threads
+ * and tags the files found in the mapping. ExifGeoTag::Index walks the
+ * tree the same way to index every file.
+ */
+
+void egt_dir_lock(egt_dir_walk_t *walk)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&walk->lock);
+#else
+    (void)walk;
+#endif
+}
+
+void egt_dir_unlock(egt_dir_walk_t *walk)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&walk->lock);
+#else
+    (void)walk;
+#endif
+}
+
+void egt_dir_wake(egt_dir_walk_t *walk)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_broadcast(&walk->cond);
+#else
+    (void)walk;
+#endif
+}
+
+/* Takes the path, it is freed if the list cannot grow. Returns 0 if it runs out of memory */
+static int egt_dir_list_push(egt_dir_list_t *list, char *path, int err)
+{
+    if (list->count == list->alloc) {
+        size_t alloc = list->alloc ? list->alloc * 2 : 64;
+        egt_dir_path_t *items = realloc(list->items, alloc * sizeof(egt_dir_path_t));
+
+        if (!items) {
+            free(path);
+            return 0;
+        }
+        list->items = items;
+        list->alloc = alloc;
+    }
+    list->items[list->count].path = path;
+    list->items[list->count].err = err;
+    list->count++;
+    return 1;
+}
+
+static void egt_dir_list_clear(egt_dir_list_t *list)
+{
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(egt_dir_list_t));
+}
+
+/* FNV-1a */
+static size_t egt_dir_hash(const char *key)
+{
+    size_t hash = (size_t)14695981039346656037ULL;
+
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * (size_t)1099511628211ULL;
+    }
+    return hash;
+}
+
+static egt_dir_entry_t **egt_dir_slot(egt_dir_walk_t *walk, const char *key)
+{
+    size_t i = egt_dir_hash(key) & walk->table_mask;
+
+    while (walk->table[i] && strcmp(walk->table[i]->key, key) != 0) {
+        i = (i + 1) & walk->table_mask;
+    }
+    return &walk->table[i];
+}
+
+static char *egt_dir_join(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    int sep = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + sep + name_len + 1);
+
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + sep, name, name_len + 1);
+    }
+    return path;
+}
+
+/* Tags the file on the writer of the calling thread, and takes its path */
+static void egt_dir_tag(egt_dir_walk_t *walk, egt_writer_t *writer, egt_dir_file_t *file)
+{
+    egt_job_t *job = &writer->job;
+
+    job->path = file->path;
+    job->plan = file->entry->plan;
+    job->save = file->entry->save;
+    job->options = walk->options;
+    job->cache = walk->cache;
+    egt_gps_reset(&job->prev_values);
+    egt_writer_run(writer);
+    file->entry->status = job->status;
+    file->entry->exif_size = job->exif_size;
+    file->entry->error = job->error;
+    job->path = NULL;
+    free(file->path);
+}
+
+/* Called with the lock held, returns with it held, but the lock is released while the file is visited */
+static void egt_dir_tag_next(egt_dir_walk_t *walk, egt_writer_t *writer)
+{
+    egt_dir_file_t file = walk->queue[walk->queue_head];
+
+    walk->queue_head = (walk->queue_head + 1) % EGT_DIR_QUEUE_SIZE;
+    walk->queued--;
+    egt_dir_unlock(walk);
+    walk->visit(walk, writer, &file);
+    egt_dir_lock(walk);
+}
+
+static void egt_dir_add_file(egt_dir_walk_t *walk, egt_writer_t *writer, char *path)
+{
+    const char *key = path + walk->root_len;
+    egt_dir_entry_t *entry = NULL;
+
+    while (*key == '/') {
+        key++;
+    }
+    if (walk->table) {
+        entry = *egt_dir_slot(walk, key);
+    }
+
+    egt_dir_lock(walk);
+    if (walk->table && !entry) {
+        if (!egt_dir_list_push(&walk->skipped, path, 0)) {
+            walk->nomem = walk->canceled = 1;
+        }
+    } else if ((entry && entry->found) || walk->canceled) {
+        free(path);
+    } else {
+        if (entry) {
+            entry->found = 1;
+        }
+        /* When the queue is full, the walker helps to drain it */
+        while (walk->queued == EGT_DIR_QUEUE_SIZE && !walk->canceled) {
+            egt_dir_tag_next(walk, writer);
+        }
+        if (walk->canceled) {
+            free(path);
+        } else {
+            walk->queue[(walk->queue_head + walk->queued) % EGT_DIR_QUEUE_SIZE].entry = entry;
+            walk->queue[(walk->queue_head + walk->queued) % EGT_DIR_QUEUE_SIZE].path = path;
+            walk->queued++;
+            egt_dir_wake(walk);
+        }
+    }
+    egt_dir_unlock(walk);
+}
+
+/* Lists the directory, subdirectories go to the list of directories and files to the queue */
+static void egt_dir_read(egt_dir_walk_t *walk, egt_writer_t *writer, char *dir_path)
+{
+    struct dirent *ent;
+    struct stat st;
+    char *path;
+    DIR *dir;
+    int is_dir, ok;
+
+    dir = opendir(dir_path);
+    if (!dir) {
+        egt_dir_lock(walk);
+        if (!egt_dir_list_push(&walk->errors, dir_path, errno)) {
+            walk->nomem = walk->canceled = 1;
+        }
+        egt_dir_unlock(walk);
+        return;
+    }
+    while (!walk->canceled && (ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        path = egt_dir_join(dir_path, ent->d_name);
+        if (!path) {
+            walk->nomem = walk->canceled = 1;
+            break;
+        }
+        /* Symbolic links are not followed */
+        if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+            is_dir = ent->d_type == DT_DIR;
+        } else if (ent->d_type == DT_UNKNOWN && lstat(path, &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            is_dir = S_ISDIR(st.st_mode);
+        } else {
+            free(path);
+            continue;
+        }
+        if (!is_dir) {
+            egt_dir_add_file(walk, writer, path);
+            continue;
+        }
+        egt_dir_lock(walk);
+        ok = egt_dir_list_push(&walk->dirs, path, 0);
+        if (!ok) {
+            walk->nomem = walk->canceled = 1;
+        }
+        egt_dir_wake(walk);
+        egt_dir_unlock(walk);
+    }
+    closedir(dir);
+    free(dir_path);
+}
+
+/*
+ * Every thread both walks the tree and tags the files. Files already found
+ * go first, so that the queue stays short, and the walk is over once there
+ * are no directories left and nobody is reading one.
+ */
+static void *egt_dir_worker(void *arg)
+{
+    egt_dir_walk_t *walk = arg;
+    egt_writer_t writer;
+    char *dir_path;
+
+    memset(&writer, 0, sizeof(writer));
+    if (!egt_writer_open(&writer)) {
+        egt_writer_clear(&writer);
+        egt_dir_lock(walk);
+        walk->nomem = walk->canceled = 1;
+        egt_dir_wake(walk);
+        egt_dir_unlock(walk);
+        return NULL;
+    }
+
+    egt_dir_lock(walk);
+    while (!walk->canceled) {
+        if (walk->queued) {
+            egt_dir_tag_next(walk, &writer);
+        } else if (walk->dirs.count) {
+            dir_path = walk->dirs.items[--walk->dirs.count].path;
+            walk->reading++;
+            egt_dir_unlock(walk);
+            egt_dir_read(walk, &writer, dir_path);
+            egt_dir_lock(walk);
+            walk->reading--;
+            egt_dir_wake(walk);
+        } else if (!walk->reading) {
+            break;
+        } else {
+#ifdef HAVE_PTHREAD_H
+            pthread_cond_wait(&walk->cond, &walk->lock);
+#endif
+        }
+    }
+    egt_dir_wake(walk);
+    egt_dir_unlock(walk);
+    egt_writer_clear(&writer);
+    return NULL;
+}
+
+static double egt_dir_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void *egt_dir_run(void *arg)
+{
+    egt_dir_walk_t *walk = arg;
+    double start = egt_dir_now();
+
+    egt_pool_run(egt_dir_worker, walk, walk->nthreads);
+    walk->seconds = egt_dir_now() - start;
+    return NULL;
+}
+
+void egt_dir_cancel(void *arg)
+{
+    egt_dir_walk_t *walk = arg;
+
+    egt_dir_lock(walk);
+    walk->canceled = 1;
+    egt_dir_wake(walk);
+    egt_dir_unlock(walk);
+}
+
+VALUE egt_dir_clear(VALUE arg)
+{
+    egt_dir_walk_t *walk = (egt_dir_walk_t *)arg;
+    long i;
+
+    for (; walk->queued; walk->queued--) {
+        free(walk->queue[walk->queue_head].path);
+        walk->queue_head = (walk->queue_head + 1) % EGT_DIR_QUEUE_SIZE;
+    }
+    if (walk->entries) {
+        for (i = 0; i < walk->count; i++) {
+            free(walk->entries[i].key);
+            if (walk->entries[i].values) {
+                egt_gps_clear(walk->entries[i].values);
+                free(walk->entries[i].values);
+            }
+        }
+        free(walk->entries);
+    }
+    free(walk->queue);
+    free(walk->table);
+    free(walk->root);
+    egt_dir_list_clear(&walk->dirs);
+    egt_dir_list_clear(&walk->skipped);
+    egt_dir_list_clear(&walk->errors);
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&walk->cond);
+    pthread_mutex_destroy(&walk->lock);
+#endif
+    return Qnil;
+}
+
+/*
+ * Sets up the walk of the tree at root, with the table for the mapping of
+ * mapping_size paths, or without a mapping when it is negative. Raises if
+ * the walk cannot be allocated.
+ */
+void egt_dir_walk_init(egt_dir_walk_t *walk, VALUE root, int nthreads, long mapping_size)
+{
+    size_t table_size = 16;
+
+    memset(walk, 0, sizeof(egt_dir_walk_t));
+    walk->nthreads = nthreads;
+    walk->root = egt_strdup(root);
+    walk->root_len = strlen(walk->root);
+    while (walk->root_len > 1 && walk->root[walk->root_len - 1] == '/') {
+        walk->root[--walk->root_len] = 0;
+    }
+    walk->queue = malloc(EGT_DIR_QUEUE_SIZE * sizeof(egt_dir_file_t));
+    if (mapping_size >= 0) {
+        while (table_size < (size_t)mapping_size * 2) {
+            table_size *= 2;
+        }
+        walk->table_mask = table_size - 1;
+        walk->table = calloc(table_size, sizeof(egt_dir_entry_t *));
+        walk->entries = calloc(mapping_size + 1, sizeof(egt_dir_entry_t));
+    }
+    if ((mapping_size >= 0 && (!walk->table || !walk->entries)) || !walk->queue ||
+        !egt_dir_list_push(&walk->dirs, strdup(walk->root), 0) || !walk->dirs.items[0].path) {
+        free(walk->queue);
+        free(walk->table);
+        free(walk->entries);
+        free(walk->root);
+        egt_dir_list_clear(&walk->dirs);
+        rb_raise(rb_eNoMemError, "failed to allocate the walk of %s", RSTRING_PTR(root));
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->cond, NULL);
+#endif
+}
+
+/* Keys are relative to the root, absolute ones may start with it */
+static const char *egt_dir_key(egt_dir_walk_t *walk, VALUE path)
+{
+    const char *key = StringValueCStr(path);
+
+    if (key[0] == '/' && !strncmp(key, walk->root, walk->root_len) && key[walk->root_len] == '/') {
+        key += walk->root_len;
+    }
+    for (;;) {
+        while (*key == '/') {
+            key++;
+        }
+        if (key[0] != '.' || key[1] != '/') {
+            break;
+        }
+        key++;
+    }
+    return key;
+}
+
+static VALUE egt_dir_convert(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_dir_walk_t *walk = (egt_dir_walk_t *)args[0];
+    egt_dir_entry_t *entry = &walk->entries[walk->count], *prev = walk->count > 0 ? entry - 1 : NULL;
+    VALUE file_path = args[1], new_values = args[2];
+    egt_dir_entry_t **slot;
+    const char *key;
+
+    Check_Type(file_path, T_STRING);
+    Check_Type(new_values, T_HASH);
+    key = egt_dir_key(walk, file_path);
+    slot = egt_dir_slot(walk, key);
+    if (*slot) {
+        rb_raise(rb_eArgError, "the same file is given twice: %s", key);
+    }
+
+    entry->status = EGT_ECANCELED;
+    if (prev && args[3] == new_values) {
+        /* the same tags as in the previous pair, reuse its plan */
+        entry->save = prev->save;
+        entry->plan = prev->plan;
+    } else {
+        egt_parse_virtual_fields(new_values);
+        entry->save = RHASH_SIZE(new_values) > 0;
+        entry->values = calloc(1, sizeof(egt_gps_t));
+        if (!entry->values) {
+            rb_raise(rb_eNoMemError, "failed to allocate GPS values");
+        }
+        egt_gps_from_hash(entry->values, new_values);
+        entry->plan = entry->values;
+    }
+    entry->key = strdup(key);
+    if (!entry->key) {
+        rb_raise(rb_eNoMemError, "failed to allocate file path");
+    }
+    *slot = entry;
+    walk->count++;
+    return Qnil;
+}
+
+static int egt_dir_convert_i(VALUE key, VALUE val, VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_dir_walk_t *walk = (egt_dir_walk_t *)args[0];
+    VALUE convert_args[4];
+    int state = 0;
+
+    convert_args[0] = args[0];
+    convert_args[1] = key;
+    convert_args[2] = val;
+    convert_args[3] = args[2];
+    rb_protect(egt_dir_convert, (VALUE)convert_args, &state);
+    if (state) {
+        egt_dir_entry_t *entry = &walk->entries[walk->count];
+
+        if (entry->values) {
+            egt_gps_clear(entry->values);
+            free(entry->values);
+        }
+        memset(entry, 0, sizeof(egt_dir_entry_t));
+        rb_hash_aset(args[1], key, egt_rescued(state));
+        args[2] = Qundef;
+    } else {
+        args[2] = val;
+    }
+    return ST_CONTINUE;
+}
+
+static VALUE egt_dir_paths(const egt_dir_list_t *list, size_t offset)
+{
+    VALUE ary = rb_ary_new_capa((long)list->count);
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        const char *path = list->items[i].path + offset;
+
+        while (*path == '/') {
+            path++;
+        }
+        rb_ary_push(ary, rb_str_new_cstr(path));
+    }
+    return ary;
+}
+
+static VALUE egt_write_tags_in_dir_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_dir_walk_t *walk = (egt_dir_walk_t *)args[0];
+    VALUE failed = rb_hash_new(), missing = rb_ary_new(), report = rb_hash_new(), convert_args[3];
+    long i, tagged = 0;
+    size_t j;
+
+    /* Convert everything up front, so that workers never need Ruby */
+    convert_args[0] = (VALUE)walk;
+    convert_args[1] = failed;
+    convert_args[2] = Qundef;
+    rb_hash_foreach(args[1], egt_dir_convert_i, (VALUE)convert_args);
+
+    egt_call_without_gvl(egt_dir_run, walk, egt_dir_cancel, walk);
+    rb_thread_check_ints();
+    if (walk->nomem) {
+        rb_raise(rb_eNoMemError, "failed to allocate memory for the walk");
+    }
+
+    for (i = 0; i < walk->count; i++) {
+        egt_dir_entry_t *entry = &walk->entries[i];
+        egt_job_t job;
+
+        if (!entry->found) {
+            rb_ary_push(missing, rb_str_new_cstr(entry->key));
+        } else if (entry->status == EGT_OK) {
+            tagged++;
+        } else {
+            memset(&job, 0, sizeof(job));
+            job.path = entry->key;
+            job.status = entry->status;
+            job.exif_size = entry->exif_size;
+            job.error = entry->error;
+            rb_hash_aset(failed, rb_str_new_cstr(entry->key), egt_job_error(&job));
+        }
+    }
+    for (j = 0; j < walk->errors.count; j++) {
+        rb_hash_aset(failed, rb_str_new_cstr(walk->errors.items[j].path),
+                     rb_syserr_new(walk->errors.items[j].err, walk->errors.items[j].path));
+    }
+
+    rb_hash_aset(report, egt_sym_tagged, LONG2NUM(tagged));
+    rb_hash_aset(report, egt_sym_failed, failed);
+    rb_hash_aset(report, egt_sym_skipped, egt_dir_paths(&walk->skipped, walk->root_len));
+    rb_hash_aset(report, egt_sym_missing, missing);
+    rb_hash_aset(report, egt_sym_seconds, DBL2NUM(walk->seconds));
+    rb_hash_aset(report, egt_sym_files_per_second, DBL2NUM(walk->seconds > 0 ? tagged / walk->seconds : 0.0));
+    return report;
+}
+
+/*
+ * ExifGeoTag.write_tags_in_dir(root, {path => tags, ...}, threads: n) tags
+ * the files of the directory tree, which are listed in the mapping by their
+ * paths relative to the root. The tree is walked, and the files are tagged,
+ * on a pool of native threads. Returns the report: the number of tagged
+ * files, failures by path, files of the tree missing in the mapping and
+ * paths of the mapping missing in the tree, and the time taken.
+ */
+static VALUE egt_write_tags_in_dir(int argc, VALUE *argv, VALUE self)
+{
+    egt_dir_walk_t walk;
+    VALUE root, mapping, options, args[2], cache = egt_cache_current, result;
+    unsigned int flags;
+    int nthreads;
+    (void)self;
+
+    rb_scan_args(argc, argv, "21", &root, &mapping, &options);
+    Check_Type(root, T_STRING);
+    Check_Type(mapping, T_HASH);
+
+    flags = egt_parse_options(options);
+    nthreads = egt_batch_threads(options);
+    egt_dir_walk_init(&walk, root, nthreads, RHASH_SIZE(mapping));
+    walk.options = flags;
+    walk.cache = egt_cache_get(cache);
+    walk.visit = egt_dir_tag;
+
+    args[0] = (VALUE)&walk;
+    args[1] = mapping;
+    result = rb_ensure(egt_write_tags_in_dir_body, (VALUE)args, egt_dir_clear, (VALUE)&walk);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+void egt_init_dir(void)
+{
+    rb_define_singleton_method(egt_mExifGeoTag, "write_tags_in_dir", egt_write_tags_in_dir, -1);
+}
@@ -0,0 +1,529 @@
+#include "exif_geo_tag.h"
+
+VALUE egt_cIndex;
+
+/*
+ * ExifGeoTag::Index maps the index file of a photo archive. The file is
+ * written by walking the tree on a pool of native threads, and is only
+ * read afterwards, so queries need no locks.
+ */
+typedef struct {
+    GeoIndex index;
+    char *path;
+    /* the records are read without GVL while the index is updated */
+    int busy;
+} egt_index_t;
+
+static void egt_index_free(void *ptr)
+{
+    egt_index_t *index = ptr;
+
+    geo_index_close(&index->index);
+    free(index->path);
+    xfree(ptr);
+}
+
+static size_t egt_index_memsize(const void *ptr)
+{
+    const egt_index_t *index = ptr;
+
+    return sizeof(egt_index_t) + (index->index.mapped ? 0 : index->index.map_size);
+}
+
+static const rb_data_type_t egt_index_type = {
+    "ExifGeoTag::Index",
+    {NULL, egt_index_free, egt_index_memsize},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE egt_index_alloc(VALUE klass)
+{
+    egt_index_t *index;
+
+    return TypedData_Make_Struct(klass, egt_index_t, &egt_index_type, index);
+}
+
+static egt_index_t *egt_index_get(VALUE self)
+{
+    egt_index_t *index;
+
+    TypedData_Get_Struct(self, egt_index_t, &egt_index_type, index);
+    return index;
+}
+
+static egt_index_t *egt_index_opened(VALUE self)
+{
+    egt_index_t *index = egt_index_get(self);
+
+    if (!index->index.map) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Index is not open");
+    }
+    return index;
+}
+
+typedef struct {
+    GeoIndex index;
+    const char *path;
+    int ok;
+    int err;
+} egt_index_open_t;
+
+static void *egt_index_open_run(void *arg)
+{
+    egt_index_open_t *open = arg;
+
+    open->ok = geo_index_open(&open->index, open->path);
+    open->err = errno;
+    return NULL;
+}
+
+/* Maps the index file, which is checked through, so it is done without GVL. Returns 0 with errno set on failure */
+static int egt_index_open(GeoIndex *index, const char *path)
+{
+    egt_index_open_t open;
+
+    open.path = path;
+    egt_call_without_gvl(egt_index_open_run, &open, NULL, NULL);
+    if (!open.ok) {
+        errno = open.err;
+        return 0;
+    }
+    *index = open.index;
+    return 1;
+}
+
+static void egt_index_fail(int err, const char *path)
+{
+    if (err == EINVAL) {
+        rb_raise(rb_eArgError, "not an ExifGeoTag::Index file: %s", path);
+    }
+    rb_syserr_fail(err, path);
+}
+
+/* Index.new(path) maps the index file written by Index.build */
+static VALUE egt_index_initialize(VALUE self, VALUE file_path)
+{
+    egt_index_t *index = egt_index_get(self);
+    GeoIndex opened;
+    char *path;
+
+    Check_Type(file_path, T_STRING);
+    if (index->busy) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Index is in use");
+    }
+    path = egt_strdup(file_path);
+    if (!egt_index_open(&opened, path)) {
+        int err = errno;
+
+        free(path);
+        egt_index_fail(err, StringValueCStr(file_path));
+    }
+    geo_index_close(&index->index);
+    free(index->path);
+    index->index = opened;
+    index->path = path;
+    return self;
+}
+
+/* Reads the position and the capture time of the photo, only the headers up to the EXIF segment */
+static void egt_index_read(const char *path, egt_gps_t *gps, GeoIndexRecord *record)
+{
+    unsigned char *app1;
+    unsigned int size = 0;
+
+    app1 = egt_read_app1(path, &size);
+    if (!app1) {
+        return;
+    }
+    egt_gps_reset(gps);
+    if (egt_gps_from_tiff(gps, app1 + 6, size - 6) && egt_gps_position(gps, &record->lat, &record->lon)) {
+        record->cell = geo_index_cell(record->lat, record->lon);
+        record->flags |= GEO_INDEX_POSITION;
+    }
+    if (egt_capture_time_from_tiff(app1 + 6, size - 6, &record->time) == EGT_OK) {
+        record->flags |= GEO_INDEX_TIME;
+    }
+    free(app1);
+}
+
+typedef struct {
+    egt_dir_walk_t walk;
+    egt_index_t *index;
+    /* the records of the index, which are taken for the files not changed since */
+    const GeoIndex *old;
+    GeoIndexBuilder builder;
+    /* the index file itself, when it is in the tree */
+    struct stat self;
+    int has_self;
+    long read;
+    long kept;
+    long changed;
+    int saved;
+    int err;
+} egt_index_update_t;
+
+/* Every file of the tree becomes a record, so that the next update knows it has been read */
+static void egt_index_visit(egt_dir_walk_t *walk, egt_writer_t *writer, egt_dir_file_t *file)
+{
+    egt_index_update_t *update = walk->data;
+    const char *key = file->path + walk->root_len;
+    const GeoIndexRecord *old = NULL;
+    GeoIndexRecord record;
+    struct stat st;
+    int64_t mtime, ctime;
+    int kept = 0;
+
+    while (*key == '/') {
+        key++;
+    }
+    if (lstat(file->path, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (update->has_self && st.st_dev == update->self.st_dev && st.st_ino == update->self.st_ino)) {
+        /* gone since the directory was read, or the index */
+        free(file->path);
+        return;
+    }
+    mtime = (int64_t)st.st_mtim.tv_sec * GPS_TRACK_SECOND + st.st_mtim.tv_nsec;
+    ctime = (int64_t)st.st_ctim.tv_sec * GPS_TRACK_SECOND + st.st_ctim.tv_nsec;
+    if (update->old) {
+        old = geo_index_find(update->old, key);
+    }
+    if (old && old->ino == (uint64_t)st.st_ino && old->size == (uint64_t)st.st_size && old->mtime == mtime &&
+        old->ctime == ctime) {
+        record = *old;
+        kept = 1;
+    } else {
+        memset(&record, 0, sizeof(record));
+        record.cell = GEO_INDEX_NO_CELL;
+        record.mtime = mtime;
+        record.ctime = ctime;
+        record.ino = st.st_ino;
+        record.size = st.st_size;
+        egt_index_read(file->path, &writer->job.prev_values, &record);
+    }
+
+    egt_dir_lock(walk);
+    if (!geo_index_builder_add(&update->builder, &record, key)) {
+        walk->nomem = walk->canceled = 1;
+        egt_dir_wake(walk);
+    } else if (kept) {
+        update->kept++;
+    } else {
+        update->read++;
+        update->changed += old != NULL;
+    }
+    egt_dir_unlock(walk);
+    free(file->path);
+}
+
+static void *egt_index_run(void *arg)
+{
+    egt_index_update_t *update = arg;
+
+    egt_dir_run(&update->walk);
+    if (!update->walk.canceled) {
+        update->saved = geo_index_builder_write(&update->builder, update->index->path);
+        update->err = errno;
+    }
+    return NULL;
+}
+
+static VALUE egt_index_update_body(VALUE arg)
+{
+    egt_index_update_t *update = (egt_index_update_t *)arg;
+    egt_index_t *index = update->index;
+    VALUE failed = rb_hash_new(), report = rb_hash_new();
+    long removed = 0;
+    GeoIndex opened;
+    size_t i;
+
+    egt_call_without_gvl(egt_index_run, update, egt_dir_cancel, &update->walk);
+    rb_thread_check_ints();
+    if (update->walk.nomem) {
+        rb_raise(rb_eNoMemError, "failed to allocate memory for the index");
+    }
+    if (!update->saved) {
+        egt_index_fail(update->err, index->path);
+    }
+    if (update->old) {
+        removed = (long)update->old->count - update->kept - update->changed;
+    }
+
+    /* the new file replaces the old one, which stays mapped until now */
+    if (!egt_index_open(&opened, index->path)) {
+        egt_index_fail(errno, index->path);
+    }
+    geo_index_close(&index->index);
+    index->index = opened;
+
+    for (i = 0; i < update->walk.errors.count; i++) {
+        rb_hash_aset(failed, rb_str_new_cstr(update->walk.errors.items[i].path),
+                     rb_syserr_new(update->walk.errors.items[i].err, update->walk.errors.items[i].path));
+    }
+    rb_hash_aset(report, egt_sym_indexed, SIZET2NUM(index->index.count));
+    rb_hash_aset(report, egt_sym_read, LONG2NUM(update->read));
+    rb_hash_aset(report, egt_sym_kept, LONG2NUM(update->kept));
+    rb_hash_aset(report, egt_sym_removed, LONG2NUM(removed));
+    rb_hash_aset(report, egt_sym_failed, failed);
+    rb_hash_aset(report, egt_sym_seconds, DBL2NUM(update->walk.seconds));
+    return report;
+}
+
+static VALUE egt_index_update_clear(VALUE arg)
+{
+    egt_index_update_t *update = (egt_index_update_t *)arg;
+
+    update->index->busy = 0;
+    egt_dir_clear((VALUE)&update->walk);
+    geo_index_builder_clear(&update->builder);
+    return Qnil;
+}
+
+/*
+ * Walks the tree at root and writes the index to the path of the index,
+ * taking the records of its mapped files, which have the same inode, size,
+ * modification and change times, instead of reading them again.
+ */
+static VALUE egt_index_write(VALUE self, VALUE root, VALUE options)
+{
+    egt_index_t *index = egt_index_get(self);
+    egt_index_update_t update;
+    int nthreads;
+
+    if (options != Qnil) {
+        Check_Type(options, T_HASH);
+    }
+    nthreads = egt_batch_threads(options);
+    if (index->busy) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Index is in use");
+    }
+
+    memset(&update, 0, sizeof(update));
+    egt_dir_walk_init(&update.walk, root, nthreads, -1);
+    update.walk.visit = egt_index_visit;
+    update.walk.data = &update;
+    update.index = index;
+    update.old = index->index.map ? &index->index : NULL;
+    update.has_self = stat(index->path, &update.self) == 0;
+    update.err = EINTR;
+    if (!geo_index_builder_init(&update.builder, update.walk.root)) {
+        egt_dir_clear((VALUE)&update.walk);
+        rb_raise(rb_eNoMemError, "failed to allocate the index of %s", RSTRING_PTR(root));
+    }
+    index->busy = 1;
+    return rb_ensure(egt_index_update_body, (VALUE)&update, egt_index_update_clear, (VALUE)&update);
+}
+
+/* The root without trailing slashes, as the walk keeps it */
+static int egt_index_same_root(const char *indexed, VALUE root)
+{
+    long len = RSTRING_LEN(root);
+
+    while (len > 1 && RSTRING_PTR(root)[len - 1] == '/') {
+        len--;
+    }
+    return (long)strlen(indexed) == len && !memcmp(indexed, RSTRING_PTR(root), len);
+}
+
+/*
+ * Index.build(path, root, threads: n) indexes the photos of the tree at
+ * root into the file at path, and returns the index. When the file is an
+ * index of the same tree already, only the files changed since are read.
+ * Any other file at the path is left alone.
+ */
+static VALUE egt_index_s_build(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE file_path, root, options, self;
+    egt_index_t *index;
+
+    rb_scan_args(argc, argv, "21", &file_path, &root, &options);
+    Check_Type(file_path, T_STRING);
+    Check_Type(root, T_STRING);
+
+    self = rb_obj_alloc(klass);
+    index = egt_index_get(self);
+    index->path = egt_strdup(file_path);
+    if (!egt_index_open(&index->index, index->path)) {
+        if (errno != ENOENT) {
+            egt_index_fail(errno, index->path);
+        }
+    } else if (!egt_index_same_root(index->index.root, root)) {
+        geo_index_close(&index->index);
+    }
+    egt_index_write(self, root, options);
+    return self;
+}
+
+/*
+ * Index#update(threads: n) walks the tree again, reads the files added or
+ * changed since the index was written, and drops the files removed since.
+ * Returns the report: the number of files indexed, read and kept, removed,
+ * the directories, which could not be read, and the time taken.
+ */
+static VALUE egt_index_update(int argc, VALUE *argv, VALUE self)
+{
+    egt_index_t *index = egt_index_opened(self);
+    VALUE options;
+
+    rb_scan_args(argc, argv, "01", &options);
+    return egt_index_write(self, rb_str_new_cstr(index->index.root), options);
+}
+
+static VALUE egt_index_size(VALUE self)
+{
+    return SIZET2NUM(egt_index_opened(self)->index.count);
+}
+
+static VALUE egt_index_root(VALUE self)
+{
+    return rb_str_new_cstr(egt_index_opened(self)->index.root);
+}
+
+/* The time: option of a query, a Range of Times or seconds since the epoch. NULL without it */
+static const GeoIndexTimes *egt_index_times(VALUE options, GeoIndexTimes *times)
+{
+    VALUE range, begin, end;
+    int exclude_end;
+
+    if (options == Qnil) {
+        return NULL;
+    }
+    Check_Type(options, T_HASH);
+    range = rb_hash_aref(options, egt_sym_time);
+    if (range == Qnil) {
+        return NULL;
+    }
+    if (!rb_range_values(range, &begin, &end, &exclude_end)) {
+        rb_raise(rb_eTypeError, "expected a Range of times, but got %" PRIsVALUE, rb_obj_class(range));
+    }
+    times->from = begin == Qnil ? INT64_MIN : egt_time_to_nanos(begin);
+    times->to = end == Qnil ? INT64_MAX : egt_time_to_nanos(end);
+    if (exclude_end && end != Qnil) {
+        times->to--;
+    }
+    return times;
+}
+
+typedef struct {
+    egt_index_t *index;
+    GeoIndexResult result;
+} egt_index_query_t;
+
+static VALUE egt_index_query_paths(VALUE arg)
+{
+    egt_index_query_t *query = (egt_index_query_t *)arg;
+    const GeoIndex *index = &query->index->index;
+    size_t root_len = strlen(index->root), i;
+    int sep = root_len > 0 && index->root[root_len - 1] != '/';
+    VALUE paths = rb_ary_new_capa((long)query->result.count);
+
+    for (i = 0; i < query->result.count; i++) {
+        const char *path = geo_index_path(index, &index->records[query->result.items[i]]);
+        size_t len = strlen(path);
+        VALUE str = rb_str_buf_new((long)(root_len + sep + len));
+
+        rb_str_buf_cat(str, index->root, (long)root_len);
+        if (sep) {
+            rb_str_buf_cat(str, "/", 1);
+        }
+        rb_str_buf_cat(str, path, (long)len);
+        rb_ary_push(paths, str);
+    }
+    return paths;
+}
+
+static VALUE egt_index_query_clear(VALUE arg)
+{
+    geo_index_result_clear(&((egt_index_query_t *)arg)->result);
+    return Qnil;
+}
+
+/* The paths of the records found, or NoMemoryError when the query ran out of memory */
+static VALUE egt_index_query_result(egt_index_query_t *query, int ok)
+{
+    if (!ok) {
+        geo_index_result_clear(&query->result);
+        rb_raise(rb_eNoMemError, "failed to allocate the result of the query");
+    }
+    return rb_ensure(egt_index_query_paths, (VALUE)query, egt_index_query_clear, (VALUE)query);
+}
+
+/*
+ * Index#near(latitude, longitude, radius, time: nil) returns the paths of
+ * the photos not farther than radius meters from the point, taken within
+ * the Range of times, if given.
+ */
+static VALUE egt_index_near(int argc, VALUE *argv, VALUE self)
+{
+    egt_index_query_t query;
+    GeoIndexTimes times;
+    const GeoIndexTimes *limit;
+    VALUE lat, lon, radius, options;
+    double lat_value, lon_value, radius_value;
+
+    rb_scan_args(argc, argv, "31", &lat, &lon, &radius, &options);
+    lat_value = NUM2DBL(lat);
+    lon_value = NUM2DBL(lon);
+    radius_value = NUM2DBL(radius);
+    limit = egt_index_times(options, &times);
+
+    memset(&query, 0, sizeof(query));
+    query.index = egt_index_opened(self);
+    return egt_index_query_result(
+        &query, geo_index_near(&query.index->index, lat_value, lon_value, radius_value, limit, &query.result));
+}
+
+/*
+ * Index#within(south, west, north, east, time: nil) returns the paths of
+ * the photos inside the box, which crosses the antimeridian when west is
+ * greater than east, taken within the Range of times, if given.
+ */
+static VALUE egt_index_within(int argc, VALUE *argv, VALUE self)
+{
+    egt_index_query_t query;
+    GeoIndexTimes times;
+    const GeoIndexTimes *limit;
+    VALUE south, west, north, east, options;
+    double box[4];
+
+    rb_scan_args(argc, argv, "41", &south, &west, &north, &east, &options);
+    box[0] = NUM2DBL(south);
+    box[1] = NUM2DBL(west);
+    box[2] = NUM2DBL(north);
+    box[3] = NUM2DBL(east);
+    limit = egt_index_times(options, &times);
+
+    memset(&query, 0, sizeof(query));
+    query.index = egt_index_opened(self);
+    return egt_index_query_result(
+        &query, geo_index_within(&query.index->index, box[0], box[1], box[2], box[3], limit, &query.result));
+}
+
+/* Index#between(from, to) returns the paths of the photos taken from from to to, in the order of time */
+static VALUE egt_index_between(VALUE self, VALUE from, VALUE to)
+{
+    egt_index_query_t query;
+    GeoIndexTimes times;
+
+    times.from = egt_time_to_nanos(from);
+    times.to = egt_time_to_nanos(to);
+
+    memset(&query, 0, sizeof(query));
+    query.index = egt_index_opened(self);
+    return egt_index_query_result(&query, geo_index_between(&query.index->index, &times, &query.result));
+}
+
+void egt_init_index(void)
+{
+    egt_cIndex = rb_define_class_under(egt_mExifGeoTag, "Index", rb_cObject);
+    rb_define_alloc_func(egt_cIndex, egt_index_alloc);
+    rb_define_singleton_method(egt_cIndex, "build", egt_index_s_build, -1);
+    rb_define_method(egt_cIndex, "initialize", egt_index_initialize, 1);
+    rb_define_method(egt_cIndex, "update", egt_index_update, -1);
+    rb_define_method(egt_cIndex, "size", egt_index_size, 0);
+    rb_define_method(egt_cIndex, "root", egt_index_root, 0);
+    rb_define_method(egt_cIndex, "near", egt_index_near, -1);
+    rb_define_method(egt_cIndex, "within", egt_index_within, -1);
+    rb_define_method(egt_cIndex, "between", egt_index_between, 2);
+}
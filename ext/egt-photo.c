@@ -0,0 +1,196 @@
+#include "exif_geo_tag.h"
+
+/* The batch of photos behind Track#write_tags and ExifGeoTag.read_capture_times */
+
+egt_photo_t *egt_photo_next(egt_photo_batch_t *batch)
+{
+    egt_photo_t *photo = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&batch->lock);
+#endif
+    while (!photo && !batch->canceled && batch->next < batch->count) {
+        photo = &batch->photos[batch->next++];
+        if (!photo->path) {
+            /* conversion of this path has failed already */
+            photo = NULL;
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    return photo;
+}
+
+static void *egt_photo_run(void *arg)
+{
+    egt_photo_batch_t *batch = arg;
+
+    egt_pool_run(batch->worker, batch, batch->nthreads);
+    return NULL;
+}
+
+static void egt_photo_cancel(void *arg)
+{
+    egt_photo_batch_t *batch = arg;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&batch->lock);
+#endif
+    batch->canceled = 1;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&batch->lock);
+#endif
+}
+
+/* Sets up the batch of count photos, raises if they cannot be allocated */
+void egt_photo_batch_init(egt_photo_batch_t *batch, long count, int nthreads)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->nthreads = nthreads;
+    batch->count = count;
+    if (batch->nthreads > batch->count) {
+        batch->nthreads = batch->count > 0 ? (int)batch->count : 1;
+    }
+    batch->photos = calloc(batch->count > 0 ? batch->count : 1, sizeof(egt_photo_t));
+    if (!batch->photos) {
+        rb_raise(rb_eNoMemError, "failed to allocate %ld photos", batch->count);
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&batch->lock, NULL);
+#endif
+}
+
+static VALUE egt_photo_batch_clear(VALUE arg)
+{
+    egt_photo_batch_t *batch = (egt_photo_batch_t *)arg;
+    long i;
+
+    if (batch->track) {
+        batch->track->busy = 0;
+    }
+    for (i = 0; i < batch->count; i++) {
+        free(batch->photos[i].path);
+    }
+    free(batch->photos);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&batch->lock);
+#endif
+    return Qnil;
+}
+
+static VALUE egt_photo_convert(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_photo_t *photo = (egt_photo_t *)args[0];
+
+    Check_Type(args[1], T_STRING);
+    photo->path = egt_strdup(args[1]);
+    return Qnil;
+}
+
+static VALUE egt_photo_batch_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_photo_batch_t *batch = (egt_photo_batch_t *)args[0];
+    VALUE paths = args[1], results;
+    long i;
+
+    results = rb_ary_new_capa(batch->count);
+    /* Copy the paths up front, so that workers never need Ruby */
+    for (i = 0; i < batch->count; i++) {
+        VALUE convert_args[2];
+        int state = 0;
+
+        batch->photos[i].status = EGT_ECANCELED;
+        convert_args[0] = (VALUE)&batch->photos[i];
+        convert_args[1] = rb_ary_entry(paths, i);
+        rb_protect(egt_photo_convert, (VALUE)convert_args, &state);
+        if (state) {
+            rb_ary_store(results, i, egt_rescued(state));
+        }
+    }
+
+    egt_call_without_gvl(egt_photo_run, batch, egt_photo_cancel, batch);
+    rb_thread_check_ints();
+
+    for (i = 0; i < batch->count; i++) {
+        egt_photo_t *photo = &batch->photos[i];
+        egt_job_t job;
+
+        if (!photo->path) {
+            continue;
+        }
+        if (photo->status != EGT_OK) {
+            memset(&job, 0, sizeof(job));
+            job.path = photo->path;
+            job.status = photo->status;
+            job.exif_size = photo->exif_size;
+            job.error = photo->error;
+            rb_ary_store(results, i, egt_job_error(&job));
+            continue;
+        }
+        rb_ary_store(results, i, batch->result(photo));
+    }
+    return results;
+}
+
+/* Runs the batch over the paths, returns the results in the same order */
+VALUE egt_photo_batch_run(egt_photo_batch_t *batch, VALUE paths)
+{
+    VALUE args[2];
+
+    args[0] = (VALUE)batch;
+    args[1] = paths;
+    return rb_ensure(egt_photo_batch_body, (VALUE)args, egt_photo_batch_clear, (VALUE)batch);
+}
+
+/* Each worker reads just the headers of the photos up to the EXIF segment */
+static void *egt_capture_time_worker(void *arg)
+{
+    egt_photo_batch_t *batch = arg;
+    egt_photo_t *photo;
+
+    while ((photo = egt_photo_next(batch)) != NULL) {
+        unsigned char *app1;
+        unsigned int size = 0;
+
+        app1 = egt_read_app1(photo->path, &size);
+        photo->status = app1 ? egt_capture_time_from_tiff(app1 + 6, size - 6, &photo->fix.time) : EGT_ENOEXIF;
+        free(app1);
+    }
+    return NULL;
+}
+
+static VALUE egt_capture_time_result(egt_photo_t *photo)
+{
+    return LL2NUM(photo->fix.time);
+}
+
+/*
+ * ExifGeoTag.read_capture_times(paths, threads: n) reads DateTimeOriginal,
+ * SubSecTimeOriginal and OffsetTimeOriginal of each photo on a pool of
+ * native threads. Returns nanoseconds since the epoch (or exception objects
+ * for the files without a capture time) in the same order as the paths.
+ */
+static VALUE egt_read_capture_times(int argc, VALUE *argv, VALUE self)
+{
+    egt_photo_batch_t batch;
+    VALUE paths, options;
+
+    rb_scan_args(argc, argv, "11", &paths, &options);
+    Check_Type(paths, T_ARRAY);
+    if (options != Qnil) {
+        Check_Type(options, T_HASH);
+    }
+
+    egt_photo_batch_init(&batch, RARRAY_LEN(paths), egt_batch_threads(options));
+    batch.worker = egt_capture_time_worker;
+    batch.result = egt_capture_time_result;
+    return egt_photo_batch_run(&batch, paths);
+}
+
+void egt_init_photo(void)
+{
+    rb_define_singleton_method(egt_mExifGeoTag, "read_capture_times", egt_read_capture_times, -1);
+}
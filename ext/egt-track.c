@@ -0,0 +1,476 @@
+#include "exif_geo_tag.h"
+
+VALUE egt_cTrack;
+
+static void egt_track_free(void *ptr)
+{
+    gps_track_clear(&((egt_track_t *)ptr)->track);
+    xfree(ptr);
+}
+
+static size_t egt_track_memsize(const void *ptr)
+{
+    const egt_track_t *track = ptr;
+
+    return sizeof(egt_track_t) + track->track.alloc * (sizeof(int64_t) + 3 * sizeof(double));
+}
+
+static const rb_data_type_t egt_track_type = {
+    "ExifGeoTag::Track",
+    {NULL, egt_track_free, egt_track_memsize},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE egt_track_alloc(VALUE klass)
+{
+    egt_track_t *track;
+    VALUE self = TypedData_Make_Struct(klass, egt_track_t, &egt_track_type, track);
+
+    gps_track_init(&track->track);
+    return self;
+}
+
+static egt_track_t *egt_track_get(VALUE self)
+{
+    egt_track_t *track;
+
+    TypedData_Get_Struct(self, egt_track_t, &egt_track_type, track);
+    return track;
+}
+
+/*
+ * Returns the track, unless a load or a batch is using it: the points may
+ * be reallocated without GVL, and a parse keeps indexes into them. Nothing
+ * may call Ruby between this and the use of the points.
+ */
+static egt_track_t *egt_track_idle(VALUE self)
+{
+    egt_track_t *track = egt_track_get(self);
+
+    if (track->busy) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Track is in use");
+    }
+    return track;
+}
+
+/* Returns the idle track with its points sorted by time */
+static egt_track_t *egt_track_sorted(VALUE self)
+{
+    egt_track_t *track = egt_track_idle(self);
+
+    if (!gps_track_sort(&track->track)) {
+        rb_raise(rb_eNoMemError, "failed to sort %zu track points", track->track.count);
+    }
+    return track;
+}
+
+/* Time or Numeric seconds since the epoch, in nanoseconds */
+int64_t egt_time_to_nanos(VALUE val)
+{
+    struct timespec ts = rb_time_timespec(val);
+
+    if (ts.tv_sec <= -(INT64_MAX / GPS_TRACK_SECOND) || ts.tv_sec >= INT64_MAX / GPS_TRACK_SECOND) {
+        rb_raise(rb_eRangeError, "time out of range: %+" PRIsVALUE, val);
+    }
+    return (int64_t)ts.tv_sec * GPS_TRACK_SECOND + ts.tv_nsec;
+}
+
+static VALUE egt_time_from_nanos(int64_t time)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(time / GPS_TRACK_SECOND);
+    ts.tv_nsec = (long)(time % GPS_TRACK_SECOND);
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += GPS_TRACK_SECOND;
+    }
+    return rb_time_timespec_new(&ts, INT_MAX - 1);
+}
+
+/* Numeric seconds in nanoseconds, the default for nil */
+static int64_t egt_seconds_to_nanos(VALUE val, int64_t default_value)
+{
+    double seconds;
+
+    if (val == Qnil) {
+        return default_value;
+    }
+    seconds = NUM2DBL(val);
+    if (!(fabs(seconds) < (double)(INT64_MAX / GPS_TRACK_SECOND))) {
+        rb_raise(rb_eRangeError, "seconds out of range: %+" PRIsVALUE, val);
+    }
+    return (int64_t)llround(seconds * (double)GPS_TRACK_SECOND);
+}
+
+/* Track#add(time, latitude, longitude, altitude = nil) */
+static VALUE egt_track_add(int argc, VALUE *argv, VALUE self)
+{
+    egt_track_t *track;
+    VALUE time, lat, lon, alt;
+    int64_t nanos;
+    double latitude, longitude, altitude;
+
+    rb_scan_args(argc, argv, "31", &time, &lat, &lon, &alt);
+    nanos = egt_time_to_nanos(time);
+    latitude = NUM2DBL(lat);
+    longitude = NUM2DBL(lon);
+    /* also refuses NaN */
+    if (!(fabs(latitude) <= 90.0)) {
+        rb_raise(rb_eArgError, "latitude out of range: %" PRIsVALUE, lat);
+    }
+    if (!(fabs(longitude) <= 180.0)) {
+        rb_raise(rb_eArgError, "longitude out of range: %" PRIsVALUE, lon);
+    }
+    altitude = alt == Qnil ? NAN : NUM2DBL(alt);
+    track = egt_track_idle(self);
+    if (!gps_track_append(&track->track, nanos, latitude, longitude, altitude)) {
+        rb_raise(rb_eNoMemError, "failed to allocate %zu track points", track->track.count + 1);
+    }
+    return self;
+}
+
+/* Track.new(points = []), each point being [time, latitude, longitude, altitude = nil] */
+static VALUE egt_track_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE points, point;
+    long i;
+
+    rb_scan_args(argc, argv, "01", &points);
+    if (points == Qnil) {
+        return self;
+    }
+    Check_Type(points, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN(points); i++) {
+        point = rb_ary_entry(points, i);
+        Check_Type(point, T_ARRAY);
+        if (RARRAY_LEN(point) < 3 || RARRAY_LEN(point) > 4) {
+            rb_raise(rb_eArgError, "expected [time, latitude, longitude, altitude] point, but got %ld items",
+                     RARRAY_LEN(point));
+        }
+        egt_track_add((int)RARRAY_LEN(point), (VALUE *)RARRAY_CONST_PTR(point), self);
+    }
+    return self;
+}
+
+static VALUE egt_track_size(VALUE self)
+{
+    return SIZET2NUM(egt_track_idle(self)->track.count);
+}
+
+/* Track#[](index) returns the point as [time, latitude, longitude, altitude], in the order of time */
+static VALUE egt_track_aref(VALUE self, VALUE index)
+{
+    long i = NUM2LONG(index);
+    egt_track_t *track = egt_track_sorted(self);
+
+    if (i < 0) {
+        i += (long)track->track.count;
+    }
+    if (i < 0 || (size_t)i >= track->track.count) {
+        return Qnil;
+    }
+    return rb_ary_new_from_args(4, egt_time_from_nanos(track->track.time[i]), DBL2NUM(track->track.lat[i]),
+                                DBL2NUM(track->track.lon[i]),
+                                isnan(track->track.alt[i]) ? Qnil : DBL2NUM(track->track.alt[i]));
+}
+
+/* The virtual fields write_tag takes */
+static VALUE egt_fix_to_hash(const GPSFix *fix)
+{
+    VALUE values = rb_hash_new();
+
+    rb_hash_aset(values, egt_sym__latitude, DBL2NUM(fix->lat));
+    rb_hash_aset(values, egt_sym__longitude, DBL2NUM(fix->lon));
+    if (!isnan(fix->alt)) {
+        rb_hash_aset(values, egt_sym__altitude, DBL2NUM(fix->alt));
+    }
+    rb_hash_aset(values, egt_sym__timestamp, egt_time_from_nanos(fix->time));
+    return values;
+}
+
+static int64_t egt_track_max_gap(VALUE options)
+{
+    int64_t max_gap = egt_seconds_to_nanos(options == Qnil ? Qnil : rb_hash_aref(options, egt_sym_max_gap),
+                                           60 * GPS_TRACK_SECOND);
+
+    if (max_gap < 0) {
+        rb_raise(rb_eArgError, "negative max_gap");
+    }
+    return max_gap;
+}
+
+/*
+ * Track#locate(time, max_gap: 60) returns the position at the time, as the
+ * hash of virtual fields, or nil if the track does not cover it.
+ */
+static VALUE egt_track_locate(int argc, VALUE *argv, VALUE self)
+{
+    VALUE time, options;
+    int64_t max_gap, nanos;
+    GPSFix fix;
+
+    rb_scan_args(argc, argv, "11", &time, &options);
+    if (options != Qnil) {
+        Check_Type(options, T_HASH);
+    }
+    max_gap = egt_track_max_gap(options);
+    nanos = egt_time_to_nanos(time);
+    if (!gps_track_locate(&egt_track_sorted(self)->track, nanos, max_gap, &fix)) {
+        return Qnil;
+    }
+    return egt_fix_to_hash(&fix);
+}
+
+static GPSParseFormat egt_track_format(VALUE options)
+{
+    VALUE val;
+
+    if (options == Qnil) {
+        return GPS_PARSE_AUTO;
+    }
+    Check_Type(options, T_HASH);
+    val = rb_hash_aref(options, egt_sym_format);
+    if (val == Qnil) {
+        return GPS_PARSE_AUTO;
+    }
+    if (val == egt_sym_gpx) {
+        return GPS_PARSE_GPX;
+    }
+    if (val == egt_sym_kml) {
+        return GPS_PARSE_KML;
+    }
+    if (val == egt_sym_nmea) {
+        return GPS_PARSE_NMEA;
+    }
+    rb_raise(rb_eArgError, "unknown track format %+" PRIsVALUE ", expected :gpx, :kml or :nmea", val);
+    return GPS_PARSE_AUTO;
+}
+
+typedef struct {
+    egt_track_t *track;
+    GPSParser parser;
+    VALUE source;
+    int fd;
+    char *buf;
+    int err;
+    int done;
+    volatile int canceled;
+} egt_track_load_t;
+
+/* Parses the log file in chunks until it is done or canceled, runs without GVL */
+static void *egt_track_load_file(void *arg)
+{
+    egt_track_load_t *load = arg;
+    ssize_t n;
+
+    while (!load->canceled) {
+        n = read(load->fd, load->buf, EGT_STREAM_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            load->err = errno;
+            break;
+        }
+        if (n == 0) {
+            load->done = gps_parser_finish(&load->parser);
+            break;
+        }
+        if (!gps_parser_feed(&load->parser, load->buf, (size_t)n)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void egt_track_load_cancel(void *arg)
+{
+    ((egt_track_load_t *)arg)->canceled = 1;
+}
+
+static VALUE egt_track_load_body(VALUE arg)
+{
+    egt_track_load_t *load = (egt_track_load_t *)arg;
+    VALUE chunk;
+
+    if (load->fd >= 0) {
+        /* Interrupts, which do not raise, resume the parse */
+        do {
+            load->canceled = 0;
+            egt_call_without_gvl(egt_track_load_file, load, egt_track_load_cancel, load);
+            rb_thread_check_ints();
+        } while (load->canceled);
+        if (load->err) {
+            rb_syserr_fail_str(load->err, load->source);
+        }
+    } else {
+        /* An IO is read in chunks too, the points never become Ruby objects */
+        while ((chunk = egt_stream_read(load->source)) != Qnil) {
+            if (!gps_parser_feed(&load->parser, RSTRING_PTR(chunk), RSTRING_LEN(chunk))) {
+                break;
+            }
+        }
+        load->done = !load->parser.nomem && gps_parser_finish(&load->parser);
+    }
+    if (!load->done) {
+        rb_raise(rb_eNoMemError, "failed to allocate %zu track points", load->track->track.count + 1);
+    }
+    return Qnil;
+}
+
+/* Nothing is added from a log, which has not been read through */
+static VALUE egt_track_load_clear(VALUE arg)
+{
+    egt_track_load_t *load = (egt_track_load_t *)arg;
+
+    if (!load->done) {
+        load->track->track.count = load->parser.start;
+    }
+    load->track->busy = 0;
+    if (load->fd >= 0) {
+        close(load->fd);
+    }
+    free(load->buf);
+    return Qnil;
+}
+
+/*
+ * Track#load(path_or_io, format: nil) adds the points of GPX, KML or NMEA
+ * log, which is parsed natively in chunks. Without the format it is told
+ * by the first byte of the log. Returns the track.
+ */
+static VALUE egt_track_load(int argc, VALUE *argv, VALUE self)
+{
+    egt_track_load_t load;
+    GPSParseFormat format;
+    VALUE source, options;
+
+    rb_scan_args(argc, argv, "11", &source, &options);
+    format = egt_track_format(options);
+    memset(&load, 0, sizeof(load));
+    load.source = source;
+    load.fd = -1;
+    if (!RB_TYPE_P(source, T_STRING) && !rb_respond_to(source, egt_id_read)) {
+        rb_raise(rb_eTypeError, "expected path or IO, but got %" PRIsVALUE, rb_obj_class(source));
+    }
+    load.track = egt_track_idle(self);
+    /* the parse appends from the count of the points as it is now */
+    gps_parser_init(&load.parser, format, &load.track->track);
+    if (RB_TYPE_P(source, T_STRING)) {
+        load.fd = open(StringValueCStr(source), O_RDONLY | O_CLOEXEC);
+        if (load.fd < 0) {
+            rb_sys_fail_str(source);
+        }
+        load.buf = malloc(EGT_STREAM_CHUNK);
+        if (!load.buf) {
+            close(load.fd);
+            rb_raise(rb_eNoMemError, "failed to allocate %d bytes for the log", EGT_STREAM_CHUNK);
+        }
+    }
+    load.track->busy = 1;
+    rb_ensure(egt_track_load_body, (VALUE)&load, egt_track_load_clear, (VALUE)&load);
+    RB_GC_GUARD(source);
+    return self;
+}
+
+/* Track.load(path_or_io, format: nil) is Track.new.load(path_or_io, format: nil) */
+static VALUE egt_track_s_load(int argc, VALUE *argv, VALUE klass)
+{
+    return egt_track_load(argc, argv, rb_class_new_instance(0, NULL, klass));
+}
+
+/* Each worker locates and tags the photos on a writer of its own */
+static void *egt_track_worker(void *arg)
+{
+    egt_photo_batch_t *batch = arg;
+    egt_photo_t *photo;
+    egt_writer_t writer;
+    egt_job_t *job = &writer.job;
+    int opened;
+
+    memset(&writer, 0, sizeof(writer));
+    opened = egt_writer_open(&writer);
+    job->track = &batch->track->track;
+    job->clock_offset = batch->clock_offset;
+    job->max_gap = batch->max_gap;
+    job->options = batch->options;
+    job->cache = batch->cache;
+    while ((photo = egt_photo_next(batch)) != NULL) {
+        if (!opened) {
+            photo->status = EGT_ENOMEM;
+            continue;
+        }
+        job->path = photo->path;
+        egt_gps_reset(&job->prev_values);
+        egt_writer_run(&writer);
+        photo->status = job->status;
+        photo->fix = job->fix;
+        photo->exif_size = job->exif_size;
+        photo->error = job->error;
+    }
+    job->path = NULL;
+    egt_writer_clear(&writer);
+    return NULL;
+}
+
+static VALUE egt_track_result(egt_photo_t *photo)
+{
+    return egt_fix_to_hash(&photo->fix);
+}
+
+/*
+ * Track#write_tags(paths, clock_offset: 0, max_gap: 60, threads: n) reads
+ * the capture time of each photo, locates it on the track and writes the
+ * position in the same pass, on a pool of native threads. clock_offset is
+ * added to the camera clock to get UTC. Returns the written virtual fields
+ * (or exception objects for the files, which have not been tagged) in the
+ * same order as the paths. Takes the options of write_tag as well.
+ */
+static VALUE egt_track_write_tags(int argc, VALUE *argv, VALUE self)
+{
+    egt_photo_batch_t batch;
+    egt_track_t *track;
+    VALUE paths, options, cache = egt_cache_current, result;
+    unsigned int flags;
+    int64_t max_gap, clock_offset;
+    int nthreads;
+
+    rb_scan_args(argc, argv, "11", &paths, &options);
+    Check_Type(paths, T_ARRAY);
+
+    flags = egt_parse_options(options);
+    max_gap = egt_track_max_gap(options);
+    clock_offset = egt_seconds_to_nanos(options == Qnil ? Qnil : rb_hash_aref(options, egt_sym_clock_offset), 0);
+    nthreads = egt_batch_threads(options);
+    track = egt_track_sorted(self);
+
+    egt_photo_batch_init(&batch, RARRAY_LEN(paths), nthreads);
+    batch.worker = egt_track_worker;
+    batch.result = egt_track_result;
+    batch.options = flags;
+    batch.max_gap = max_gap;
+    batch.clock_offset = clock_offset;
+    batch.track = track;
+    batch.cache = egt_cache_get(cache);
+    track->busy = 1;
+    result = egt_photo_batch_run(&batch, paths);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+void egt_init_track(void)
+{
+    egt_cTrack = rb_define_class_under(egt_mExifGeoTag, "Track", rb_cObject);
+    rb_define_alloc_func(egt_cTrack, egt_track_alloc);
+    rb_define_singleton_method(egt_cTrack, "load", egt_track_s_load, -1);
+    rb_define_method(egt_cTrack, "initialize", egt_track_initialize, -1);
+    rb_define_method(egt_cTrack, "load", egt_track_load, -1);
+    rb_define_method(egt_cTrack, "add", egt_track_add, -1);
+    rb_define_method(egt_cTrack, "size", egt_track_size, 0);
+    rb_define_method(egt_cTrack, "[]", egt_track_aref, 1);
+    rb_define_method(egt_cTrack, "locate", egt_track_locate, -1);
+    rb_define_method(egt_cTrack, "write_tags", egt_track_write_tags, -1);
+}
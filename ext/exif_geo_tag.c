@@ -1,78 +1,70 @@
-#include <strings.h>
-
-#include "ruby.h"
-#include "ruby/encoding.h"
-
-RUBY_EXTERN VALUE rb_cRational;
-RUBY_EXTERN VALUE rb_cTime;
-RUBY_EXTERN VALUE rb_cNumeric;
-
-#include <libexif/exif-data.h>
-#include <libexif/exif-entry.h>
-#include <libexif/exif-loader.h>
-
-#include "jpeg-data.h"
+#include "exif_geo_tag.h"
 
 ExifLog *logger;
-#ifndef DEBUG
-#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
-#define exif_log(...)                                                                                                  \
-    do {                                                                                                               \
-    } while (0)
-#elif defined(__GNUC__)
-#define exif_log(x...)                                                                                                 \
-    do {                                                                                                               \
-    } while (0)
-#else
-#define exif_log (void)
-#endif
-#endif
 
 VALUE egt_mExifGeoTag;
-
-#define TAG_MAPPING(X)                                                                                                 \
-    X(EXIF_TAG_GPS_VERSION_ID, version_id)                                                                             \
-    X(EXIF_TAG_GPS_LATITUDE_REF, latitude_ref)                                                                         \
-    X(EXIF_TAG_GPS_LATITUDE, latitude)                                                                                 \
-    X(EXIF_TAG_GPS_LONGITUDE_REF, longitude_ref)                                                                       \
-    X(EXIF_TAG_GPS_LONGITUDE, longitude)                                                                               \
-    X(EXIF_TAG_GPS_ALTITUDE_REF, altitude_ref)                                                                         \
-    X(EXIF_TAG_GPS_ALTITUDE, altitude)                                                                                 \
-    X(EXIF_TAG_GPS_TIME_STAMP, time_stamp)                                                                             \
-    X(EXIF_TAG_GPS_DATE_STAMP, date_stamp)                                                                             \
-    X(EXIF_TAG_GPS_SATELLITES, satellites)                                                                             \
-    X(EXIF_TAG_GPS_STATUS, status)                                                                                     \
-    X(EXIF_TAG_GPS_MEASURE_MODE, measure_mode)                                                                         \
-    X(EXIF_TAG_GPS_DOP, dop)                                                                                           \
-    X(EXIF_TAG_GPS_SPEED_REF, speed_ref)                                                                               \
-    X(EXIF_TAG_GPS_SPEED, speed)                                                                                       \
-    X(EXIF_TAG_GPS_TRACK_REF, track_ref)                                                                               \
-    X(EXIF_TAG_GPS_TRACK, track)                                                                                       \
-    X(EXIF_TAG_GPS_IMG_DIRECTION_REF, img_direction_ref)                                                               \
-    X(EXIF_TAG_GPS_IMG_DIRECTION, img_direction)                                                                       \
-    X(EXIF_TAG_GPS_MAP_DATUM, map_datum)                                                                               \
-    X(EXIF_TAG_GPS_DEST_LATITUDE_REF, dest_latitude_ref)                                                               \
-    X(EXIF_TAG_GPS_DEST_LATITUDE, dest_latitude)                                                                       \
-    X(EXIF_TAG_GPS_DEST_LONGITUDE_REF, dest_longitude_ref)                                                             \
-    X(EXIF_TAG_GPS_DEST_LONGITUDE, dest_longitude)                                                                     \
-    X(EXIF_TAG_GPS_DEST_BEARING_REF, dest_bearing_ref)                                                                 \
-    X(EXIF_TAG_GPS_DEST_BEARING, dest_bearing)                                                                         \
-    X(EXIF_TAG_GPS_DEST_DISTANCE_REF, dest_distance_ref)                                                               \
-    X(EXIF_TAG_GPS_DEST_DISTANCE, dest_distance)                                                                       \
-    X(EXIF_TAG_GPS_PROCESSING_METHOD, processing_method)                                                               \
-    X(EXIF_TAG_GPS_AREA_INFORMATION, area_information)                                                                 \
-    X(EXIF_TAG_GPS_DIFFERENTIAL, differential)
+VALUE egt_cGPS;
+VALUE egt_cWriter;
 
 #define X(e, i) ID egt_sym_##i;
 TAG_MAPPING(X)
 #undef X
 
+#define X(e, i) e,
+static const ExifTag egt_tags[EGT_TAG_COUNT] = {TAG_MAPPING(X)};
+#undef X
+
+/* Index of GPS tag in TAG_MAPPING, which mostly follows tag numbers */
+static int egt_tag_index(ExifTag tag)
+{
+    int i;
+
+    if ((unsigned int)tag < EGT_TAG_COUNT && egt_tags[tag] == tag) {
+        return (int)tag;
+    }
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        if (egt_tags[i] == tag) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 ID egt_sym__latitude;
 ID egt_sym__longitude;
 ID egt_sym__altitude;
 ID egt_sym__timestamp;
 
-ID egt_id_Rational;
+ID egt_sym_in_place;
+ID egt_sym_fsync;
+ID egt_sym_keep_mode;
+ID egt_sym_keep_mtime;
+ID egt_sym_threads;
+ID egt_sym_marker;
+ID egt_sym_offset;
+ID egt_sym_size;
+ID egt_sym_as;
+ID egt_sym_gps;
+ID egt_sym_hash;
+ID egt_sym_tagged;
+ID egt_sym_failed;
+ID egt_sym_skipped;
+ID egt_sym_missing;
+ID egt_sym_seconds;
+ID egt_sym_files_per_second;
+ID egt_sym_clock_offset;
+ID egt_sym_max_gap;
+ID egt_sym_format;
+ID egt_sym_gpx;
+ID egt_sym_kml;
+ID egt_sym_nmea;
+ID egt_sym_time;
+ID egt_sym_indexed;
+ID egt_sym_read;
+ID egt_sym_kept;
+ID egt_sym_removed;
+ID egt_sym_entries;
+
 ID egt_id_add;
 ID egt_id_div;
 ID egt_id_sub;
@@ -91,6 +83,7 @@ ID egt_id_min;
 ID egt_id_sec;
 ID egt_id_truncate;
 ID egt_id_negative_p;
+ID egt_id_read;
 
 VALUE egt_str_colon;
 VALUE egt_str_period;
@@ -463,69 +456,63 @@ static void egt_exif_entry_initialize(ExifMem *mem, ExifEntry *entry, ExifTag ta
     }
 }
 
-#define CF(entry, expected)                                                                                            \
+#define CF(value, tag, expected)                                                                                       \
     {                                                                                                                  \
-        if (entry->format != expected) {                                                                               \
+        if (value->format != expected) {                                                                               \
             exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",                                                           \
-                     "Invalid format '%s' for tag '%s' (0x%04x), expected '%s'.", exif_format_get_name(entry->format), \
-                     exif_tag_get_name_in_ifd(entry->tag, EXIF_IFD_GPS), (int)entry->tag,                              \
-                     exif_format_get_name(expected));                                                                  \
+                     "Invalid format '%s' for tag '%s' (0x%04x), expected '%s'.", exif_format_get_name(value->format), \
+                     exif_tag_get_name_in_ifd(tag, EXIF_IFD_GPS), (int)tag, exif_format_get_name(expected));           \
             break;                                                                                                     \
         }                                                                                                              \
     }
 
-#define CC(entry, expected)                                                                                            \
+#define CC(value, tag, expected)                                                                                       \
     {                                                                                                                  \
-        if (entry->components != expected) {                                                                           \
+        if (value->components != expected) {                                                                           \
             exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Invalid number of components %i for tag '%s' (0x%04x), " \
                                                              "expected %i.",                                           \
-                     (int)entry->components, exif_tag_get_name_in_ifd(entry->tag, EXIF_IFD_GPS), (int)entry->tag,      \
-                     (int)expected);                                                                                   \
+                     (int)value->components, exif_tag_get_name_in_ifd(tag, EXIF_IFD_GPS), (int)tag, (int)expected);    \
             break;                                                                                                     \
         }                                                                                                              \
     }
 
-static VALUE egt_exif_entry_get_value(ExifEntry *entry)
+static VALUE egt_value_to_ruby(ExifTag tag, const egt_value_t *value, ExifByteOrder byte_order)
 {
-    ExifByteOrder byte_order;
     ExifRational rat;
     VALUE val;
     unsigned long i;
 
-    byte_order = exif_data_get_byte_order(entry->parent->parent);
-
     /* Sanity check */
-    if (entry->size != entry->components * exif_format_get_size(entry->format)) {
+    if (value->size != value->components * exif_format_get_size(value->format)) {
         exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Invalid size of entry with tag %d (%i, expected %li x %i).",
-                 (int)entry->tag, entry->size, entry->components, exif_format_get_size(entry->format));
+                 (int)tag, value->size, value->components, exif_format_get_size(value->format));
         return Qnil;
     }
 
 #define READ_AND_RETURN_RATIONAL()                                                                                     \
     val = rb_ary_new();                                                                                                \
-    if (entry->components == 1) {                                                                                      \
-        rat = exif_get_rational(entry->data, byte_order);                                                              \
+    if (value->components == 1) {                                                                                      \
+        rat = exif_get_rational(value->data, byte_order);                                                              \
         if (rat.numerator == 0 && rat.denominator == 0) {                                                              \
             rat.denominator = 1;                                                                                       \
         }                                                                                                              \
-        return rb_funcall(rb_mKernel, egt_id_Rational, 2, INT2FIX(rat.numerator), INT2FIX(rat.denominator));           \
+        return rb_rational_new(INT2FIX(rat.numerator), INT2FIX(rat.denominator));                                      \
     } else {                                                                                                           \
-        for (i = 0; i < entry->components; i++) {                                                                      \
-            rat = exif_get_rational(entry->data + exif_format_get_size(entry->format) * i, byte_order);                \
+        for (i = 0; i < value->components; i++) {                                                                      \
+            rat = exif_get_rational(value->data + exif_format_get_size(value->format) * i, byte_order);                \
             if (rat.numerator == 0 && rat.denominator == 0) {                                                          \
                 rat.denominator = 1;                                                                                   \
             }                                                                                                          \
-            rb_ary_push(val,                                                                                           \
-                        rb_funcall(rb_mKernel, egt_id_Rational, 2, INT2FIX(rat.numerator), INT2FIX(rat.denominator))); \
+            rb_ary_push(val, rb_rational_new(INT2FIX(rat.numerator), INT2FIX(rat.denominator)));                       \
         }                                                                                                              \
         return val;                                                                                                    \
     }
 
-    switch ((int)entry->tag) {
+    switch ((int)tag) {
     case EXIF_TAG_GPS_VERSION_ID:
-        CF(entry, EXIF_FORMAT_BYTE);
-        CC(entry, 4);
-        return rb_sprintf("%u.%u.%u.%u", entry->data[0], entry->data[1], entry->data[2], entry->data[3]);
+        CF(value, tag, EXIF_FORMAT_BYTE);
+        CC(value, tag, 4);
+        return rb_sprintf("%u.%u.%u.%u", value->data[0], value->data[1], value->data[2], value->data[3]);
     case EXIF_TAG_GPS_LONGITUDE_REF:
     case EXIF_TAG_GPS_STATUS:
     case EXIF_TAG_GPS_MEASURE_MODE:
@@ -538,49 +525,336 @@ static VALUE egt_exif_entry_get_value(ExifEntry *entry)
     case EXIF_TAG_GPS_DEST_LONGITUDE_REF:
     case EXIF_TAG_GPS_DEST_BEARING_REF:
     case EXIF_TAG_GPS_DEST_DISTANCE_REF:
-        CF(entry, EXIF_FORMAT_ASCII);
-        CC(entry, 2);
-        return rb_str_new_cstr((char *)entry->data);
+        CF(value, tag, EXIF_FORMAT_ASCII);
+        CC(value, tag, 2);
+        return rb_str_new_cstr((char *)value->data);
     case EXIF_TAG_GPS_ALTITUDE_REF:
-        CF(entry, EXIF_FORMAT_BYTE);
-        CC(entry, 1);
-        return INT2FIX(entry->data[0]);
+        CF(value, tag, EXIF_FORMAT_BYTE);
+        CC(value, tag, 1);
+        return INT2FIX(value->data[0]);
     case EXIF_TAG_GPS_ALTITUDE:
     case EXIF_TAG_GPS_SPEED:
     case EXIF_TAG_GPS_TRACK:
     case EXIF_TAG_GPS_IMG_DIRECTION:
     case EXIF_TAG_GPS_DEST_BEARING:
     case EXIF_TAG_GPS_DEST_DISTANCE:
-        CF(entry, EXIF_FORMAT_RATIONAL);
-        CC(entry, 1);
+        CF(value, tag, EXIF_FORMAT_RATIONAL);
+        CC(value, tag, 1);
         READ_AND_RETURN_RATIONAL();
     case EXIF_TAG_GPS_TIME_STAMP:
     case EXIF_TAG_GPS_LATITUDE:
     case EXIF_TAG_GPS_LONGITUDE:
     case EXIF_TAG_GPS_DEST_LATITUDE:
     case EXIF_TAG_GPS_DEST_LONGITUDE:
-        CF(entry, EXIF_FORMAT_RATIONAL);
-        CC(entry, 3);
+        CF(value, tag, EXIF_FORMAT_RATIONAL);
+        CC(value, tag, 3);
         READ_AND_RETURN_RATIONAL();
     case EXIF_TAG_GPS_SATELLITES:
     case EXIF_TAG_GPS_MAP_DATUM:
-        CF(entry, EXIF_FORMAT_ASCII);
-        return rb_str_new_cstr((char *)entry->data);
+        CF(value, tag, EXIF_FORMAT_ASCII);
+        return rb_str_new((char *)value->data, strnlen((char *)value->data, value->size));
     case EXIF_TAG_GPS_PROCESSING_METHOD:
     case EXIF_TAG_GPS_AREA_INFORMATION:
-        return rb_str_new((char *)entry->data, entry->size);
+        return rb_str_new((char *)value->data, value->size);
     case EXIF_TAG_GPS_DATE_STAMP:
-        CF(entry, EXIF_FORMAT_ASCII);
-        CC(entry, 11);
-        return rb_str_new_cstr((char *)entry->data);
+        CF(value, tag, EXIF_FORMAT_ASCII);
+        CC(value, tag, 11);
+        return rb_str_new((char *)value->data, strnlen((char *)value->data, value->size));
     case EXIF_TAG_GPS_DIFFERENTIAL:
-        CF(entry, EXIF_FORMAT_SHORT);
-        CC(entry, 1);
-        return INT2FIX(exif_get_short(entry->data, byte_order));
+        CF(value, tag, EXIF_FORMAT_SHORT);
+        CC(value, tag, 1);
+        return INT2FIX(exif_get_short(value->data, byte_order));
     default:
-        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Unexpected tag %d", (int)entry->tag);
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Unexpected tag %d", (int)tag);
     }
     return Qnil;
+#undef READ_AND_RETURN_RATIONAL
+}
+
+/*
+ * Converts the value read from EXIF into double, if it is a Fixnum or a
+ * Rational of Fixnums. The division is the same as in Rational#to_f.
+ */
+static int egt_dms_part_to_double(VALUE val, double *result)
+{
+    if (FIXNUM_P(val)) {
+        *result = (double)FIX2LONG(val);
+        return 1;
+    }
+    if (RB_TYPE_P(val, T_RATIONAL)) {
+        VALUE num = rb_rational_num(val), den = rb_rational_den(val);
+
+        if (FIXNUM_P(num) && FIXNUM_P(den) && labs(FIX2LONG(num)) < (1L << 53) && FIX2LONG(den) < (1L << 53)) {
+            *result = (double)FIX2LONG(num) / (double)FIX2LONG(den);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Converts [deg, min, sec] triplet into Float as
+ * (deg + (min / 60.0 + sec / 3600.0)).to_f does.
+ */
+static VALUE egt_coordinate_from_dms(VALUE dms)
+{
+    VALUE deg = rb_ary_entry(dms, 0), min = rb_ary_entry(dms, 1), sec = rb_ary_entry(dms, 2);
+    double d, m, s;
+
+    if (egt_dms_part_to_double(deg, &d) && egt_dms_part_to_double(min, &m) && egt_dms_part_to_double(sec, &s)) {
+        return DBL2NUM(d + (m / 60.0 + s / 3600.0));
+    }
+
+    /* Other numeric types go through Ruby arithmetic */
+    min = rb_funcall(min, egt_id_div, 1, egt_flt_min);
+    sec = rb_funcall(sec, egt_id_div, 1, egt_flt_sec);
+    return rb_funcall(rb_funcall(deg, egt_id_add, 1, rb_funcall(min, egt_id_add, 1, sec)), egt_id_to_f, 0);
+}
+
+/*
+ * Same as x.round(3) * 1000 for Float x, which is within the range of
+ * seconds: round half up, and positive numbers too small to be rounded
+ * turn into zero.
+ */
+static double egt_round_millis(double x)
+{
+    double f;
+    int binexp;
+
+    if (x == 0.0) {
+        return 0.0;
+    }
+    frexp(x, &binexp);
+    if (x > 0.0 && 3 < -(binexp > 0 ? binexp / 3 + 1 : binexp / 4)) {
+        return 0.0;
+    }
+    f = round(x * 1000.0);
+    if (x > 0.0) {
+        if ((double)((f + 0.5) / 1000.0) <= x) {
+            f += 1;
+        }
+    } else {
+        if ((double)((f - 0.5) / 1000.0) >= x) {
+            f -= 1;
+        }
+    }
+    return f;
+}
+
+/*
+ * Converts coordinate into [deg, min, sec] triplet of Rationals, where
+ * seconds are rounded to 3 digits. For Float and Fixnum this is done on
+ * doubles, exactly as the Ruby code below: the simplest rational of
+ * seconds rounded to the millisecond is the reduced fraction k/1000.
+ */
+static VALUE egt_coordinate_to_dms(VALUE val)
+{
+    VALUE deg, min, sec, tmp;
+
+    if (FIXNUM_P(val)) {
+        return rb_ary_new_from_args(3, rb_rational_new(val, INT2FIX(1)), rb_rational_new(INT2FIX(0), INT2FIX(1)),
+                                    rb_rational_new(INT2FIX(0), INT2FIX(1)));
+    }
+    if (RB_FLOAT_TYPE_P(val)) {
+        double v = RFLOAT_VALUE(val), d, m, s;
+
+        if (fabs(v) < 1e15) {
+            d = trunc(v);
+            m = trunc((v - d) * 60.0);
+            s = egt_round_millis(((v - d) - m / 60.0) * 3600.0);
+            return rb_ary_new_from_args(3, rb_rational_new(LL2NUM((LONG_LONG)d), INT2FIX(1)),
+                                        rb_rational_new(LL2NUM((LONG_LONG)m), INT2FIX(1)),
+                                        rb_rational_new(LL2NUM((LONG_LONG)s), INT2FIX(1000)));
+        }
+    }
+
+    deg = rb_funcall(val, egt_id_truncate, 0);
+    min = rb_funcall(rb_funcall(rb_funcall(val, egt_id_sub, 1, deg), egt_id_mul, 1, egt_flt_min), egt_id_truncate, 0);
+    tmp = rb_funcall(
+        rb_funcall(rb_funcall(val, egt_id_sub, 1, deg), egt_id_sub, 1, rb_funcall(min, egt_id_div, 1, egt_flt_min)),
+        egt_id_mul, 1, egt_flt_sec);
+    sec = rb_funcall(tmp, egt_id_round, 1, INT2FIX(3));
+    return rb_ary_new_from_args(3, rb_funcall(deg, egt_id_rationalize, 0), rb_funcall(min, egt_id_rationalize, 0),
+                                rb_funcall(sec, egt_id_rationalize, 0));
+}
+
+/* Days since 1970-01-01 of the proleptic Gregorian date */
+static LONG_LONG egt_days_from_civil(LONG_LONG y, int m, int d)
+{
+    LONG_LONG era;
+    unsigned int yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned int)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (LONG_LONG)doe - 719468;
+}
+
+static void egt_civil_from_days(LONG_LONG z, LONG_LONG *y, int *m, int *d)
+{
+    LONG_LONG era;
+    unsigned int doe, yoe, doy, mp;
+
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (unsigned int)(z - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (LONG_LONG)yoe + era * 400 + (*m <= 2);
+}
+
+/* Integer part of Fixnum or Rational of Fixnums, as #to_i returns it */
+static int egt_time_part_to_long(VALUE val, long *result)
+{
+    if (FIXNUM_P(val)) {
+        *result = FIX2LONG(val);
+        return 1;
+    }
+    if (RB_TYPE_P(val, T_RATIONAL)) {
+        VALUE num = rb_rational_num(val), den = rb_rational_den(val);
+
+        if (FIXNUM_P(num) && FIXNUM_P(den)) {
+            *result = FIX2LONG(num) / FIX2LONG(den);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int egt_parse_digits(const char *p, int n)
+{
+    int r = 0;
+
+    while (n--) {
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        r = r * 10 + (*p++ - '0');
+    }
+    return r;
+}
+
+/* Days since 1970-01-01 of "YYYY:MM:DD", returns 0 unless the date exists */
+static int egt_parse_date(const char *p, LONG_LONG *days)
+{
+    int year, month, day, m, d;
+    LONG_LONG y;
+
+    if (p[4] != ':' || p[7] != ':') {
+        return 0;
+    }
+    year = egt_parse_digits(p, 4);
+    month = egt_parse_digits(p + 5, 2);
+    day = egt_parse_digits(p + 8, 2);
+    if (year <= 0 || month <= 0 || day <= 0) {
+        return 0;
+    }
+    *days = egt_days_from_civil(year, month, day);
+    egt_civil_from_days(*days, &y, &m, &d);
+    /* the day exists in the month */
+    return y == year && m == month && d == day;
+}
+
+/*
+ * Builds UTC Time from "YYYY:MM:DD" date and time of day natively. Returns
+ * Qundef for anything Time.utc would normalize or reject.
+ */
+static VALUE egt_timestamp_new(const char *p, long len, long hour, long min, long sec)
+{
+    LONG_LONG days;
+    struct timespec ts;
+
+    if (len != 10 || hour < 0 || hour >= 24 || min < 0 || min >= 60 || sec < 0 || sec >= 60 ||
+        !egt_parse_date(p, &days)) {
+        return Qundef;
+    }
+    ts.tv_sec = (time_t)(days * 86400 + hour * 3600 + min * 60 + sec);
+    ts.tv_nsec = 0;
+    return rb_time_timespec_new(&ts, INT_MAX - 1);
+}
+
+/*
+ * Builds UTC Time out of :time_stamp and :date_stamp. Valid values are
+ * converted natively, anything else is left to Time.utc, which either
+ * normalizes or rejects it.
+ */
+static VALUE egt_timestamp_from_gps(VALUE time, VALUE date)
+{
+    long hour, min, sec;
+    VALUE sdate;
+
+    if (RARRAY_LEN(time) != 3) {
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Expected :time_stamp to have 3 items, but got %ld",
+                 RARRAY_LEN(time));
+        return Qnil;
+    }
+
+    if (egt_time_part_to_long(rb_ary_entry(time, 0), &hour) && egt_time_part_to_long(rb_ary_entry(time, 1), &min) &&
+        egt_time_part_to_long(rb_ary_entry(time, 2), &sec)) {
+        VALUE val = egt_timestamp_new(RSTRING_PTR(date), RSTRING_LEN(date), hour, min, sec);
+
+        if (val != Qundef) {
+            return val;
+        }
+    }
+
+    sdate = rb_funcall(date, egt_id_split, 1, egt_str_colon);
+    if (RARRAY_LEN(sdate) != 3) {
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",
+                 "Expected :date_stamp to have 3 sections separated by ':', but got %ld", RARRAY_LEN(sdate));
+        return Qnil;
+    }
+    return rb_funcall(rb_cTime, egt_id_utc, 6, rb_funcall(rb_ary_entry(sdate, 0), egt_id_to_i, 0),
+                      rb_funcall(rb_ary_entry(sdate, 1), egt_id_to_i, 0),
+                      rb_funcall(rb_ary_entry(sdate, 2), egt_id_to_i, 0),
+                      rb_funcall(rb_ary_entry(time, 0), egt_id_to_i, 0),
+                      rb_funcall(rb_ary_entry(time, 1), egt_id_to_i, 0),
+                      rb_funcall(rb_ary_entry(time, 2), egt_id_to_i, 0));
+}
+
+/*
+ * Sets :date_stamp and :time_stamp from Time in its own time zone, as
+ * strftime('%Y:%m:%d') and [hour, min, sec] would give them.
+ */
+static void egt_timestamp_to_gps(VALUE values, VALUE val)
+{
+    VALUE time, offset;
+
+    if (rb_obj_class(val) == rb_cTime) {
+        offset = rb_time_utc_offset(val);
+        if (FIXNUM_P(offset)) {
+            struct timespec ts = rb_time_timespec(val);
+            LONG_LONG local = (LONG_LONG)ts.tv_sec + FIX2LONG(offset), days, y;
+            int m, d, secs;
+
+            days = (local >= 0 ? local : local - 86399) / 86400;
+            secs = (int)(local - days * 86400);
+            egt_civil_from_days(days, &y, &m, &d);
+            if (y > 0 && y < 10000) {
+                char date[11];
+
+                snprintf(date, sizeof(date), "%04d:%02d:%02d", (int)y, m, d);
+                rb_hash_aset(values, egt_sym_date_stamp, rb_str_new(date, 10));
+                rb_hash_aset(values, egt_sym_time_stamp,
+                             rb_ary_new_from_args(3, rb_rational_new(INT2FIX(secs / 3600), INT2FIX(1)),
+                                                  rb_rational_new(INT2FIX(secs / 60 % 60), INT2FIX(1)),
+                                                  rb_rational_new(INT2FIX(secs % 60), INT2FIX(1))));
+                return;
+            }
+        }
+    }
+
+    rb_hash_aset(values, egt_sym_date_stamp, rb_funcall(val, egt_id_strftime, 1, egt_str_date_format));
+    time = rb_ary_new();
+    rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_hour, 0), egt_id_rationalize, 0));
+    rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_min, 0), egt_id_rationalize, 0));
+    rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_sec, 0), egt_id_rationalize, 0));
+    rb_hash_aset(values, egt_sym_time_stamp, time);
 }
 
 static void egt_generate_virtual_fields(VALUE values)
@@ -592,10 +866,7 @@ static void egt_generate_virtual_fields(VALUE values)
     if (val != Qnil) {                                                                                                 \
         Check_Type(val, T_ARRAY);                                                                                      \
         if (RARRAY_LEN(val) == 3) {                                                                                    \
-            VALUE deg = rb_ary_entry(val, 0), min = rb_funcall(rb_ary_entry(val, 1), egt_id_div, 1, egt_flt_min),      \
-                  sec = rb_funcall(rb_ary_entry(val, 2), egt_id_div, 1, egt_flt_sec);                                  \
-            rb_hash_aset(values, to, rb_funcall(rb_funcall(deg, egt_id_add, 1, rb_funcall(min, egt_id_add, 1, sec)),   \
-                                                egt_id_to_f, 0));                                                      \
+            rb_hash_aset(values, to, egt_coordinate_from_dms(val));                                                    \
         } else {                                                                                                       \
             exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Expected " name " to have 3 items, but got %ld",         \
                      RARRAY_LEN(val));                                                                                 \
@@ -613,57 +884,134 @@ static void egt_generate_virtual_fields(VALUE values)
         VALUE date = rb_hash_aref(values, egt_sym_date_stamp);
 
         if (time != Qnil && date != Qnil) {
-            VALUE sdate;
             Check_Type(time, T_ARRAY);
             Check_Type(date, T_STRING);
-            sdate = rb_funcall(date, egt_id_split, 1, egt_str_colon);
-            if (RARRAY_LEN(time) == 3) {
-                if (RARRAY_LEN(sdate) == 3) {
-                    VALUE hour = rb_funcall(rb_ary_entry(time, 0), egt_id_to_i, 0),
-                          min = rb_funcall(rb_ary_entry(time, 1), egt_id_to_i, 0),
-                          sec = rb_funcall(rb_ary_entry(time, 2), egt_id_to_i, 0);
-                    VALUE year = rb_funcall(rb_ary_entry(sdate, 0), egt_id_to_i, 0),
-                          month = rb_funcall(rb_ary_entry(sdate, 1), egt_id_to_i, 0),
-                          day = rb_funcall(rb_ary_entry(sdate, 2), egt_id_to_i, 0);
-                    rb_hash_aset(values, egt_sym__timestamp,
-                                 rb_funcall(rb_cTime, egt_id_utc, 6, year, month, day, hour, min, sec));
-                } else {
-                    exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",
-                             "Expected :date_stamp to have 3 sections separated by ':', but got %ld",
-                             RARRAY_LEN(sdate));
-                }
-            } else {
-                exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Expected :time_stamp to have 3 items, but got %ld",
-                         RARRAY_LEN(time));
+            val = egt_timestamp_from_gps(time, date);
+            if (val != Qnil) {
+                rb_hash_aset(values, egt_sym__timestamp, val);
             }
         }
     }
 #undef CONVERT_COORDINATES
 }
 
-static void egt_exif_entry_set_value(ExifMem *mem, ExifEntry *entry, VALUE values, ID key)
+/* Makes room for size bytes of data, keeping the buffer if it is big enough */
+static int egt_value_reserve(egt_value_t *value, unsigned int size)
 {
-    VALUE val = rb_hash_aref(values, key);
-    ExifByteOrder byte_order = exif_data_get_byte_order(entry->parent->parent);
+    unsigned char *data;
 
-    switch ((int)entry->tag) {
-    case EXIF_TAG_GPS_VERSION_ID:
-        if (val != Qnil) {
-            VALUE sval;
-
-            Check_Type(val, T_STRING);
-            sval = rb_funcall(val, egt_id_split, 1, egt_str_period);
-            if (RARRAY_LEN(sval) == 3) {
-                entry->data[0] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 0), egt_id_to_i, 0));
-                entry->data[1] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 1), egt_id_to_i, 0));
-                entry->data[2] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 2), egt_id_to_i, 0));
-                entry->data[3] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 3), egt_id_to_i, 0));
-            } else {
-                exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",
-                         "Expected :gps_version_id to have 4 sections separated by '.', but got %ld", RARRAY_LEN(sval));
-            }
+    if (!size) {
+        size = 1;
+    }
+    if (value->data && value->alloc >= size) {
+        return 1;
+    }
+    data = malloc(size);
+    if (!data) {
+        return 0;
+    }
+    free(value->data);
+    value->data = data;
+    value->alloc = size;
+    return 1;
+}
+
+/* Returns 0 if it runs out of memory, does not touch Ruby objects */
+static int egt_value_store(egt_value_t *value, ExifFormat format, unsigned long components, const void *data)
+{
+    unsigned int size = exif_format_get_size(format) * components;
+
+    if (!egt_value_reserve(value, size)) {
+        return 0;
+    }
+    value->format = format;
+    value->components = components;
+    value->size = size;
+    memcpy(value->data, data, size);
+    return 1;
+}
+
+static void egt_value_set(egt_value_t *value, ExifFormat format, unsigned long components, const void *data)
+{
+    if (!egt_value_store(value, format, components, data)) {
+        rb_raise(rb_eNoMemError, "failed to allocate %u bytes for EXIF value",
+                 exif_format_get_size(format) * (unsigned int)components);
+    }
+}
+
+static void egt_value_clear(egt_value_t *value)
+{
+    free(value->data);
+    memset(value, 0, sizeof(egt_value_t));
+}
+
+/* Forgets the value, but keeps its buffer for the next one */
+static void egt_value_reset(egt_value_t *value)
+{
+    value->format = 0;
+    value->components = 0;
+    value->size = 0;
+}
+
+void egt_gps_clear(egt_gps_t *gps)
+{
+    int i;
+
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        egt_value_clear(&gps->values[i]);
+    }
+    gps->present = 0;
+}
+
+void egt_gps_reset(egt_gps_t *gps)
+{
+    int i;
+
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        egt_value_reset(&gps->values[i]);
+    }
+    gps->present = 0;
+}
+
+static ExifRational egt_rational_from_ruby(VALUE val)
+{
+    ExifRational rat;
+
+    val = rb_funcall(val, egt_id_rationalize, 0);
+    rat.numerator = FIX2INT(rb_funcall(val, egt_id_numerator, 0));
+    rat.denominator = FIX2INT(rb_funcall(val, egt_id_denominator, 0));
+    return rat;
+}
+
+/*
+ * Converts Ruby value into the raw form of the entry. The value encoded
+ * using Motorola byte order, and egt_gps_apply() converts it to the byte
+ * order of the file.
+ */
+static void egt_value_from_ruby(ExifTag tag, VALUE val, egt_value_t *value)
+{
+    const ExifByteOrder byte_order = EXIF_BYTE_ORDER_MOTOROLA;
+
+    switch ((int)tag) {
+    case EXIF_TAG_GPS_VERSION_ID: {
+        VALUE sval;
+
+        Check_Type(val, T_STRING);
+        sval = rb_funcall(val, egt_id_split, 1, egt_str_period);
+        if (RARRAY_LEN(sval) == 3) {
+            ExifByte data[4];
+
+            data[0] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 0), egt_id_to_i, 0));
+            data[1] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 1), egt_id_to_i, 0));
+            data[2] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 2), egt_id_to_i, 0));
+            data[3] = (ExifByte)FIX2INT(rb_funcall(rb_ary_entry(sval, 3), egt_id_to_i, 0));
+            egt_value_set(value, EXIF_FORMAT_BYTE, 4, data);
+        } else {
+            exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",
+                     "Expected :gps_version_id to have 4 sections separated by '.', but got %ld", RARRAY_LEN(sval));
         }
         return;
+    }
     case EXIF_TAG_GPS_LONGITUDE_REF:
     case EXIF_TAG_GPS_STATUS:
     case EXIF_TAG_GPS_MEASURE_MODE:
@@ -675,130 +1023,106 @@ static void egt_exif_entry_set_value(ExifMem *mem, ExifEntry *entry, VALUE value
     case EXIF_TAG_GPS_DEST_LATITUDE_REF:
     case EXIF_TAG_GPS_DEST_LONGITUDE_REF:
     case EXIF_TAG_GPS_DEST_BEARING_REF:
-    case EXIF_TAG_GPS_DEST_DISTANCE_REF:
-        if (val != Qnil) {
-            Check_Type(val, T_STRING);
-            if (entry->data) {
-                exif_mem_free(mem, entry->data);
-            }
-            entry->components = 2;
-            entry->size = entry->components * sizeof(char);
-            entry->data = exif_mem_alloc(mem, entry->components * sizeof(char));
-            entry->data[0] = RSTRING_PTR(val)[0];
-            entry->data[1] = 0;
-        }
+    case EXIF_TAG_GPS_DEST_DISTANCE_REF: {
+        char data[2];
+
+        Check_Type(val, T_STRING);
+        data[0] = RSTRING_PTR(val)[0];
+        data[1] = 0;
+        egt_value_set(value, EXIF_FORMAT_ASCII, 2, data);
         return;
-    case EXIF_TAG_GPS_ALTITUDE_REF:
-        if (val != Qnil) {
-            Check_Type(val, T_FIXNUM);
-            if (entry->data) {
-                exif_mem_free(mem, entry->data);
-            }
-            entry->components = 1;
-            entry->size = entry->components * sizeof(ExifByte);
-            entry->data = exif_mem_alloc(mem, entry->components * sizeof(ExifByte));
-            entry->data[0] = (ExifByte)FIX2INT(val);
-        }
+    }
+    case EXIF_TAG_GPS_ALTITUDE_REF: {
+        ExifByte data;
+
+        Check_Type(val, T_FIXNUM);
+        data = (ExifByte)FIX2INT(val);
+        egt_value_set(value, EXIF_FORMAT_BYTE, 1, &data);
         return;
+    }
     case EXIF_TAG_GPS_ALTITUDE:
     case EXIF_TAG_GPS_SPEED:
     case EXIF_TAG_GPS_TRACK:
     case EXIF_TAG_GPS_IMG_DIRECTION:
     case EXIF_TAG_GPS_DEST_BEARING:
-    case EXIF_TAG_GPS_DEST_DISTANCE:
-        if (val != Qnil) {
-            ExifRational rat;
+    case EXIF_TAG_GPS_DEST_DISTANCE: {
+        unsigned char data[sizeof(ExifRational)];
 
-            val = rb_funcall(val, egt_id_rationalize, 0), rat.numerator = FIX2INT(rb_funcall(val, egt_id_numerator, 0));
-            rat.denominator = FIX2INT(rb_funcall(val, egt_id_denominator, 0));
-            if (entry->data) {
-                exif_mem_free(mem, entry->data);
-            }
-            entry->components = 1;
-            entry->size = entry->components * sizeof(ExifRational);
-            entry->data = exif_mem_alloc(mem, entry->components * sizeof(ExifRational));
-            exif_set_rational(entry->data, byte_order, rat);
-        }
+        exif_set_rational(data, byte_order, egt_rational_from_ruby(val));
+        egt_value_set(value, EXIF_FORMAT_RATIONAL, 1, data);
         return;
+    }
     case EXIF_TAG_GPS_TIME_STAMP:
     case EXIF_TAG_GPS_LATITUDE:
     case EXIF_TAG_GPS_LONGITUDE:
     case EXIF_TAG_GPS_DEST_LATITUDE:
     case EXIF_TAG_GPS_DEST_LONGITUDE:
-        if (val != Qnil) {
-            Check_Type(val, T_ARRAY);
-
-            if (RARRAY_LEN(val) == 3) {
-                unsigned long i;
-
-                entry->components = 3;
-                entry->size = entry->components * sizeof(ExifRational);
-                entry->data = exif_mem_alloc(mem, entry->components * sizeof(ExifRational));
-
-                for (i = 0; i < entry->components; i++) {
-                    ExifRational rat;
-                    VALUE vrat;
-                    vrat = rb_funcall(rb_ary_entry(val, i), egt_id_rationalize, 0);
-                    rat.numerator = FIX2INT(rb_funcall(vrat, egt_id_numerator, 0));
-                    rat.denominator = FIX2INT(rb_funcall(vrat, egt_id_denominator, 0));
-                    exif_set_rational(entry->data + exif_format_get_size(entry->format) * i, byte_order, rat);
-                }
-            } else {
-                exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt",
-                         "Expected %s to have 4 sections separated by '.', but got %ld", StringValueCStr(key),
-                         RARRAY_LEN(val));
+        Check_Type(val, T_ARRAY);
+        if (RARRAY_LEN(val) == 3) {
+            unsigned char data[3 * sizeof(ExifRational)];
+            long i;
+
+            for (i = 0; i < 3; i++) {
+                exif_set_rational(data + sizeof(ExifRational) * i, byte_order,
+                                  egt_rational_from_ruby(rb_ary_entry(val, i)));
             }
+            egt_value_set(value, EXIF_FORMAT_RATIONAL, 3, data);
+        } else {
+            exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Expected %s to have 3 items, but got %ld",
+                     exif_tag_get_name_in_ifd(tag, EXIF_IFD_GPS), RARRAY_LEN(val));
         }
         return;
     case EXIF_TAG_GPS_SATELLITES:
     case EXIF_TAG_GPS_MAP_DATUM:
     case EXIF_TAG_GPS_PROCESSING_METHOD:
-    case EXIF_TAG_GPS_AREA_INFORMATION:
-        if (val != Qnil) {
-            Check_Type(val, T_STRING);
-            if (entry->data) {
-                exif_mem_free(mem, entry->data);
-            }
-            entry->components = RSTRING_LEN(val) + 1;
-            entry->size = entry->components * sizeof(char);
-            entry->data = exif_mem_alloc(mem, entry->components * sizeof(char));
-            memcpy(entry->data, RSTRING_PTR(val), RSTRING_LEN(val));
-            entry->data[RSTRING_LEN(val)] = 0;
+    case EXIF_TAG_GPS_AREA_INFORMATION: {
+        ExifFormat format = EXIF_FORMAT_ASCII;
+
+        Check_Type(val, T_STRING);
+        if (tag == EXIF_TAG_GPS_PROCESSING_METHOD || tag == EXIF_TAG_GPS_AREA_INFORMATION) {
+            format = EXIF_FORMAT_UNDEFINED;
         }
+        /* the data is always NUL-terminated, so reserve one more byte */
+        egt_value_set(value, format, RSTRING_LEN(val) + 1, RSTRING_PTR(val));
+        value->data[RSTRING_LEN(val)] = 0;
         return;
+    }
     case EXIF_TAG_GPS_DATE_STAMP:
-        if (val != Qnil) {
-            Check_Type(val, T_STRING);
-            if (RSTRING_LEN(val) == 10) {
-                if (entry->data) {
-                    exif_mem_free(mem, entry->data);
-                }
-                entry->components = 11;
-                entry->size = entry->components * sizeof(char);
-                entry->data = exif_mem_alloc(mem, entry->components * sizeof(char));
-                memcpy(entry->data, RSTRING_PTR(val), 10);
-                entry->data[10] = 0;
-            }
+        Check_Type(val, T_STRING);
+        if (RSTRING_LEN(val) == 10) {
+            char data[11];
+
+            memcpy(data, RSTRING_PTR(val), 10);
+            data[10] = 0;
+            egt_value_set(value, EXIF_FORMAT_ASCII, 11, data);
         }
         return;
-    case EXIF_TAG_GPS_DIFFERENTIAL:
-        if (val != Qnil) {
-            Check_Type(val, T_FIXNUM);
-            if (entry->data) {
-                exif_mem_free(mem, entry->data);
-            }
-            entry->components = 1;
-            entry->size = entry->components * sizeof(ExifShort);
-            entry->data = exif_mem_alloc(mem, entry->components * sizeof(ExifShort));
-            exif_set_short(entry->data, byte_order, (ExifShort)FIX2INT(val));
-        }
+    case EXIF_TAG_GPS_DIFFERENTIAL: {
+        unsigned char data[sizeof(ExifShort)];
+
+        Check_Type(val, T_FIXNUM);
+        exif_set_short(data, byte_order, (ExifShort)FIX2INT(val));
+        egt_value_set(value, EXIF_FORMAT_SHORT, 1, data);
         return;
+    }
     default:
-        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Unexpected tag %d", (int)entry->tag);
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Unexpected tag %d", (int)tag);
+    }
+}
+
+/* The magnitude of a negative coordinate, whose sign goes into the ref */
+static VALUE egt_coordinate_negate(VALUE val)
+{
+    if (FIXNUM_P(val)) {
+        return LONG2NUM(-FIX2LONG(val));
+    }
+    if (RB_FLOAT_TYPE_P(val)) {
+        return DBL2NUM(-RFLOAT_VALUE(val));
     }
+    return rb_funcall(INT2FIX(0), egt_id_sub, 1, val);
 }
 
-static void egt_parse_virtual_fields(VALUE values)
+void egt_parse_virtual_fields(VALUE values)
 {
 
     VALUE val;
@@ -810,43 +1134,30 @@ static void egt_parse_virtual_fields(VALUE values)
 
     val = rb_hash_aref(values, egt_sym__timestamp);
     if (val != Qnil) {
-        VALUE time;
         if (!rb_obj_is_kind_of(val, rb_cTime)) {
             rb_raise(rb_eTypeError, "wrong argument (%" PRIsVALUE ")! (Expected kind of %" PRIsVALUE ")",
                      rb_obj_class(val), rb_cTime);
         }
-        rb_hash_aset(values, egt_sym_date_stamp, rb_funcall(val, egt_id_strftime, 1, egt_str_date_format));
-        time = rb_ary_new();
-        rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_hour, 0), egt_id_rationalize, 0));
-        rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_min, 0), egt_id_rationalize, 0));
-        rb_ary_push(time, rb_funcall(rb_funcall(val, egt_id_sec, 0), egt_id_rationalize, 0));
-        rb_hash_aset(values, egt_sym_time_stamp, time);
+        egt_timestamp_to_gps(values, val);
     }
 
 #define CONVERT_COORDINATES(from, to, ref, negative, positive)                                                         \
     val = rb_hash_aref(values, from);                                                                                  \
     if (val != Qnil) {                                                                                                 \
-        VALUE deg, min, sec, tmp;                                                                                      \
+        int is_negative;                                                                                               \
                                                                                                                        \
-        if (!rb_obj_is_kind_of(val, rb_cNumeric)) {                                                                    \
+        if (FIXNUM_P(val)) {                                                                                           \
+            is_negative = FIX2LONG(val) < 0;                                                                           \
+        } else if (RB_FLOAT_TYPE_P(val)) {                                                                             \
+            is_negative = RFLOAT_VALUE(val) < 0.0;                                                                     \
+        } else if (rb_obj_is_kind_of(val, rb_cNumeric)) {                                                              \
+            is_negative = RTEST(rb_funcall(val, egt_id_negative_p, 0));                                                \
+        } else {                                                                                                       \
             rb_raise(rb_eTypeError, "wrong argument (%" PRIsVALUE ")! (Expected kind of %" PRIsVALUE ")",              \
                      rb_obj_class(val), rb_cNumeric);                                                                  \
         }                                                                                                              \
-        deg = rb_funcall(val, egt_id_truncate, 0);                                                                     \
-        min = rb_funcall(rb_funcall(rb_funcall(val, egt_id_sub, 1, deg), egt_id_mul, 1, egt_flt_min), egt_id_truncate, \
-                         0);                                                                                           \
-        tmp = rb_funcall(rb_funcall(rb_funcall(val, egt_id_sub, 1, deg), egt_id_sub, 1,                                \
-                                    rb_funcall(min, egt_id_div, 1, egt_flt_min)),                                      \
-                         egt_id_mul, 1, egt_flt_sec);                                                                  \
-        sec = rb_funcall(tmp, egt_id_round, 1, INT2FIX(3));                                                            \
-        rb_hash_aset(values, to, rb_ary_new_from_args(3, rb_funcall(deg, egt_id_rationalize, 0),                       \
-                                                      rb_funcall(min, egt_id_rationalize, 0),                          \
-                                                      rb_funcall(sec, egt_id_rationalize, 0)));                        \
-        if (RTEST(rb_funcall(val, egt_id_negative_p, 0))) {                                                            \
-            rb_hash_aset(values, ref, negative);                                                                       \
-        } else {                                                                                                       \
-            rb_hash_aset(values, ref, positive);                                                                       \
-        }                                                                                                              \
+        rb_hash_aset(values, to, egt_coordinate_to_dms(is_negative ? egt_coordinate_negate(val) : val));               \
+        rb_hash_aset(values, ref, is_negative ? negative : positive);                                                  \
     }
 
     CONVERT_COORDINATES(egt_sym__latitude, egt_sym_latitude, egt_sym_latitude_ref, egt_str_south, egt_str_north);
@@ -854,128 +1165,2126 @@ static void egt_parse_virtual_fields(VALUE values)
 #undef CONVERT_COORDINATES
 }
 
-static void egt_handle_tag(ExifMem *mem, ExifData *exif_data, ExifTag tag, VALUE prev_values, VALUE new_values, ID key)
+/* Index of TAG_MAPPING entry with given hash key, -1 for other keys */
+static int egt_tag_index_from_key(VALUE key)
 {
-    ExifEntry *exif_entry;
-    VALUE val;
-
-    if (rb_hash_aref(new_values, key) != Qnil) {
-        exif_entry = exif_content_get_entry(exif_data->ifd[EXIF_IFD_GPS], tag);
-        if (!exif_entry) {
-            exif_entry = exif_entry_new();
-            exif_entry->tag = tag;
-            exif_content_add_entry(exif_data->ifd[EXIF_IFD_GPS], exif_entry);
-            egt_exif_entry_initialize(mem, exif_entry, tag);
-            /* the entry has been added to the IFD, so we can unref it */
-            exif_entry_unref(exif_entry);
-        } else {
-            val = egt_exif_entry_get_value(exif_entry);
-            rb_hash_aset(prev_values, key, val);
-        }
-
-        egt_exif_entry_set_value(mem, exif_entry, new_values, key);
+#define X(e, i)                                                                                                        \
+    if (key == egt_sym_##i) {                                                                                          \
+        return EGT_TAG_##i;                                                                                            \
     }
+    TAG_MAPPING(X)
+#undef X
+    return -1;
 }
 
-static ExifData *egt_exif_data_new_from_file(ExifMem *mem, const char *path)
+static int egt_gps_from_hash_i(VALUE key, VALUE val, VALUE arg)
 {
-    ExifData *edata;
-    ExifLoader *loader;
+    egt_gps_t *gps = (egt_gps_t *)arg;
+    int idx;
 
-    loader = exif_loader_new_mem(mem);
-    exif_loader_log(loader, logger);
-    exif_loader_write_file(loader, path);
-    edata = exif_loader_get_data(loader);
-    exif_loader_unref(loader);
+    if (val == Qnil || !SYMBOL_P(key)) {
+        return ST_CONTINUE;
+    }
+    idx = egt_tag_index_from_key(key);
+    if (idx >= 0) {
+        egt_value_reset(&gps->values[idx]);
+        egt_value_from_ruby(egt_tags[idx], val, &gps->values[idx]);
+        gps->present |= EGT_BIT(idx);
+    }
+    return ST_CONTINUE;
+}
 
-    return (edata);
+/*
+ * Compiles the tags hash into the tag plan: a bitmap of given tags with
+ * their raw values. The hash is walked once, whatever its size.
+ */
+void egt_gps_from_hash(egt_gps_t *gps, VALUE values)
+{
+    gps->byte_order = EXIF_BYTE_ORDER_MOTOROLA;
+    rb_hash_foreach(values, egt_gps_from_hash_i, (VALUE)gps);
 }
 
-static void egt_save_exif_to_file(ExifData *exif_data, char *file_path)
+static VALUE egt_gps_to_hash(const egt_gps_t *gps)
 {
-    JPEGData *jdata;
-    unsigned char *exif_blob = NULL;
-    unsigned int exif_blob_len;
+    VALUE values = rb_hash_new();
 
-    /* Parse the JPEG file. */
-    jdata = jpeg_data_new();
-    jpeg_data_log(jdata, logger);
-    jpeg_data_load_file(jdata, file_path);
+#define X(e, i)                                                                                                        \
+    if (gps->present & EGT_BIT(EGT_TAG_##i)) {                                                                         \
+        rb_hash_aset(values, egt_sym_##i, egt_value_to_ruby(e, &gps->values[EGT_TAG_##i], gps->byte_order));           \
+    }
+    TAG_MAPPING(X)
+#undef X
+    return values;
+}
 
-    /* Make sure the EXIF data is not too big. */
-    exif_data_save_data(exif_data, &exif_blob, &exif_blob_len);
-    if (exif_blob_len) {
-        free(exif_blob);
-        if (exif_blob_len > 0xffff) {
-            rb_raise(rb_eArgError, "too much EXIF data (%i bytes). Only %i bytes are allowed.", exif_blob_len, 0xffff);
-        }
-    };
+static void egt_gps_free(void *ptr)
+{
+    egt_gps_clear(ptr);
+    xfree(ptr);
+}
 
-    jpeg_data_set_exif_data(jdata, exif_data);
+static size_t egt_gps_memsize(const void *ptr)
+{
+    const egt_gps_t *gps = ptr;
+    size_t size = sizeof(egt_gps_t);
+    int i;
 
-    if (!jpeg_data_save_file(jdata, file_path)) {
-        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "failed to write updated EXIF to %s", file_path);
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        size += gps->values[i].alloc;
     }
-    jpeg_data_unref(jdata);
+    return size;
 }
 
-static VALUE egt_write_tag(VALUE self, VALUE file_path, VALUE new_values)
+static const rb_data_type_t egt_gps_type = {
+    "ExifGeoTag::GPS",
+    {NULL, egt_gps_free, egt_gps_memsize},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * Wraps found values into ExifGeoTag::GPS, which takes ownership of them.
+ * Ruby objects are created only for the fields, which are read.
+ */
+static VALUE egt_gps_wrap(egt_gps_t *gps)
 {
-    ExifData *exif_data;
-    ExifMem *mem;
-    VALUE prev_values;
-    (void)self;
+    egt_gps_t *ptr;
+    VALUE obj;
 
-    Check_Type(file_path, T_STRING);
-    Check_Type(new_values, T_HASH);
+    obj = TypedData_Make_Struct(egt_cGPS, egt_gps_t, &egt_gps_type, ptr);
+    *ptr = *gps;
+    memset(gps, 0, sizeof(egt_gps_t));
+    return obj;
+}
 
-    mem = exif_mem_new_default();
-    exif_data = egt_exif_data_new_from_file(mem, RSTRING_PTR(file_path));
-    if (!exif_data) {
-        rb_raise(rb_eArgError, "file not readable or no EXIF data in file");
-    }
+static egt_gps_t *egt_gps_get(VALUE self)
+{
+    egt_gps_t *gps;
 
-    prev_values = rb_hash_new();
+    TypedData_Get_Struct(self, egt_gps_t, &egt_gps_type, gps);
+    return gps;
+}
 
-    egt_parse_virtual_fields(new_values);
-#define X(e, i) egt_handle_tag(mem, exif_data, e, prev_values, new_values, egt_sym_##i);
-    TAG_MAPPING(X)
-#undef X
-    egt_generate_virtual_fields(prev_values);
+static VALUE egt_gps_field(VALUE self, int idx)
+{
+    egt_gps_t *gps = egt_gps_get(self);
 
-    if (rb_hash_size(new_values) > 0) {
-        egt_save_exif_to_file(exif_data, RSTRING_PTR(file_path));
+    if (!(gps->present & EGT_BIT(idx))) {
+        return Qnil;
     }
-
-    exif_data_free(exif_data);
-    exif_mem_unref(mem);
-    return prev_values;
+    return egt_value_to_ruby(egt_tags[idx], &gps->values[idx], gps->byte_order);
 }
 
-#ifdef DEBUG
-/* ANSI escape codes for output colors */
-#define COL_BLUE "\033[34m"
-#define COL_GREEN "\033[32m"
-#define COL_RED "\033[31m"
-#define COL_BOLD "\033[1m"
-#define COL_UNDERLINE "\033[4m"
-#define COL_NORMAL "\033[m"
+/*
+ * Reads rational components of the value as doubles, the way Rational#to_f
+ * does. Returns zero when the value has to go through Ruby objects.
+ */
+static int egt_value_to_doubles(const egt_value_t *value, ExifByteOrder byte_order, double *result,
+                                unsigned long count)
+{
+    ExifRational rat;
+    unsigned long i;
 
-#define put_colorstring(file, colorstring)                                                                             \
-    do {                                                                                                               \
-        if (isatty(fileno(file))) {                                                                                    \
-            fputs(colorstring, file);                                                                                  \
-        }                                                                                                              \
-    } while (0)
+    if (value->format != EXIF_FORMAT_RATIONAL || value->components != count || value->size != 8 * count) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        rat = exif_get_rational(value->data + 8 * i, byte_order);
+        if (rat.denominator == 0) {
+            if (rat.numerator != 0) {
+                return 0;
+            }
+            result[i] = 0.0;
+        } else {
+            result[i] = (double)rat.numerator / (double)rat.denominator;
+        }
+    }
+    return 1;
+}
 
-static void log_func(ExifLog *log, ExifLogCode code, const char *domain, const char *format, va_list args, void *data)
+static VALUE egt_gps_coordinate(VALUE self, int idx, const char *name)
 {
-    (void)log;
-    (void)data;
+    egt_gps_t *gps = egt_gps_get(self);
+    double dms[3];
+    VALUE val;
 
-    switch (code) {
-    case EXIF_LOG_CODE_DEBUG:
-        put_colorstring(stdout, COL_GREEN);
+    if (!(gps->present & EGT_BIT(idx))) {
+        return Qnil;
+    }
+    if (egt_value_to_doubles(&gps->values[idx], gps->byte_order, dms, 3)) {
+        return DBL2NUM(dms[0] + (dms[1] / 60.0 + dms[2] / 3600.0));
+    }
+
+    val = egt_value_to_ruby(egt_tags[idx], &gps->values[idx], gps->byte_order);
+    if (val == Qnil) {
+        return Qnil;
+    }
+    Check_Type(val, T_ARRAY);
+    if (RARRAY_LEN(val) != 3) {
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "Expected %s to have 3 items, but got %ld", name,
+                 RARRAY_LEN(val));
+        return Qnil;
+    }
+    return egt_coordinate_from_dms(val);
+}
+
+static VALUE egt_gps__latitude(VALUE self)
+{
+    return egt_gps_coordinate(self, EGT_TAG_latitude, ":latitude");
+}
+
+static VALUE egt_gps__longitude(VALUE self)
+{
+    return egt_gps_coordinate(self, EGT_TAG_longitude, ":longitude");
+}
+
+static VALUE egt_gps__altitude(VALUE self)
+{
+    egt_gps_t *gps = egt_gps_get(self);
+    double altitude;
+    VALUE val;
+
+    if (!(gps->present & EGT_BIT(EGT_TAG_altitude))) {
+        return Qnil;
+    }
+    if (egt_value_to_doubles(&gps->values[EGT_TAG_altitude], gps->byte_order, &altitude, 1)) {
+        return DBL2NUM(altitude);
+    }
+    val = egt_value_to_ruby(EXIF_TAG_GPS_ALTITUDE, &gps->values[EGT_TAG_altitude], gps->byte_order);
+    return val == Qnil ? Qnil : rb_funcall(val, egt_id_to_f, 0);
+}
+
+static VALUE egt_gps__timestamp(VALUE self)
+{
+    egt_gps_t *gps = egt_gps_get(self);
+    const egt_value_t *date;
+    double unused[3];
+    VALUE time_stamp, date_stamp;
+
+    if ((gps->present & (EGT_BIT(EGT_TAG_time_stamp) | EGT_BIT(EGT_TAG_date_stamp))) !=
+        (EGT_BIT(EGT_TAG_time_stamp) | EGT_BIT(EGT_TAG_date_stamp))) {
+        return Qnil;
+    }
+
+    date = &gps->values[EGT_TAG_date_stamp];
+    if (date->format == EXIF_FORMAT_ASCII && date->components == 11 && date->size == 11 &&
+        egt_value_to_doubles(&gps->values[EGT_TAG_time_stamp], gps->byte_order, unused, 3)) {
+        const unsigned char *d = gps->values[EGT_TAG_time_stamp].data;
+        long hms[3];
+        int i;
+        VALUE val;
+
+        for (i = 0; i < 3; i++) {
+            ExifRational rat = exif_get_rational(d + 8 * i, gps->byte_order);
+
+            hms[i] = rat.denominator ? (long)(rat.numerator / rat.denominator) : 0;
+        }
+        val = egt_timestamp_new((const char *)date->data, (long)strnlen((const char *)date->data, date->size),
+                                hms[0], hms[1], hms[2]);
+        if (val != Qundef) {
+            return val;
+        }
+    }
+
+    time_stamp = egt_value_to_ruby(EXIF_TAG_GPS_TIME_STAMP, &gps->values[EGT_TAG_time_stamp], gps->byte_order);
+    date_stamp = egt_value_to_ruby(EXIF_TAG_GPS_DATE_STAMP, date, gps->byte_order);
+    if (time_stamp == Qnil || date_stamp == Qnil) {
+        return Qnil;
+    }
+    Check_Type(time_stamp, T_ARRAY);
+    Check_Type(date_stamp, T_STRING);
+    return egt_timestamp_from_gps(time_stamp, date_stamp);
+}
+
+#define X(e, i)                                                                                                        \
+    static VALUE egt_gps_##i(VALUE self)                                                                               \
+    {                                                                                                                  \
+        return egt_gps_field(self, EGT_TAG_##i);                                                                       \
+    }
+TAG_MAPPING(X)
+#undef X
+
+/* GPS#[] accepts the same keys as the hash returned by read_tag */
+static VALUE egt_gps_aref(VALUE self, VALUE key)
+{
+    int idx = egt_tag_index_from_key(key);
+
+    if (idx >= 0) {
+        return egt_gps_field(self, idx);
+    }
+    if (key == egt_sym__latitude) {
+        return egt_gps__latitude(self);
+    }
+    if (key == egt_sym__longitude) {
+        return egt_gps__longitude(self);
+    }
+    if (key == egt_sym__altitude) {
+        return egt_gps__altitude(self);
+    }
+    if (key == egt_sym__timestamp) {
+        return egt_gps__timestamp(self);
+    }
+    return Qnil;
+}
+
+static VALUE egt_gps_to_h(VALUE self)
+{
+    VALUE values = egt_gps_to_hash(egt_gps_get(self));
+
+    egt_generate_virtual_fields(values);
+    return values;
+}
+
+/*
+ * Returns found values either as Hash with virtual fields or, if asked,
+ * as ExifGeoTag::GPS, which then owns them.
+ */
+static VALUE egt_gps_result(egt_gps_t *gps, int as_gps)
+{
+    VALUE values;
+
+    if (as_gps) {
+        return egt_gps_wrap(gps);
+    }
+    values = egt_gps_to_hash(gps);
+    egt_generate_virtual_fields(values);
+    return values;
+}
+
+static int egt_parse_result_type(VALUE options)
+{
+    VALUE val;
+
+    if (options == Qnil) {
+        return 0;
+    }
+    Check_Type(options, T_HASH);
+    val = rb_hash_aref(options, egt_sym_as);
+    if (val == Qnil || val == egt_sym_hash) {
+        return 0;
+    }
+    if (val == egt_sym_gps) {
+        return 1;
+    }
+    rb_raise(rb_eArgError, "unknown result type %+" PRIsVALUE ", expected :hash or :gps", val);
+    return 0;
+}
+
+/*
+ * Writes given values into GPS IFD, and records previous values of the
+ * entries, which already exist. Does not touch Ruby objects.
+ */
+static void egt_gps_apply(ExifMem *mem, ExifData *exif_data, const egt_gps_t *new_values, egt_gps_t *prev_values)
+{
+    ExifByteOrder byte_order = exif_data_get_byte_order(exif_data);
+    ExifContent *ifd = exif_data->ifd[EXIF_IFD_GPS];
+    ExifEntry *entries[EGT_TAG_COUNT], *exif_entry;
+    const egt_value_t *value;
+    unsigned int j;
+    int i;
+
+    /* Look all planned entries up in a single pass over the IFD */
+    memset(entries, 0, sizeof(entries));
+    for (j = 0; j < ifd->count; j++) {
+        i = egt_tag_index(ifd->entries[j]->tag);
+        if (i >= 0 && (new_values->present & EGT_BIT(i)) && !entries[i]) {
+            entries[i] = ifd->entries[j];
+        }
+    }
+
+    prev_values->byte_order = byte_order;
+    for (i = 0; i < EGT_TAG_COUNT; i++) {
+        if (!(new_values->present & EGT_BIT(i))) {
+            continue;
+        }
+        exif_entry = entries[i];
+        if (!exif_entry) {
+            exif_entry = exif_entry_new_mem(mem);
+            if (!exif_entry) {
+                EXIF_LOG_NO_MEMORY(logger, "RubyExt", sizeof(ExifEntry));
+                continue;
+            }
+            exif_entry->tag = egt_tags[i];
+            exif_content_add_entry(exif_data->ifd[EXIF_IFD_GPS], exif_entry);
+            egt_exif_entry_initialize(mem, exif_entry, egt_tags[i]);
+            /* the entry has been added to the IFD, so we can unref it */
+            exif_entry_unref(exif_entry);
+        } else {
+            egt_value_t *prev = &prev_values->values[i];
+
+            if (egt_value_reserve(prev, exif_entry->size)) {
+                prev->format = exif_entry->format;
+                prev->components = exif_entry->components;
+                prev->size = exif_entry->size;
+                memcpy(prev->data, exif_entry->data, exif_entry->size);
+                prev_values->present |= EGT_BIT(i);
+            }
+        }
+
+        value = &new_values->values[i];
+        if (value->size) {
+            unsigned char *data = exif_mem_alloc(mem, value->size);
+
+            if (!data) {
+                EXIF_LOG_NO_MEMORY(logger, "RubyExt", value->size);
+                continue;
+            }
+            memcpy(data, value->data, value->size);
+            if (new_values->byte_order != byte_order) {
+                exif_array_set_byte_order(value->format, data, value->components, new_values->byte_order, byte_order);
+            }
+            if (exif_entry->data) {
+                exif_mem_free(mem, exif_entry->data);
+            }
+            exif_entry->format = value->format;
+            exif_entry->components = value->components;
+            exif_entry->size = value->size;
+            exif_entry->data = data;
+        }
+    }
+}
+
+/*
+ * Reads the payload of the EXIF APP1 segment (starting with "Exif\0\0")
+ * from the head of JPEG file. Only the headers are ever read, the scan
+ * stops at SOS. Returns NULL if there is no EXIF segment.
+ */
+unsigned char *egt_read_app1(const char *path, unsigned int *size)
+{
+    const JPEGScanSegment *segment = NULL;
+    unsigned char *buf = NULL;
+    JPEGScan scan;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    jpeg_scan_init(&scan);
+    jpeg_scan_fd(&scan, fd);
+    while ((segment = jpeg_scan_find(&scan, JPEG_MARKER_APP1, segment)) != NULL) {
+        if (segment->size < 6) {
+            continue;
+        }
+        buf = jpeg_scan_read(fd, segment);
+        if (buf && !memcmp(buf, "Exif\0\0", 6)) {
+            *size = segment->size;
+            break;
+        }
+        free(buf);
+        buf = NULL;
+    }
+    jpeg_scan_clear(&scan);
+    close(fd);
+    return buf;
+}
+
+/* Byte order of TIFF header of EXIF blob, returns zero if it is not one */
+static int egt_tiff_byte_order(const unsigned char *d, unsigned int size, ExifByteOrder *byte_order)
+{
+    if (size < 8) {
+        return 0;
+    }
+    if (!memcmp(d, "II", 2)) {
+        *byte_order = EXIF_BYTE_ORDER_INTEL;
+    } else if (!memcmp(d, "MM", 2)) {
+        *byte_order = EXIF_BYTE_ORDER_MOTOROLA;
+    } else {
+        return 0;
+    }
+    return exif_get_short(d + 2, *byte_order) == 0x002a;
+}
+
+/* The 12 byte entry of the tag in the IFD at the offset, or NULL */
+static const unsigned char *egt_tiff_entry(const unsigned char *d, unsigned int size, ExifByteOrder byte_order,
+                                           unsigned int offset, ExifTag tag)
+{
+    unsigned int n, i;
+
+    if (!offset || offset > size - 2) {
+        return NULL;
+    }
+    n = exif_get_short(d + offset, byte_order);
+    for (i = 0; i < n && offset + 2 + 12 * (i + 1) <= size; i++) {
+        const unsigned char *e = d + offset + 2 + 12 * i;
+
+        if (exif_get_short(e, byte_order) == tag) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* The characters of ASCII entry up to the NUL, or NULL for any other entry */
+static const char *egt_tiff_ascii(const unsigned char *d, unsigned int size, ExifByteOrder byte_order,
+                                  const unsigned char *e, unsigned int *len)
+{
+    unsigned int components, offset;
+    const char *p;
+
+    if (!e || exif_get_short(e + 2, byte_order) != EXIF_FORMAT_ASCII) {
+        return NULL;
+    }
+    components = exif_get_long(e + 4, byte_order);
+    offset = components > 4 ? exif_get_long(e + 8, byte_order) : (unsigned int)(e + 8 - d);
+    if (offset > size || components > size - offset) {
+        return NULL;
+    }
+    p = (const char *)d + offset;
+    for (*len = 0; *len < components && p[*len]; (*len)++) {
+    }
+    return p;
+}
+
+/*
+ * Walks TIFF structure of EXIF blob and collects entries of GPS IFD, which
+ * are listed in TAG_MAPPING. The rest of EXIF data is never decoded. Returns
+ * zero if the blob is not a valid TIFF header.
+ */
+int egt_gps_from_tiff(egt_gps_t *gps, const unsigned char *d, unsigned int size)
+{
+    ExifByteOrder byte_order;
+    const unsigned char *pointer;
+    unsigned int gps_offset, n, i;
+
+    if (!egt_tiff_byte_order(d, size, &byte_order)) {
+        return 0;
+    }
+    gps->byte_order = byte_order;
+
+    /* find GPS IFD pointer in IFD 0 */
+    pointer = egt_tiff_entry(d, size, byte_order, exif_get_long(d + 4, byte_order), EXIF_TAG_GPS_INFO_IFD_POINTER);
+    if (!pointer) {
+        return 1;
+    }
+    gps_offset = exif_get_long(pointer + 8, byte_order);
+    if (!gps_offset || gps_offset > size - 2) {
+        return 1;
+    }
+
+    n = exif_get_short(d + gps_offset, byte_order);
+    for (i = 0; i < n && gps_offset + 2 + 12 * (i + 1) <= size; i++) {
+        const unsigned char *e = d + gps_offset + 2 + 12 * i;
+        egt_value_t *value;
+        unsigned int fsize, vsize, voffset;
+        unsigned long components;
+        int idx;
+
+        idx = egt_tag_index((ExifTag)exif_get_short(e, byte_order));
+        if (idx < 0 || (gps->present & EGT_BIT(idx))) {
+            continue;
+        }
+        fsize = exif_format_get_size((ExifFormat)exif_get_short(e + 2, byte_order));
+        components = exif_get_long(e + 4, byte_order);
+        if (!fsize || components > size / fsize) {
+            continue;
+        }
+        vsize = fsize * components;
+        voffset = vsize > 4 ? exif_get_long(e + 8, byte_order) : (unsigned int)(e + 8 - d);
+        if (voffset > size || vsize > size - voffset) {
+            continue;
+        }
+
+        value = &gps->values[idx];
+        if (!egt_value_reserve(value, vsize)) {
+            continue;
+        }
+        memcpy(value->data, d + voffset, vsize);
+        value->format = (ExifFormat)exif_get_short(e + 2, byte_order);
+        value->components = components;
+        value->size = vsize;
+        gps->present |= EGT_BIT(idx);
+    }
+    return 1;
+}
+
+/*
+ * Signed latitude and longitude out of the GPS fields, read natively. Returns
+ * zero unless both are there and on the globe.
+ */
+int egt_gps_position(const egt_gps_t *gps, double *lat, double *lon)
+{
+    const egt_value_t *ref;
+    double dms[3];
+
+    if ((gps->present & (EGT_BIT(EGT_TAG_latitude) | EGT_BIT(EGT_TAG_longitude))) !=
+        (EGT_BIT(EGT_TAG_latitude) | EGT_BIT(EGT_TAG_longitude))) {
+        return 0;
+    }
+    if (!egt_value_to_doubles(&gps->values[EGT_TAG_latitude], gps->byte_order, dms, 3)) {
+        return 0;
+    }
+    *lat = dms[0] + (dms[1] / 60.0 + dms[2] / 3600.0);
+    ref = &gps->values[EGT_TAG_latitude_ref];
+    if ((gps->present & EGT_BIT(EGT_TAG_latitude_ref)) && ref->size > 0 && ref->data[0] == 'S') {
+        *lat = -*lat;
+    }
+    if (!egt_value_to_doubles(&gps->values[EGT_TAG_longitude], gps->byte_order, dms, 3)) {
+        return 0;
+    }
+    *lon = dms[0] + (dms[1] / 60.0 + dms[2] / 3600.0);
+    ref = &gps->values[EGT_TAG_longitude_ref];
+    if ((gps->present & EGT_BIT(EGT_TAG_longitude_ref)) && ref->size > 0 && ref->data[0] == 'W') {
+        *lon = -*lon;
+    }
+    return *lat >= -90.0 && *lat <= 90.0 && *lon >= -180.0 && *lon <= 180.0;
+}
+
+static JPEGData *egt_jpeg_data_new(ExifMem *mem)
+{
+    JPEGData *jpeg_data;
+
+    jpeg_data = jpeg_data_new();
+    if (!jpeg_data) {
+        return NULL;
+    }
+    jpeg_data_log(jpeg_data, logger);
+    jpeg_data_set_mem(jpeg_data, mem);
+
+    return jpeg_data;
+}
+
+unsigned int egt_parse_options(VALUE options)
+{
+    unsigned int flags = 0;
+
+    if (options != Qnil) {
+        Check_Type(options, T_HASH);
+    }
+    if (options != Qnil && RTEST(rb_hash_aref(options, egt_sym_in_place))) {
+        flags |= JPEG_DATA_OPTION_PATCH_IN_PLACE;
+    }
+    if (options != Qnil && RTEST(rb_hash_aref(options, egt_sym_fsync))) {
+        flags |= JPEG_DATA_OPTION_FSYNC;
+    }
+    if (options == Qnil || rb_hash_aref(options, egt_sym_keep_mode) != Qfalse) {
+        flags |= JPEG_DATA_OPTION_KEEP_MODE;
+    }
+    if (options != Qnil && RTEST(rb_hash_aref(options, egt_sym_keep_mtime))) {
+        flags |= JPEG_DATA_OPTION_KEEP_MTIME;
+    }
+    return flags;
+}
+
+/*
+ * Serializes EXIF data back into the APP1 section of already parsed JPEG.
+ * Returns zero on success, otherwise the size of serialized EXIF blob, which
+ * does not fit into the APP1 segment.
+ */
+static unsigned int egt_store_exif(JPEGData *jpeg_data, ExifMem *mem, ExifData *exif_data)
+{
+    unsigned char *exif_blob = NULL;
+    unsigned int exif_blob_len = 0;
+
+    /* Make sure the EXIF data is not too big. The blob is then written as is. */
+    exif_data_save_data(exif_data, &exif_blob, &exif_blob_len);
+    if (exif_blob && exif_blob_len > 0xffff) {
+        exif_mem_free(mem, exif_blob);
+        return exif_blob_len;
+    }
+
+    if (exif_blob) {
+        jpeg_data_set_exif_blob(jpeg_data, exif_blob, exif_blob_len);
+    } else {
+        jpeg_data_set_exif_data(jpeg_data, exif_data);
+    }
+    return 0;
+}
+
+/* OffsetTimeOriginal of EXIF 2.31, which older libexif has no name for */
+#define EGT_TAG_OFFSET_TIME_ORIGINAL ((ExifTag)0x9011)
+
+/*
+ * Capture time in nanoseconds since the epoch out of DateTimeOriginal
+ * "YYYY:MM:DD HH:MM:SS", the digits of SubSecTimeOriginal and
+ * OffsetTimeOriginal "+HH:MM". Without the offset the camera clock is taken
+ * as UTC. The strings need not be NUL terminated, and subsec and offset may
+ * be NULL. Returns 0 unless the date and time are valid.
+ */
+static int egt_parse_capture_time(const char *p, unsigned int len, const char *subsec, unsigned int subsec_len,
+                                  const char *offset, unsigned int offset_len, int64_t *time)
+{
+    int64_t scale = GPS_TRACK_SECOND;
+    LONG_LONG days;
+    int hour, min, sec;
+    unsigned int i;
+
+    if (len < 19 || p[10] != ' ' || p[13] != ':' || p[16] != ':' || !egt_parse_date(p, &days)) {
+        return 0;
+    }
+    hour = egt_parse_digits(p + 11, 2);
+    min = egt_parse_digits(p + 14, 2);
+    sec = egt_parse_digits(p + 17, 2);
+    if (hour < 0 || hour >= 24 || min < 0 || min >= 60 || sec < 0 || sec >= 60) {
+        return 0;
+    }
+    *time = ((int64_t)days * 86400 + hour * 3600 + min * 60 + sec) * GPS_TRACK_SECOND;
+
+    /* the digits of the fraction of the second, if any */
+    for (i = 0; subsec && i < subsec_len && scale > 1 && subsec[i] >= '0' && subsec[i] <= '9'; i++) {
+        scale /= 10;
+        *time += (subsec[i] - '0') * scale;
+    }
+
+    /* local time is UTC plus the offset; a blank or broken one is ignored */
+    if (offset && offset_len >= 6 && (offset[0] == '+' || offset[0] == '-') && offset[3] == ':') {
+        hour = egt_parse_digits(offset + 1, 2);
+        min = egt_parse_digits(offset + 4, 2);
+        if (hour >= 0 && hour < 24 && min >= 0 && min < 60) {
+            int64_t nanos = (int64_t)(hour * 3600 + min * 60) * GPS_TRACK_SECOND;
+
+            *time += offset[0] == '+' ? -nanos : nanos;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Capture time straight from TIFF structure of EXIF blob: IFD 0, the EXIF
+ * IFD it points to, and the three time tags there. Nothing else is decoded.
+ * Returns EGT_ENOEXIF if the blob is not TIFF, EGT_ENOTIME if it has no
+ * valid capture time.
+ */
+enum egt_status egt_capture_time_from_tiff(const unsigned char *d, unsigned int size, int64_t *time)
+{
+    ExifByteOrder byte_order;
+    const unsigned char *pointer;
+    const char *p, *subsec, *offset;
+    unsigned int exif_offset, len, subsec_len = 0, offset_len = 0;
+
+    if (!egt_tiff_byte_order(d, size, &byte_order)) {
+        return EGT_ENOEXIF;
+    }
+    pointer = egt_tiff_entry(d, size, byte_order, exif_get_long(d + 4, byte_order), EXIF_TAG_EXIF_IFD_POINTER);
+    if (!pointer) {
+        return EGT_ENOTIME;
+    }
+    exif_offset = exif_get_long(pointer + 8, byte_order);
+    p = egt_tiff_ascii(d, size, byte_order,
+                       egt_tiff_entry(d, size, byte_order, exif_offset, EXIF_TAG_DATE_TIME_ORIGINAL), &len);
+    subsec = egt_tiff_ascii(d, size, byte_order,
+                            egt_tiff_entry(d, size, byte_order, exif_offset, EXIF_TAG_SUB_SEC_TIME_ORIGINAL),
+                            &subsec_len);
+    offset = egt_tiff_ascii(d, size, byte_order,
+                            egt_tiff_entry(d, size, byte_order, exif_offset, EGT_TAG_OFFSET_TIME_ORIGINAL),
+                            &offset_len);
+    if (!p || !egt_parse_capture_time(p, len, subsec, subsec_len, offset, offset_len, time)) {
+        return EGT_ENOTIME;
+    }
+    return EGT_OK;
+}
+
+static ExifLong egt_gcd(ExifLong a, ExifLong b)
+{
+    ExifLong t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Same triplet as egt_coordinate_to_dms() gives for the Float, v must be within 0..180 */
+static void egt_dms_from_double(double v, unsigned char *data)
+{
+    double d = trunc(v), m = trunc((v - d) * 60.0), s = egt_round_millis(((v - d) - m / 60.0) * 3600.0);
+    ExifRational rat;
+    ExifLong gcd;
+
+    rat.denominator = 1;
+    rat.numerator = (ExifLong)d;
+    exif_set_rational(data, EXIF_BYTE_ORDER_MOTOROLA, rat);
+    rat.numerator = (ExifLong)m;
+    exif_set_rational(data + sizeof(ExifRational), EXIF_BYTE_ORDER_MOTOROLA, rat);
+    /* k/1000 in lowest terms, as Rational has it */
+    gcd = egt_gcd((ExifLong)s, 1000);
+    rat.numerator = (ExifLong)s / gcd;
+    rat.denominator = 1000 / gcd;
+    exif_set_rational(data + 2 * sizeof(ExifRational), EXIF_BYTE_ORDER_MOTOROLA, rat);
+}
+
+int egt_gps_store(egt_gps_t *gps, int idx, ExifFormat format, unsigned long components, const void *data)
+{
+    if (!egt_value_store(&gps->values[idx], format, components, data)) {
+        return 0;
+    }
+    gps->present |= EGT_BIT(idx);
+    return 1;
+}
+
+/*
+ * Sets the position and UTC time of the fix, as write_tag sets _latitude,
+ * _longitude, _altitude and _timestamp. The altitude is rounded to the
+ * centimeter, and takes its reference. Returns EGT_ERANGE for a position
+ * off the globe, which would not fit the rationals, and EGT_ENOMEM if it
+ * runs out of memory.
+ */
+static enum egt_status egt_gps_from_fix(egt_gps_t *gps, const GPSFix *fix)
+{
+    unsigned char data[3 * sizeof(ExifRational)];
+    int64_t secs = fix->time / GPS_TRACK_SECOND - (fix->time % GPS_TRACK_SECOND < 0);
+    LONG_LONG days = (secs >= 0 ? secs : secs - 86399) / 86400, y;
+    int m, d, sod = (int)(secs - days * 86400), ok = 1;
+    ExifRational rat;
+    ExifByte ref;
+    char date[11];
+
+    if (!(fabs(fix->lat) <= 90.0 && fabs(fix->lon) <= 180.0)) {
+        return EGT_ERANGE;
+    }
+    egt_gps_reset(gps);
+    gps->byte_order = EXIF_BYTE_ORDER_MOTOROLA;
+
+    egt_dms_from_double(fabs(fix->lat), data);
+    ok &= egt_gps_store(gps, EGT_TAG_latitude, EXIF_FORMAT_RATIONAL, 3, data);
+    ok &= egt_gps_store(gps, EGT_TAG_latitude_ref, EXIF_FORMAT_ASCII, 2, fix->lat < 0.0 ? "S" : "N");
+    egt_dms_from_double(fabs(fix->lon), data);
+    ok &= egt_gps_store(gps, EGT_TAG_longitude, EXIF_FORMAT_RATIONAL, 3, data);
+    ok &= egt_gps_store(gps, EGT_TAG_longitude_ref, EXIF_FORMAT_ASCII, 2, fix->lon < 0.0 ? "W" : "E");
+
+    if (!isnan(fix->alt) && fabs(fix->alt) < 4e7) {
+        ExifLong gcd;
+
+        ref = fix->alt < 0.0;
+        rat.numerator = (ExifLong)llround(fabs(fix->alt) * 100.0);
+        gcd = egt_gcd(rat.numerator, 100);
+        rat.numerator /= gcd;
+        rat.denominator = 100 / gcd;
+        exif_set_rational(data, EXIF_BYTE_ORDER_MOTOROLA, rat);
+        ok &= egt_gps_store(gps, EGT_TAG_altitude, EXIF_FORMAT_RATIONAL, 1, data);
+        ok &= egt_gps_store(gps, EGT_TAG_altitude_ref, EXIF_FORMAT_BYTE, 1, &ref);
+    }
+
+    egt_civil_from_days(days, &y, &m, &d);
+    if (y > 0 && y < 10000) {
+        snprintf(date, sizeof(date), "%04d:%02d:%02d", (int)y, m, d);
+        ok &= egt_gps_store(gps, EGT_TAG_date_stamp, EXIF_FORMAT_ASCII, 11, date);
+        rat.denominator = 1;
+        rat.numerator = sod / 3600;
+        exif_set_rational(data, EXIF_BYTE_ORDER_MOTOROLA, rat);
+        rat.numerator = sod / 60 % 60;
+        exif_set_rational(data + sizeof(ExifRational), EXIF_BYTE_ORDER_MOTOROLA, rat);
+        rat.numerator = sod % 60;
+        exif_set_rational(data + 2 * sizeof(ExifRational), EXIF_BYTE_ORDER_MOTOROLA, rat);
+        ok &= egt_gps_store(gps, EGT_TAG_time_stamp, EXIF_FORMAT_RATIONAL, 3, data);
+    }
+    return ok ? EGT_OK : EGT_ENOMEM;
+}
+
+/*
+ * Plans the position of the track at the capture time of the photo, returns 0
+ * with the status set if there is none. The time is read from the APP1 section
+ * as it has been loaded, the same way read_capture_times reads it, because
+ * older libexif drops OffsetTimeOriginal.
+ */
+static int egt_job_locate(egt_job_t *job, JPEGData *jpeg_data)
+{
+    const unsigned char *app1;
+    unsigned int size = 0;
+    int64_t time;
+
+    app1 = jpeg_data_get_source_exif(jpeg_data, &size);
+    if (!app1 || size < 6 || memcmp(app1, "Exif\0\0", 6) ||
+        egt_capture_time_from_tiff(app1 + 6, size - 6, &time) != EGT_OK) {
+        job->status = EGT_ENOTIME;
+        return 0;
+    }
+    if (!gps_track_locate(job->track, time + job->clock_offset, job->max_gap, &job->fix)) {
+        job->status = EGT_ENOFIX;
+        return 0;
+    }
+    job->status = egt_gps_from_fix(&job->new_values, &job->fix);
+    if (job->status != EGT_OK) {
+        return 0;
+    }
+    job->plan = &job->new_values;
+    job->save = 1;
+    return 1;
+}
+
+/*
+ * Updates GPS IFD of the JPEG loaded into jpeg_data and, if the job saves,
+ * stores the new EXIF data in its APP1 section. EXIF data is allocated from
+ * mem, which jpeg_data is set up with.
+ */
+static void egt_job_update(egt_job_t *job, JPEGData *jpeg_data, ExifMem *mem)
+{
+    ExifData *exif_data;
+
+    job->status = EGT_OK;
+    /* The file is parsed only once, EXIF data is taken from its APP1 section. */
+    exif_data = jpeg_data_get_exif_data(jpeg_data);
+    if (!exif_data) {
+        job->status = EGT_ENOEXIF;
+        return;
+    }
+    if (job->track && !egt_job_locate(job, jpeg_data)) {
+        exif_data_unref(exif_data);
+        return;
+    }
+    jpeg_data_set_option(jpeg_data, (JPEGDataOption)job->options);
+
+    egt_gps_apply(mem, exif_data, job->plan, &job->prev_values);
+    if (job->save) {
+        job->exif_size = egt_store_exif(jpeg_data, mem, exif_data);
+        if (job->exif_size) {
+            job->status = EGT_ETOOBIG;
+        }
+    }
+    exif_data_unref(exif_data);
+}
+
+/* Loads the file into empty jpeg_data, updates GPS IFD and saves it back */
+static void egt_job_process(egt_job_t *job, JPEGData *jpeg_data, ExifMem *mem)
+{
+    GPSCacheKey key;
+    int keyed;
+
+    jpeg_data_load_file(jpeg_data, job->path);
+    egt_job_update(job, jpeg_data, mem);
+    if (job->status != EGT_OK || !job->save) {
+        return;
+    }
+    /* The file is keyed before it is written, which may keep its inode, size and (keep_mtime) time */
+    keyed = job->cache && egt_cache_key(job->path, &key);
+    errno = 0;
+    if (!jpeg_data_save_file(jpeg_data, job->path)) {
+        job->status = EGT_ESAVE;
+        job->error = errno ? errno : EIO;
+        exif_log(logger, EXIF_LOG_CODE_DEBUG, "RubyExt", "failed to write updated EXIF to %s", job->path);
+    }
+    if (keyed) {
+        gps_cache_forget(job->cache, &key);
+    }
+}
+
+/*
+ * The native part of write_tag. It runs without GVL, so it must not touch
+ * any Ruby objects.
+ */
+static void *egt_job_run(void *arg)
+{
+    egt_job_t *job = arg;
+    JPEGData *jpeg_data;
+    ExifMem *mem;
+
+    mem = exif_mem_new_default();
+    jpeg_data = egt_jpeg_data_new(mem);
+    egt_job_process(job, jpeg_data, mem);
+    jpeg_data_unref(jpeg_data);
+    exif_mem_unref(mem);
+    return NULL;
+}
+
+/*
+ * The native part of read_tag: decodes GPS IFD straight from the APP1
+ * segment, values are reported as prev_values. With the cache, the file
+ * is read only when its identity is not found there. Runs without GVL.
+ */
+static void *egt_read_job_run(void *arg)
+{
+    egt_job_t *job = arg;
+    unsigned char *app1, packed[GPS_CACHE_DATA_SIZE];
+    unsigned int size = 0;
+    size_t packed_size = 0;
+    GPSCacheKey key;
+    int keyed;
+
+    job->status = EGT_OK;
+    keyed = job->cache && egt_cache_key(job->path, &key);
+    if (keyed && gps_cache_lookup(job->cache, &key, packed, &packed_size) &&
+        egt_gps_unpack(&job->prev_values, packed, packed_size)) {
+        return NULL;
+    }
+    app1 = egt_read_app1(job->path, &size);
+    if (!app1 || !egt_gps_from_tiff(&job->prev_values, app1 + 6, size - 6)) {
+        job->status = EGT_ENOEXIF;
+    } else if (keyed && (packed_size = egt_gps_pack(&job->prev_values, packed)) > 0) {
+        gps_cache_store(job->cache, &key, packed, packed_size);
+    }
+    free(app1);
+    return NULL;
+}
+
+void egt_call_without_gvl(void *(*func)(void *), void *data, rb_unblock_function_t *ubf, void *ubf_data)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(func, data, ubf, ubf_data);
+#else
+    (void)ubf;
+    (void)ubf_data;
+    func(data);
+#endif
+}
+
+char *egt_strdup(VALUE str)
+{
+    char *copy;
+
+    copy = malloc(RSTRING_LEN(str) + 1);
+    if (!copy) {
+        rb_raise(rb_eNoMemError, "failed to allocate %ld bytes for file path", RSTRING_LEN(str) + 1);
+    }
+    memcpy(copy, RSTRING_PTR(str), RSTRING_LEN(str));
+    copy[RSTRING_LEN(str)] = 0;
+    return copy;
+}
+
+VALUE egt_job_error(egt_job_t *job)
+{
+    switch (job->status) {
+    case EGT_OK:
+        break;
+    case EGT_ENOEXIF:
+        return rb_exc_new_cstr(rb_eArgError,
+                               job->path ? "file not readable or no EXIF data in file" : "no EXIF data in JPEG data");
+    case EGT_ETOOBIG:
+        return rb_exc_new_str(rb_eArgError, rb_sprintf("too much EXIF data (%i bytes). Only %i bytes are allowed.",
+                                                       job->exif_size, 0xffff));
+    case EGT_ECANCELED:
+        return rb_exc_new_cstr(rb_eRuntimeError, "the file has not been processed");
+    case EGT_ENOMEM:
+        return rb_exc_new_cstr(rb_eNoMemError, "failed to allocate memory for JPEG data");
+    case EGT_ENOTIME:
+        return rb_exc_new_cstr(rb_eArgError, "no capture time in EXIF data");
+    case EGT_ENOFIX:
+        return rb_exc_new_cstr(rb_eRangeError, "the capture time is not covered by the track");
+    case EGT_ESAVE:
+        return rb_syserr_new(job->error, job->path);
+    case EGT_ERANGE:
+        return rb_exc_new_cstr(rb_eArgError, "the track gives a position out of range");
+    }
+    return Qnil;
+}
+
+static VALUE egt_job_clear(VALUE arg)
+{
+    egt_job_t *job = (egt_job_t *)arg;
+
+    free(job->path);
+    job->path = NULL;
+    egt_gps_clear(&job->new_values);
+    egt_gps_clear(&job->prev_values);
+    return Qnil;
+}
+
+static VALUE egt_write_tag_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_job_t *job = (egt_job_t *)args[0];
+
+    job->path = egt_strdup(args[2]);
+    egt_gps_from_hash(&job->new_values, args[1]);
+    job->plan = &job->new_values;
+
+    /* File I/O, parsing and serialization do not need the GVL */
+    egt_call_without_gvl(egt_job_run, job, NULL, NULL);
+    if (job->status != EGT_OK) {
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    return egt_gps_result(&job->prev_values, job->as_gps);
+}
+
+static VALUE egt_write_tag(int argc, VALUE *argv, VALUE self)
+{
+    egt_job_t job;
+    VALUE file_path, new_values, options, args[3], cache = egt_cache_current, result;
+    (void)self;
+
+    rb_scan_args(argc, argv, "21", &file_path, &new_values, &options);
+    Check_Type(file_path, T_STRING);
+    Check_Type(new_values, T_HASH);
+
+    memset(&job, 0, sizeof(job));
+    job.options = egt_parse_options(options);
+    job.as_gps = egt_parse_result_type(options);
+    egt_parse_virtual_fields(new_values);
+    job.save = RHASH_SIZE(new_values) > 0;
+    job.cache = egt_cache_get(cache);
+
+    args[0] = (VALUE)&job;
+    args[1] = new_values;
+    args[2] = file_path;
+    result = rb_ensure(egt_write_tag_body, (VALUE)args, egt_job_clear, (VALUE)&job);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+static VALUE egt_read_tag_body(VALUE arg)
+{
+    egt_job_t *job = (egt_job_t *)arg;
+
+    egt_call_without_gvl(egt_read_job_run, job, NULL, NULL);
+    if (job->status != EGT_OK) {
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    return egt_gps_result(&job->prev_values, job->as_gps);
+}
+
+/*
+ * ExifGeoTag.read_tag(path, as: :hash) returns all GPS fields found in the
+ * file, including the virtual ones. It reads only the headers of JPEG file.
+ */
+static VALUE egt_read_tag(int argc, VALUE *argv, VALUE self)
+{
+    egt_job_t job;
+    VALUE file_path, options, cache = egt_cache_current, result;
+    (void)self;
+
+    rb_scan_args(argc, argv, "11", &file_path, &options);
+    Check_Type(file_path, T_STRING);
+    memset(&job, 0, sizeof(job));
+    job.as_gps = egt_parse_result_type(options);
+    job.cache = egt_cache_get(cache);
+    job.path = egt_strdup(file_path);
+    result = rb_ensure(egt_read_tag_body, (VALUE)&job, egt_job_clear, (VALUE)&job);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+typedef struct {
+    char *path;
+    JPEGScan scan;
+} egt_scan_job_t;
+
+static void *egt_scan_job_run(void *arg)
+{
+    egt_scan_job_t *job = arg;
+
+    jpeg_scan_file(&job->scan, job->path);
+    return NULL;
+}
+
+static VALUE egt_scan_markers_body(VALUE arg)
+{
+    egt_scan_job_t *job = (egt_scan_job_t *)arg;
+    VALUE segments, segment;
+    unsigned int i;
+
+    egt_call_without_gvl(egt_scan_job_run, job, NULL, NULL);
+    if (!job->scan.count) {
+        rb_raise(rb_eArgError, "file not readable or not a JPEG file");
+    }
+
+    segments = rb_ary_new_capa(job->scan.count);
+    for (i = 0; i < job->scan.count; i++) {
+        const JPEGScanSegment *s = &job->scan.segments[i];
+        const char *name = jpeg_marker_get_name(s->marker);
+
+        segment = rb_hash_new();
+        rb_hash_aset(segment, egt_sym_marker, name ? ID2SYM(rb_intern(name)) : INT2FIX(s->marker));
+        rb_hash_aset(segment, egt_sym_offset, OFFT2NUM(s->offset));
+        rb_hash_aset(segment, egt_sym_size, UINT2NUM(s->size));
+        rb_ary_push(segments, segment);
+    }
+    return segments;
+}
+
+static VALUE egt_scan_markers_clear(VALUE arg)
+{
+    egt_scan_job_t *job = (egt_scan_job_t *)arg;
+
+    free(job->path);
+    jpeg_scan_clear(&job->scan);
+    return Qnil;
+}
+
+/*
+ * ExifGeoTag.scan_markers(path) lists segments of JPEG file in front of the
+ * image data, it stops reading at the first SOS marker.
+ */
+static VALUE egt_scan_markers(VALUE self, VALUE file_path)
+{
+    egt_scan_job_t job;
+    (void)self;
+
+    Check_Type(file_path, T_STRING);
+    jpeg_scan_init(&job.scan);
+    job.path = egt_strdup(file_path);
+    return rb_ensure(egt_scan_markers_body, (VALUE)&job, egt_scan_markers_clear, (VALUE)&job);
+}
+
+/*
+ * Finds the payload of the EXIF APP1 segment (starting with "Exif\0\0") in
+ * JPEG data. Returns NULL if there is no EXIF segment.
+ */
+static const unsigned char *egt_find_app1(const unsigned char *d, size_t size, unsigned int *app1_size)
+{
+    const JPEGScanSegment *segment = NULL;
+    const unsigned char *app1 = NULL;
+    JPEGScan scan;
+
+    jpeg_scan_init(&scan);
+    jpeg_scan_data(&scan, d, size);
+    while ((segment = jpeg_scan_find(&scan, JPEG_MARKER_APP1, segment)) != NULL) {
+        if (segment->size < 6 || (size_t)JPEG_SCAN_SEGMENT_DATA(segment) > size ||
+            segment->size > size - (size_t)JPEG_SCAN_SEGMENT_DATA(segment)) {
+            continue;
+        }
+        if (!memcmp(d + JPEG_SCAN_SEGMENT_DATA(segment), "Exif\0\0", 6)) {
+            app1 = d + JPEG_SCAN_SEGMENT_DATA(segment);
+            *app1_size = segment->size;
+            break;
+        }
+    }
+    jpeg_scan_clear(&scan);
+    return app1;
+}
+
+static VALUE egt_read_tag_from_string_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_job_t *job = (egt_job_t *)args[0];
+    const unsigned char *app1;
+    unsigned int size = 0;
+
+    /* Only the headers are walked, GPS IFD is decoded in place */
+    app1 = egt_find_app1((const unsigned char *)RSTRING_PTR(args[1]), (size_t)RSTRING_LEN(args[1]), &size);
+    if (!app1 || !egt_gps_from_tiff(&job->prev_values, app1 + 6, size - 6)) {
+        job->status = EGT_ENOEXIF;
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    return egt_gps_result(&job->prev_values, job->as_gps);
+}
+
+/*
+ * ExifGeoTag.read_tag_from_string(jpeg, options = {}) is read_tag for JPEG
+ * data, which is already in memory.
+ */
+static VALUE egt_read_tag_from_string(int argc, VALUE *argv, VALUE self)
+{
+    egt_job_t job;
+    VALUE data, options, args[2];
+    (void)self;
+
+    rb_scan_args(argc, argv, "11", &data, &options);
+    Check_Type(data, T_STRING);
+    memset(&job, 0, sizeof(job));
+    job.as_gps = egt_parse_result_type(options);
+
+    args[0] = (VALUE)&job;
+    args[1] = data;
+    return rb_ensure(egt_read_tag_from_string_body, (VALUE)args, egt_job_clear, (VALUE)&job);
+}
+
+typedef struct {
+    egt_job_t job;
+    /* frozen String, which shares the buffer with the given one */
+    VALUE data;
+    const unsigned char *src;
+    size_t src_size;
+    ExifMem *mem;
+    JPEGData *jpeg_data;
+    /* new sections in front of the unchanged tail of src */
+    const unsigned char *head;
+    size_t head_size;
+    size_t tail;
+    char *out;
+} egt_string_job_t;
+
+/* The native part of write_tag_to_string, the sections borrow the String */
+static void *egt_string_job_run(void *arg)
+{
+    egt_string_job_t *sjob = arg;
+
+    jpeg_data_borrow_data(sjob->jpeg_data, sjob->src, sjob->src_size);
+    egt_job_update(&sjob->job, sjob->jpeg_data, sjob->mem);
+    if (sjob->job.status == EGT_OK && sjob->job.save &&
+        !jpeg_data_save_head(sjob->jpeg_data, &sjob->head, &sjob->head_size, &sjob->tail)) {
+        sjob->job.status = EGT_ENOMEM;
+    }
+    return NULL;
+}
+
+static void *egt_string_job_copy(void *arg)
+{
+    egt_string_job_t *sjob = arg;
+
+    memcpy(sjob->out, sjob->head, sjob->head_size);
+    memcpy(sjob->out + sjob->head_size, sjob->src + sjob->tail, sjob->src_size - sjob->tail);
+    return NULL;
+}
+
+static VALUE egt_write_tag_to_string_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_string_job_t *sjob = (egt_string_job_t *)args[0];
+    egt_job_t *job = &sjob->job;
+    VALUE result;
+
+    egt_gps_from_hash(&job->new_values, args[1]);
+    job->plan = &job->new_values;
+
+    sjob->mem = exif_mem_new_default();
+    sjob->jpeg_data = egt_jpeg_data_new(sjob->mem);
+    if (!sjob->jpeg_data) {
+        rb_raise(rb_eNoMemError, "failed to allocate JPEG data");
+    }
+    sjob->src = (const unsigned char *)RSTRING_PTR(sjob->data);
+
+    egt_call_without_gvl(egt_string_job_run, sjob, NULL, NULL);
+    if (job->status != EGT_OK) {
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    if (!job->save) {
+        result = rb_str_dup(sjob->data);
+    } else {
+        result = rb_str_new(NULL, (long)sjob->head_size + (sjob->src_size - sjob->tail));
+        sjob->out = RSTRING_PTR(result);
+        egt_call_without_gvl(egt_string_job_copy, sjob, NULL, NULL);
+    }
+    return rb_assoc_new(result, egt_gps_result(&job->prev_values, job->as_gps));
+}
+
+static VALUE egt_write_tag_to_string_clear(VALUE arg)
+{
+    egt_string_job_t *sjob = (egt_string_job_t *)arg;
+
+    jpeg_data_unref(sjob->jpeg_data);
+    if (sjob->mem) {
+        exif_mem_unref(sjob->mem);
+    }
+    RB_GC_GUARD(sjob->data);
+    return egt_job_clear((VALUE)&sjob->job);
+}
+
+/*
+ * ExifGeoTag.write_tag_to_string(jpeg, tags, options = {}) tags JPEG data,
+ * which is already in memory, and returns the new data along with the old
+ * values. The given String is not changed, nor copied: the sections are
+ * parsed in place, and only the unchanged tail is copied into the result.
+ */
+static VALUE egt_write_tag_to_string(int argc, VALUE *argv, VALUE self)
+{
+    egt_string_job_t sjob;
+    VALUE data, new_values, options, args[2];
+    (void)self;
+
+    rb_scan_args(argc, argv, "21", &data, &new_values, &options);
+    memset(&sjob, 0, sizeof(sjob));
+    Check_Type(data, T_STRING);
+    Check_Type(new_values, T_HASH);
+    sjob.job.as_gps = egt_parse_result_type(options);
+    egt_parse_virtual_fields(new_values);
+    sjob.job.save = RHASH_SIZE(new_values) > 0;
+    /* Changes to the given String, made meanwhile, go to its own copy */
+    sjob.data = rb_str_new_frozen(data);
+    /* the fields above may have run Ruby code, which resized the String */
+    sjob.src_size = (size_t)RSTRING_LEN(sjob.data);
+
+    args[0] = (VALUE)&sjob;
+    args[1] = new_values;
+    return rb_ensure(egt_write_tag_to_string_body, (VALUE)args, egt_write_tag_to_string_clear, (VALUE)&sjob);
+}
+
+typedef struct {
+    egt_string_job_t sjob;
+    VALUE in;
+    VALUE out;
+    /* the headers read so far, possibly followed by the beginning of the scan */
+    VALUE head;
+    JPEGScan scan;
+} egt_stream_job_t;
+
+/* Reads the next chunk of the input, returns nil at its end */
+VALUE egt_stream_read(VALUE io)
+{
+    VALUE chunk = rb_funcall(io, egt_id_read, 1, INT2FIX(EGT_STREAM_CHUNK));
+
+    if (chunk == Qnil) {
+        return Qnil;
+    }
+    Check_Type(chunk, T_STRING);
+    return RSTRING_LEN(chunk) ? chunk : Qnil;
+}
+
+/*
+ * Reads the input until the headers are complete, i.e. up to the end of SOS
+ * header, and returns their size. Stops earlier at the end of the input, or
+ * when the data does not look like JPEG any more, then all of it is returned.
+ */
+static size_t egt_stream_read_head(egt_stream_job_t *stream)
+{
+    const JPEGScanSegment *last;
+    size_t size = 0, end;
+    VALUE chunk;
+
+    for (;;) {
+        chunk = egt_stream_read(stream->in);
+        if (chunk == Qnil) {
+            return size;
+        }
+        rb_str_buf_append(stream->head, chunk);
+        size = (size_t)RSTRING_LEN(stream->head);
+
+        if (!jpeg_scan_data(&stream->scan, (const unsigned char *)RSTRING_PTR(stream->head), size)) {
+            return size;
+        }
+        last = &stream->scan.segments[stream->scan.count - 1];
+        if (last->marker == JPEG_MARKER_EOI) {
+            return size;
+        }
+        if (last->marker == JPEG_MARKER_SOI) {
+            end = (size_t)last->offset + 2;
+        } else {
+            end = (size_t)JPEG_SCAN_SEGMENT_DATA(last) + last->size;
+        }
+        if (stream->scan.complete && end <= size) {
+            return end;
+        }
+        /* A segment, or the next marker, may be cut by the end of the chunk */
+        if (!stream->scan.complete && end <= size && size - end > 16) {
+            return size;
+        }
+    }
+}
+
+static VALUE egt_write_tag_stream_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_stream_job_t *stream = (egt_stream_job_t *)args[0];
+    egt_string_job_t *sjob = &stream->sjob;
+    egt_job_t *job = &sjob->job;
+    long size;
+    VALUE chunk;
+
+    egt_gps_from_hash(&job->new_values, args[1]);
+    job->plan = &job->new_values;
+
+    sjob->mem = exif_mem_new_default();
+    sjob->jpeg_data = egt_jpeg_data_new(sjob->mem);
+    if (!sjob->jpeg_data) {
+        rb_raise(rb_eNoMemError, "failed to allocate JPEG data");
+    }
+
+    /* Only the headers are parsed, the scan is never held in memory as a whole */
+    sjob->src_size = egt_stream_read_head(stream);
+    sjob->src = (const unsigned char *)RSTRING_PTR(stream->head);
+    egt_call_without_gvl(egt_string_job_run, sjob, NULL, NULL);
+    if (job->status != EGT_OK) {
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    size = RSTRING_LEN(stream->head);
+    if (!job->save) {
+        rb_io_write(stream->out, stream->head);
+    } else {
+        rb_io_write(stream->out, rb_str_new((const char *)sjob->head, sjob->head_size));
+        if (sjob->tail < (size_t)size) {
+            rb_io_write(stream->out, rb_str_substr(stream->head, (long)sjob->tail, size - (long)sjob->tail));
+        }
+    }
+    while ((chunk = egt_stream_read(stream->in)) != Qnil) {
+        rb_io_write(stream->out, chunk);
+    }
+
+    return egt_gps_result(&job->prev_values, job->as_gps);
+}
+
+static VALUE egt_write_tag_stream_clear(VALUE arg)
+{
+    egt_stream_job_t *stream = (egt_stream_job_t *)arg;
+
+    jpeg_scan_clear(&stream->scan);
+    RB_GC_GUARD(stream->head);
+    return egt_write_tag_to_string_clear((VALUE)&stream->sjob);
+}
+
+/*
+ * ExifGeoTag.write_tag_stream(in, out, tags, options = {}) reads JPEG data
+ * from in (anything with read(length)), and writes it tagged to out
+ * (anything with write). Only the headers are kept in memory, the scan
+ * is passed through in chunks. Nothing is written if the tagging fails.
+ */
+static VALUE egt_write_tag_stream(int argc, VALUE *argv, VALUE self)
+{
+    egt_stream_job_t stream;
+    VALUE in, out, new_values, options, args[2];
+    (void)self;
+
+    rb_scan_args(argc, argv, "31", &in, &out, &new_values, &options);
+    Check_Type(new_values, T_HASH);
+    memset(&stream, 0, sizeof(stream));
+    stream.sjob.job.as_gps = egt_parse_result_type(options);
+    egt_parse_virtual_fields(new_values);
+    stream.sjob.job.save = RHASH_SIZE(new_values) > 0;
+    stream.in = in;
+    stream.out = out;
+    stream.head = rb_str_buf_new(EGT_STREAM_CHUNK);
+    jpeg_scan_init(&stream.scan);
+
+    args[0] = (VALUE)&stream;
+    args[1] = new_values;
+    return rb_ensure(egt_write_tag_stream_body, (VALUE)args, egt_write_tag_stream_clear, (VALUE)&stream);
+}
+
+typedef struct {
+    egt_job_t *jobs;
+    long count;
+    long next;
+    int nthreads;
+    int canceled;
+    int as_gps;
+    GPSCache *cache;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+} egt_batch_t;
+
+static egt_job_t *egt_batch_next(egt_batch_t *batch)
+{
+    egt_job_t *job = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&batch->lock);
+#endif
+    while (!job && !batch->canceled && batch->next < batch->count) {
+        job = &batch->jobs[batch->next++];
+        if (!job->path) {
+            /* conversion of this entry has failed already */
+            job = NULL;
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    return job;
+}
+
+static void *egt_batch_worker(void *arg)
+{
+    egt_batch_t *batch = arg;
+    egt_job_t *job;
+
+    while ((job = egt_batch_next(batch)) != NULL) {
+        egt_job_run(job);
+    }
+    return NULL;
+}
+
+/*
+ * Runs the worker on the pool of native threads. The calling thread works
+ * as one of the workers.
+ */
+void egt_pool_run(void *(*worker)(void *), void *arg, int nthreads)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_t *threads;
+    int i, started = 0;
+
+    threads = malloc(sizeof(pthread_t) * nthreads);
+    if (threads) {
+        for (i = 1; i < nthreads; i++) {
+            if (pthread_create(&threads[started], NULL, worker, arg) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+    worker(arg);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+#else
+    (void)nthreads;
+    worker(arg);
+#endif
+}
+
+static void *egt_batch_run(void *arg)
+{
+    egt_batch_t *batch = arg;
+
+    egt_pool_run(egt_batch_worker, batch, batch->nthreads);
+    return NULL;
+}
+
+static void egt_batch_cancel(void *arg)
+{
+    egt_batch_t *batch = arg;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&batch->lock);
+#endif
+    batch->canceled = 1;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&batch->lock);
+#endif
+}
+
+static VALUE egt_batch_clear(VALUE arg)
+{
+    egt_batch_t *batch = (egt_batch_t *)arg;
+    long i;
+
+    if (batch->jobs) {
+        for (i = 0; i < batch->count; i++) {
+            egt_job_clear((VALUE)&batch->jobs[i]);
+        }
+        free(batch->jobs);
+        batch->jobs = NULL;
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&batch->lock);
+#endif
+    return Qnil;
+}
+
+int egt_batch_threads(VALUE options)
+{
+    VALUE val = Qnil;
+    long nthreads;
+
+    if (options != Qnil) {
+        val = rb_hash_aref(options, egt_sym_threads);
+    }
+    if (val == Qnil) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    } else {
+        nthreads = NUM2LONG(val);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > 256) {
+        nthreads = 256;
+    }
+    return (int)nthreads;
+}
+
+/*
+ * Returns the StandardError caught by rb_protect, and lets anything else
+ * (Interrupt, SystemExit, throw) go on, once the caller has cleaned up.
+ */
+VALUE egt_rescued(int state)
+{
+    VALUE error = rb_errinfo();
+
+    /* a throw leaves no exception object there */
+    if (!RB_TYPE_P(error, T_OBJECT) || !rb_obj_is_kind_of(error, rb_eStandardError)) {
+        rb_jump_tag(state);
+    }
+    rb_set_errinfo(Qnil);
+    return error;
+}
+
+static VALUE egt_write_tags_convert(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_job_t *job = (egt_job_t *)args[0];
+    egt_job_t *prev_job = (egt_job_t *)args[2];
+    VALUE pair = args[1], prev_pair = args[3], file_path, new_values;
+
+    Check_Type(pair, T_ARRAY);
+    if (RARRAY_LEN(pair) != 2) {
+        rb_raise(rb_eArgError, "expected [path, tags] pair, but got %ld items", RARRAY_LEN(pair));
+    }
+    file_path = rb_ary_entry(pair, 0);
+    new_values = rb_ary_entry(pair, 1);
+    Check_Type(file_path, T_STRING);
+    Check_Type(new_values, T_HASH);
+
+    if (prev_job && prev_job->path && RB_TYPE_P(prev_pair, T_ARRAY) && rb_ary_entry(prev_pair, 1) == new_values) {
+        /* the same tags as in the previous pair, reuse its plan */
+        job->save = prev_job->save;
+        job->plan = prev_job->plan;
+    } else {
+        egt_parse_virtual_fields(new_values);
+        job->save = RHASH_SIZE(new_values) > 0;
+        egt_gps_from_hash(&job->new_values, new_values);
+        job->plan = &job->new_values;
+    }
+    job->path = egt_strdup(file_path);
+    return Qnil;
+}
+
+static VALUE egt_write_tags_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_batch_t *batch = (egt_batch_t *)args[0];
+    VALUE pairs = args[1], results;
+    unsigned int options = (unsigned int)args[2];
+    long i;
+
+    results = rb_ary_new_capa(batch->count);
+    /* Convert everything up front, so that workers never need Ruby */
+    for (i = 0; i < batch->count; i++) {
+        egt_job_t *job = &batch->jobs[i];
+        VALUE convert_args[4];
+        int state = 0;
+
+        job->options = options;
+        job->as_gps = batch->as_gps;
+        job->cache = batch->cache;
+        job->status = EGT_ECANCELED;
+        convert_args[0] = (VALUE)job;
+        convert_args[1] = rb_ary_entry(pairs, i);
+        convert_args[2] = (VALUE)(i > 0 ? &batch->jobs[i - 1] : NULL);
+        convert_args[3] = i > 0 ? rb_ary_entry(pairs, i - 1) : Qnil;
+        rb_protect(egt_write_tags_convert, (VALUE)convert_args, &state);
+        if (state) {
+            egt_job_clear((VALUE)job);
+            rb_ary_store(results, i, egt_rescued(state));
+        }
+    }
+
+    egt_call_without_gvl(egt_batch_run, batch, egt_batch_cancel, batch);
+    rb_thread_check_ints();
+
+    for (i = 0; i < batch->count; i++) {
+        egt_job_t *job = &batch->jobs[i];
+
+        if (!job->path) {
+            continue;
+        }
+        if (job->status != EGT_OK) {
+            rb_ary_store(results, i, egt_job_error(job));
+            continue;
+        }
+        rb_ary_store(results, i, egt_gps_result(&job->prev_values, job->as_gps));
+    }
+    return results;
+}
+
+/*
+ * ExifGeoTag.write_tags([[path, tags], ...], threads: n) tags many files
+ * on a pool of native threads. Returns array with previous values (or
+ * exception objects for the files, which have not been tagged) in the same
+ * order as the pairs.
+ */
+static VALUE egt_write_tags(int argc, VALUE *argv, VALUE self)
+{
+    egt_batch_t batch;
+    VALUE pairs, options, args[3], cache = egt_cache_current, result;
+    (void)self;
+
+    rb_scan_args(argc, argv, "11", &pairs, &options);
+    Check_Type(pairs, T_ARRAY);
+
+    memset(&batch, 0, sizeof(batch));
+    args[2] = (VALUE)egt_parse_options(options);
+    batch.as_gps = egt_parse_result_type(options);
+    batch.cache = egt_cache_get(cache);
+    batch.nthreads = egt_batch_threads(options);
+    batch.count = RARRAY_LEN(pairs);
+    if (batch.nthreads > batch.count) {
+        batch.nthreads = batch.count > 0 ? (int)batch.count : 1;
+    }
+    batch.jobs = calloc(batch.count > 0 ? batch.count : 1, sizeof(egt_job_t));
+    if (!batch.jobs) {
+        rb_raise(rb_eNoMemError, "failed to allocate %ld jobs", batch.count);
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&batch.lock, NULL);
+#endif
+
+    args[0] = (VALUE)&batch;
+    args[1] = pairs;
+    result = rb_ensure(egt_write_tags_body, (VALUE)args, egt_batch_clear, (VALUE)&batch);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+#ifdef HAVE_TLS
+/*
+ * Arena behind the ExifMem of ExifGeoTag::Writer. libexif passes no context
+ * to the callbacks, so they use the arena of the current thread. Blocks are
+ * carved from chunks, which are kept between files, freeing them does
+ * nothing, and the whole arena is emptied once the file is done.
+ */
+
+/* Precedes every block handed out to libexif, keeps blocks aligned as malloc does */
+typedef struct {
+    size_t size;
+    size_t heap;
+} egt_mem_header_t;
+
+#define EGT_ARENA_CHUNK_SIZE 65536
+#define EGT_ARENA_ROUND(n) (((n) + sizeof(egt_mem_header_t) - 1) & ~(sizeof(egt_mem_header_t) - 1))
+#define EGT_ARENA_CHUNK_HEADER EGT_ARENA_ROUND(sizeof(egt_arena_chunk_t))
+
+static __thread egt_arena_t *egt_arena_current;
+
+static void *egt_arena_alloc(egt_arena_t *arena, size_t size)
+{
+    egt_arena_chunk_t *chunk = arena->chunks;
+    size_t need = sizeof(egt_mem_header_t) + EGT_ARENA_ROUND(size);
+    egt_mem_header_t *header;
+
+    if (!chunk || chunk->size - chunk->used < need) {
+        size_t chunk_size = chunk ? chunk->size * 2 : EGT_ARENA_CHUNK_SIZE;
+
+        while (chunk_size - EGT_ARENA_CHUNK_HEADER < need) {
+            chunk_size *= 2;
+        }
+        chunk = malloc(chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->used = EGT_ARENA_CHUNK_HEADER;
+        arena->chunks = chunk;
+    }
+
+    header = (egt_mem_header_t *)((unsigned char *)chunk + chunk->used);
+    chunk->used += need;
+    header->size = size;
+    header->heap = 0;
+    /* libexif expects zeroed memory, as calloc gives */
+    memset(header + 1, 0, size);
+    arena->last = header + 1;
+    return header + 1;
+}
+
+static void *egt_arena_realloc(egt_arena_t *arena, void *ptr, size_t size)
+{
+    egt_mem_header_t *header = (egt_mem_header_t *)ptr - 1;
+    egt_arena_chunk_t *chunk = arena->chunks;
+    void *data;
+
+    if (ptr == arena->last) {
+        size_t old_size = EGT_ARENA_ROUND(header->size);
+        size_t new_size = EGT_ARENA_ROUND(size);
+
+        if (new_size <= old_size || new_size - old_size <= chunk->size - chunk->used) {
+            chunk->used = chunk->used - old_size + new_size;
+            header->size = size;
+            return ptr;
+        }
+    }
+    data = egt_arena_alloc(arena, size);
+    if (data) {
+        memcpy(data, ptr, header->size < size ? header->size : size);
+    }
+    return data;
+}
+
+/* Empties the arena. If it took more than one chunk, they are merged into one */
+static void egt_arena_reset(egt_arena_t *arena)
+{
+    egt_arena_chunk_t *chunk = arena->chunks, *next;
+    size_t total = 0;
+
+    if (chunk && chunk->next) {
+        for (; chunk; chunk = next) {
+            next = chunk->next;
+            total += chunk->size;
+            free(chunk);
+        }
+        chunk = malloc(total);
+        if (chunk) {
+            chunk->next = NULL;
+            chunk->size = total;
+        }
+        arena->chunks = chunk;
+    }
+    if (chunk) {
+        chunk->used = EGT_ARENA_CHUNK_HEADER;
+    }
+    arena->last = NULL;
+}
+
+static void egt_arena_free(egt_arena_t *arena)
+{
+    egt_arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->chunks = NULL;
+    arena->last = NULL;
+}
+
+static size_t egt_arena_memsize(const egt_arena_t *arena)
+{
+    const egt_arena_chunk_t *chunk;
+    size_t size = 0;
+
+    for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+        size += chunk->size;
+    }
+    return size;
+}
+
+/* Outside of the arena (e.g. for ExifMem itself) blocks come from the heap */
+static void *egt_mem_alloc(ExifLong size)
+{
+    egt_mem_header_t *header;
+
+    if (egt_arena_current) {
+        return egt_arena_alloc(egt_arena_current, size);
+    }
+    header = calloc(1, sizeof(egt_mem_header_t) + size);
+    if (!header) {
+        return NULL;
+    }
+    header->size = size;
+    header->heap = 1;
+    return header + 1;
+}
+
+static void egt_mem_free(void *ptr)
+{
+    egt_mem_header_t *header;
+
+    if (!ptr) {
+        return;
+    }
+    header = (egt_mem_header_t *)ptr - 1;
+    if (header->heap) {
+        free(header);
+    }
+}
+
+static void *egt_mem_realloc(void *ptr, ExifLong size)
+{
+    egt_mem_header_t *header;
+    void *data;
+
+    if (!ptr) {
+        return egt_mem_alloc(size);
+    }
+    if (!size) {
+        egt_mem_free(ptr);
+        return NULL;
+    }
+    header = (egt_mem_header_t *)ptr - 1;
+    if (header->heap) {
+        header = realloc(header, sizeof(egt_mem_header_t) + size);
+        if (!header) {
+            return NULL;
+        }
+        header->size = size;
+        return header + 1;
+    }
+    if (egt_arena_current) {
+        return egt_arena_realloc(egt_arena_current, ptr, size);
+    }
+    data = egt_mem_alloc(size);
+    if (data) {
+        memcpy(data, ptr, header->size < size ? header->size : size);
+    }
+    return data;
+}
+#endif
+
+void egt_writer_clear(egt_writer_t *writer)
+{
+    jpeg_data_unref(writer->jpeg_data);
+    if (writer->mem) {
+        exif_mem_unref(writer->mem);
+    }
+#ifdef HAVE_TLS
+    egt_arena_free(&writer->arena);
+#endif
+    free(writer->job.path);
+    egt_gps_clear(&writer->job.new_values);
+    egt_gps_clear(&writer->job.prev_values);
+}
+
+static void egt_writer_free(void *ptr)
+{
+    egt_writer_clear(ptr);
+    xfree(ptr);
+}
+
+static size_t egt_writer_memsize(const void *ptr)
+{
+    const egt_writer_t *writer = ptr;
+    size_t size = sizeof(egt_writer_t) + writer->path_alloc;
+
+#ifdef HAVE_TLS
+    size += egt_arena_memsize(&writer->arena);
+#endif
+    return size + egt_gps_memsize(&writer->job.new_values) + egt_gps_memsize(&writer->job.prev_values);
+}
+
+static const rb_data_type_t egt_writer_type = {
+    "ExifGeoTag::Writer",
+    {NULL, egt_writer_free, egt_writer_memsize},
+    NULL,
+    NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE egt_writer_alloc(VALUE klass)
+{
+    egt_writer_t *writer;
+
+    return TypedData_Make_Struct(klass, egt_writer_t, &egt_writer_type, writer);
+}
+
+static egt_writer_t *egt_writer_get(VALUE self)
+{
+    egt_writer_t *writer;
+
+    TypedData_Get_Struct(self, egt_writer_t, &egt_writer_type, writer);
+    if (!writer->jpeg_data) {
+        rb_raise(rb_eRuntimeError, "uninitialized ExifGeoTag::Writer");
+    }
+    return writer;
+}
+
+/* Creates the memory and JPEG data of the writer, returns 0 if it runs out of memory */
+int egt_writer_open(egt_writer_t *writer)
+{
+    if (!writer->mem) {
+#ifdef HAVE_TLS
+        writer->mem = exif_mem_new(egt_mem_alloc, egt_mem_realloc, egt_mem_free);
+#else
+        writer->mem = exif_mem_new_default();
+#endif
+        if (!writer->mem) {
+            return 0;
+        }
+    }
+    if (!writer->jpeg_data) {
+        writer->jpeg_data = egt_jpeg_data_new(writer->mem);
+    }
+    return writer->jpeg_data != NULL;
+}
+
+/* Writer.new(options = {}) takes the same options as write_tag */
+static VALUE egt_writer_initialize(int argc, VALUE *argv, VALUE self)
+{
+    egt_writer_t *writer;
+    VALUE options;
+
+    TypedData_Get_Struct(self, egt_writer_t, &egt_writer_type, writer);
+    rb_scan_args(argc, argv, "01", &options);
+    if (writer->busy) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Writer is in use");
+    }
+    writer->job.options = egt_parse_options(options);
+    writer->job.as_gps = egt_parse_result_type(options);
+
+    if (!egt_writer_open(writer)) {
+        rb_raise(rb_eNoMemError, writer->mem ? "failed to allocate JPEG data" : "failed to allocate EXIF memory");
+    }
+    return self;
+}
+
+void *egt_writer_run(void *arg)
+{
+    egt_writer_t *writer = arg;
+
+#ifdef HAVE_TLS
+    egt_arena_current = &writer->arena;
+#endif
+    egt_job_process(&writer->job, writer->jpeg_data, writer->mem);
+    /* Nothing may point into the arena once it is emptied */
+    jpeg_data_reset(writer->jpeg_data);
+#ifdef HAVE_TLS
+    egt_arena_current = NULL;
+    egt_arena_reset(&writer->arena);
+#endif
+    return NULL;
+}
+
+static void egt_writer_set_path(egt_writer_t *writer, VALUE str)
+{
+    size_t size = RSTRING_LEN(str) + 1;
+
+    if (size > writer->path_alloc) {
+        char *path = realloc(writer->job.path, size);
+
+        if (!path) {
+            rb_raise(rb_eNoMemError, "failed to allocate %zu bytes for file path", size);
+        }
+        writer->job.path = path;
+        writer->path_alloc = size;
+    }
+    memcpy(writer->job.path, RSTRING_PTR(str), size - 1);
+    writer->job.path[size - 1] = 0;
+}
+
+static VALUE egt_writer_write_tag_body(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    egt_writer_t *writer = (egt_writer_t *)args[0];
+    egt_job_t *job = &writer->job;
+
+    egt_writer_set_path(writer, args[2]);
+    egt_gps_reset(&job->new_values);
+    egt_gps_reset(&job->prev_values);
+    egt_gps_from_hash(&job->new_values, args[1]);
+    job->plan = &job->new_values;
+    job->save = RHASH_SIZE(args[1]) > 0;
+
+    egt_call_without_gvl(egt_writer_run, writer, NULL, NULL);
+    if (job->status != EGT_OK) {
+        rb_exc_raise(egt_job_error(job));
+    }
+
+    return egt_gps_result(&job->prev_values, job->as_gps);
+}
+
+static VALUE egt_writer_release(VALUE arg)
+{
+    ((egt_writer_t *)arg)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * Writer#write_tag(path, tags) is write_tag with the options of the writer.
+ * One writer tags one file at a time, use a writer per thread.
+ */
+static VALUE egt_writer_write_tag(VALUE self, VALUE file_path, VALUE new_values)
+{
+    egt_writer_t *writer = egt_writer_get(self);
+    VALUE args[3], cache = egt_cache_current, result;
+
+    Check_Type(file_path, T_STRING);
+    Check_Type(new_values, T_HASH);
+    if (writer->busy) {
+        rb_raise(rb_eRuntimeError, "ExifGeoTag::Writer is in use");
+    }
+    egt_parse_virtual_fields(new_values);
+
+    writer->busy = 1;
+    writer->job.cache = egt_cache_get(cache);
+    args[0] = (VALUE)writer;
+    args[1] = new_values;
+    args[2] = file_path;
+    result = rb_ensure(egt_writer_write_tag_body, (VALUE)args, egt_writer_release, (VALUE)writer);
+    RB_GC_GUARD(cache);
+    return result;
+}
+
+#ifdef DEBUG
+/* ANSI escape codes for output colors */
+#define COL_BLUE "\033[34m"
+#define COL_GREEN "\033[32m"
+#define COL_RED "\033[31m"
+#define COL_BOLD "\033[1m"
+#define COL_UNDERLINE "\033[4m"
+#define COL_NORMAL "\033[m"
+
+#define put_colorstring(file, colorstring)                                                                             \
+    do {                                                                                                               \
+        if (isatty(fileno(file))) {                                                                                    \
+            fputs(colorstring, file);                                                                                  \
+        }                                                                                                              \
+    } while (0)
+
+static void log_func(ExifLog *log, ExifLogCode code, const char *domain, const char *format, va_list args, void *data)
+{
+    (void)log;
+    (void)data;
+
+    switch (code) {
+    case EXIF_LOG_CODE_DEBUG:
+        put_colorstring(stdout, COL_GREEN);
         fprintf(stdout, "%s: ", domain);
         vfprintf(stdout, format, args);
         put_colorstring(stdout, COL_NORMAL);
@@ -1021,7 +3330,36 @@ void Init_exif_geo_tag_ext(void)
 
     egt_mExifGeoTag = rb_define_module("ExifGeoTag");
 
-    rb_define_singleton_method(egt_mExifGeoTag, "write_tag", egt_write_tag, 2);
+    egt_cGPS = rb_define_class_under(egt_mExifGeoTag, "GPS", rb_cObject);
+    rb_undef_alloc_func(egt_cGPS);
+#define X(e, i) rb_define_method(egt_cGPS, #i, egt_gps_##i, 0);
+    TAG_MAPPING(X)
+#undef X
+    rb_define_method(egt_cGPS, "_latitude", egt_gps__latitude, 0);
+    rb_define_method(egt_cGPS, "_longitude", egt_gps__longitude, 0);
+    rb_define_method(egt_cGPS, "_altitude", egt_gps__altitude, 0);
+    rb_define_method(egt_cGPS, "_timestamp", egt_gps__timestamp, 0);
+    rb_define_method(egt_cGPS, "[]", egt_gps_aref, 1);
+    rb_define_method(egt_cGPS, "to_h", egt_gps_to_h, 0);
+
+    egt_cWriter = rb_define_class_under(egt_mExifGeoTag, "Writer", rb_cObject);
+    rb_define_alloc_func(egt_cWriter, egt_writer_alloc);
+    rb_define_method(egt_cWriter, "initialize", egt_writer_initialize, -1);
+    rb_define_method(egt_cWriter, "write_tag", egt_writer_write_tag, 2);
+
+    rb_define_singleton_method(egt_mExifGeoTag, "write_tag", egt_write_tag, -1);
+    rb_define_singleton_method(egt_mExifGeoTag, "write_tags", egt_write_tags, -1);
+    rb_define_singleton_method(egt_mExifGeoTag, "read_tag", egt_read_tag, -1);
+    rb_define_singleton_method(egt_mExifGeoTag, "scan_markers", egt_scan_markers, 1);
+    rb_define_singleton_method(egt_mExifGeoTag, "write_tag_to_string", egt_write_tag_to_string, -1);
+    rb_define_singleton_method(egt_mExifGeoTag, "read_tag_from_string", egt_read_tag_from_string, -1);
+    rb_define_singleton_method(egt_mExifGeoTag, "write_tag_stream", egt_write_tag_stream, -1);
+
+    egt_init_track();
+    egt_init_index();
+    egt_init_cache();
+    egt_init_dir();
+    egt_init_photo();
 
 #define X(e, i) egt_sym_##i = ID2SYM(rb_intern(#i));
     TAG_MAPPING(X)
@@ -1032,7 +3370,36 @@ void Init_exif_geo_tag_ext(void)
     egt_sym__altitude = ID2SYM(rb_intern("_altitude"));
     egt_sym__timestamp = ID2SYM(rb_intern("_timestamp"));
 
-    egt_id_Rational = rb_intern("Rational");
+    egt_sym_in_place = ID2SYM(rb_intern("in_place"));
+    egt_sym_fsync = ID2SYM(rb_intern("fsync"));
+    egt_sym_keep_mode = ID2SYM(rb_intern("keep_mode"));
+    egt_sym_keep_mtime = ID2SYM(rb_intern("keep_mtime"));
+    egt_sym_threads = ID2SYM(rb_intern("threads"));
+    egt_sym_marker = ID2SYM(rb_intern("marker"));
+    egt_sym_offset = ID2SYM(rb_intern("offset"));
+    egt_sym_size = ID2SYM(rb_intern("size"));
+    egt_sym_as = ID2SYM(rb_intern("as"));
+    egt_sym_gps = ID2SYM(rb_intern("gps"));
+    egt_sym_hash = ID2SYM(rb_intern("hash"));
+    egt_sym_tagged = ID2SYM(rb_intern("tagged"));
+    egt_sym_failed = ID2SYM(rb_intern("failed"));
+    egt_sym_skipped = ID2SYM(rb_intern("skipped"));
+    egt_sym_missing = ID2SYM(rb_intern("missing"));
+    egt_sym_seconds = ID2SYM(rb_intern("seconds"));
+    egt_sym_files_per_second = ID2SYM(rb_intern("files_per_second"));
+    egt_sym_clock_offset = ID2SYM(rb_intern("clock_offset"));
+    egt_sym_max_gap = ID2SYM(rb_intern("max_gap"));
+    egt_sym_format = ID2SYM(rb_intern("format"));
+    egt_sym_gpx = ID2SYM(rb_intern("gpx"));
+    egt_sym_kml = ID2SYM(rb_intern("kml"));
+    egt_sym_nmea = ID2SYM(rb_intern("nmea"));
+    egt_sym_time = ID2SYM(rb_intern("time"));
+    egt_sym_indexed = ID2SYM(rb_intern("indexed"));
+    egt_sym_read = ID2SYM(rb_intern("read"));
+    egt_sym_kept = ID2SYM(rb_intern("kept"));
+    egt_sym_removed = ID2SYM(rb_intern("removed"));
+    egt_sym_entries = ID2SYM(rb_intern("entries"));
+
     egt_id_add = rb_intern("+");
     egt_id_div = rb_intern("/");
     egt_id_sub = rb_intern("-");
@@ -1051,6 +3418,7 @@ void Init_exif_geo_tag_ext(void)
     egt_id_sec = rb_intern("sec");
     egt_id_truncate = rb_intern("truncate");
     egt_id_negative_p = rb_intern("negative?");
+    egt_id_read = rb_intern("read");
 
     interned = rb_ary_new();
     rb_const_set(egt_mExifGeoTag, rb_intern("_INTERNED"), interned);
@@ -0,0 +1,424 @@
+/* Shared by the files of the ExifGeoTag extension */
+
+#ifndef EXIF_GEO_TAG_H
+#define EXIF_GEO_TAG_H
+
+#include <strings.h>
+
+#include "config.h"
+#include "ruby.h"
+#include "ruby/encoding.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+RUBY_EXTERN VALUE rb_cRational;
+RUBY_EXTERN VALUE rb_cTime;
+RUBY_EXTERN VALUE rb_cNumeric;
+
+#include <libexif/exif-data.h>
+#include <libexif/exif-entry.h>
+#include <libexif/exif-utils.h>
+
+#include "geo-index.h"
+#include "gps-cache.h"
+#include "gps-parse.h"
+#include "gps-track.h"
+#include "jpeg-data.h"
+#include "jpeg-scan.h"
+
+extern ExifLog *logger;
+#ifndef DEBUG
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define exif_log(...)                                                                                                  \
+    do {                                                                                                               \
+    } while (0)
+#elif defined(__GNUC__)
+#define exif_log(x...)                                                                                                 \
+    do {                                                                                                               \
+    } while (0)
+#else
+#define exif_log (void)
+#endif
+#endif
+
+extern VALUE egt_mExifGeoTag;
+extern VALUE egt_cGPS;
+extern VALUE egt_cWriter;
+extern VALUE egt_cTrack;
+extern VALUE egt_cIndex;
+extern VALUE egt_cCache;
+
+/* ExifGeoTag.cache, which read_tag reads through and the writes invalidate */
+extern VALUE egt_cache_current;
+
+#define TAG_MAPPING(X)                                                                                                 \
+    X(EXIF_TAG_GPS_VERSION_ID, version_id)                                                                             \
+    X(EXIF_TAG_GPS_LATITUDE_REF, latitude_ref)                                                                         \
+    X(EXIF_TAG_GPS_LATITUDE, latitude)                                                                                 \
+    X(EXIF_TAG_GPS_LONGITUDE_REF, longitude_ref)                                                                       \
+    X(EXIF_TAG_GPS_LONGITUDE, longitude)                                                                               \
+    X(EXIF_TAG_GPS_ALTITUDE_REF, altitude_ref)                                                                         \
+    X(EXIF_TAG_GPS_ALTITUDE, altitude)                                                                                 \
+    X(EXIF_TAG_GPS_TIME_STAMP, time_stamp)                                                                             \
+    X(EXIF_TAG_GPS_DATE_STAMP, date_stamp)                                                                             \
+    X(EXIF_TAG_GPS_SATELLITES, satellites)                                                                             \
+    X(EXIF_TAG_GPS_STATUS, status)                                                                                     \
+    X(EXIF_TAG_GPS_MEASURE_MODE, measure_mode)                                                                         \
+    X(EXIF_TAG_GPS_DOP, dop)                                                                                           \
+    X(EXIF_TAG_GPS_SPEED_REF, speed_ref)                                                                               \
+    X(EXIF_TAG_GPS_SPEED, speed)                                                                                       \
+    X(EXIF_TAG_GPS_TRACK_REF, track_ref)                                                                               \
+    X(EXIF_TAG_GPS_TRACK, track)                                                                                       \
+    X(EXIF_TAG_GPS_IMG_DIRECTION_REF, img_direction_ref)                                                               \
+    X(EXIF_TAG_GPS_IMG_DIRECTION, img_direction)                                                                       \
+    X(EXIF_TAG_GPS_MAP_DATUM, map_datum)                                                                               \
+    X(EXIF_TAG_GPS_DEST_LATITUDE_REF, dest_latitude_ref)                                                               \
+    X(EXIF_TAG_GPS_DEST_LATITUDE, dest_latitude)                                                                       \
+    X(EXIF_TAG_GPS_DEST_LONGITUDE_REF, dest_longitude_ref)                                                             \
+    X(EXIF_TAG_GPS_DEST_LONGITUDE, dest_longitude)                                                                     \
+    X(EXIF_TAG_GPS_DEST_BEARING_REF, dest_bearing_ref)                                                                 \
+    X(EXIF_TAG_GPS_DEST_BEARING, dest_bearing)                                                                         \
+    X(EXIF_TAG_GPS_DEST_DISTANCE_REF, dest_distance_ref)                                                               \
+    X(EXIF_TAG_GPS_DEST_DISTANCE, dest_distance)                                                                       \
+    X(EXIF_TAG_GPS_PROCESSING_METHOD, processing_method)                                                               \
+    X(EXIF_TAG_GPS_AREA_INFORMATION, area_information)                                                                 \
+    X(EXIF_TAG_GPS_DIFFERENTIAL, differential)
+
+#define X(e, i) extern ID egt_sym_##i;
+TAG_MAPPING(X)
+#undef X
+
+#define X(e, i) EGT_TAG_##i,
+enum egt_tag_index { TAG_MAPPING(X) EGT_TAG_COUNT };
+#undef X
+
+#define EGT_BIT(idx) (1UL << (idx))
+
+/*
+ * Raw value of the GPS entry, laid out exactly as in ExifEntry. This lets
+ * to keep values between Ruby and libexif without holding the GVL.
+ */
+typedef struct {
+    ExifFormat format;
+    unsigned long components;
+    unsigned int size;
+    unsigned char *data;
+    /* capacity of data, which may outlive the value it was made for */
+    unsigned int alloc;
+} egt_value_t;
+
+typedef struct {
+    /* bit per TAG_MAPPING entry, which is set for given (or found) tags */
+    unsigned long present;
+    ExifByteOrder byte_order;
+    egt_value_t values[EGT_TAG_COUNT];
+} egt_gps_t;
+
+enum egt_status {
+    EGT_OK = 0,
+    EGT_ENOEXIF,
+    EGT_ETOOBIG,
+    EGT_ECANCELED,
+    EGT_ENOMEM,
+    EGT_ENOTIME,
+    EGT_ENOFIX,
+    EGT_ESAVE,
+    EGT_ERANGE
+};
+
+typedef struct {
+    char *path;
+    unsigned int options;
+    int save;
+    egt_gps_t new_values;
+    /* points to new_values, or to the plan of another job in the batch */
+    const egt_gps_t *plan;
+    egt_gps_t prev_values;
+    enum egt_status status;
+    unsigned int exif_size;
+    /* errno of the failed save */
+    int error;
+    int as_gps;
+    /* when set, new_values are located on the track at the capture time of the photo */
+    const GPSTrack *track;
+    int64_t clock_offset;
+    int64_t max_gap;
+    GPSFix fix;
+    /* ExifGeoTag.cache at the start of the call, or NULL */
+    GPSCache *cache;
+} egt_job_t;
+
+extern ID egt_sym__latitude;
+extern ID egt_sym__longitude;
+extern ID egt_sym__altitude;
+extern ID egt_sym__timestamp;
+
+extern ID egt_sym_in_place;
+extern ID egt_sym_fsync;
+extern ID egt_sym_keep_mode;
+extern ID egt_sym_keep_mtime;
+extern ID egt_sym_threads;
+extern ID egt_sym_marker;
+extern ID egt_sym_offset;
+extern ID egt_sym_size;
+extern ID egt_sym_as;
+extern ID egt_sym_gps;
+extern ID egt_sym_hash;
+extern ID egt_sym_tagged;
+extern ID egt_sym_failed;
+extern ID egt_sym_skipped;
+extern ID egt_sym_missing;
+extern ID egt_sym_seconds;
+extern ID egt_sym_files_per_second;
+extern ID egt_sym_clock_offset;
+extern ID egt_sym_max_gap;
+extern ID egt_sym_format;
+extern ID egt_sym_gpx;
+extern ID egt_sym_kml;
+extern ID egt_sym_nmea;
+extern ID egt_sym_time;
+extern ID egt_sym_indexed;
+extern ID egt_sym_read;
+extern ID egt_sym_kept;
+extern ID egt_sym_removed;
+extern ID egt_sym_entries;
+
+extern ID egt_id_add;
+extern ID egt_id_div;
+extern ID egt_id_sub;
+extern ID egt_id_mul;
+extern ID egt_id_to_f;
+extern ID egt_id_to_i;
+extern ID egt_id_rationalize;
+extern ID egt_id_round;
+extern ID egt_id_split;
+extern ID egt_id_utc;
+extern ID egt_id_numerator;
+extern ID egt_id_denominator;
+extern ID egt_id_strftime;
+extern ID egt_id_hour;
+extern ID egt_id_min;
+extern ID egt_id_sec;
+extern ID egt_id_truncate;
+extern ID egt_id_negative_p;
+extern ID egt_id_read;
+
+extern VALUE egt_str_colon;
+extern VALUE egt_str_period;
+extern VALUE egt_str_date_format;
+extern VALUE egt_str_south;
+extern VALUE egt_str_north;
+extern VALUE egt_str_west;
+extern VALUE egt_str_east;
+
+extern VALUE egt_flt_min;
+extern VALUE egt_flt_sec;
+
+#ifdef HAVE_TLS
+/* Arena behind the ExifMem of ExifGeoTag::Writer, which carves the blocks from the chunks */
+typedef struct egt_arena_chunk {
+    struct egt_arena_chunk *next;
+    size_t size;
+    size_t used;
+} egt_arena_chunk_t;
+
+typedef struct {
+    /* the chunk blocks are taken from goes first */
+    egt_arena_chunk_t *chunks;
+    /* the last block, which can be grown in place */
+    void *last;
+} egt_arena_t;
+#endif
+
+/*
+ * ExifGeoTag::Writer keeps everything write_tag allocates per file (EXIF
+ * memory, parsed sections, output buffer and values) between the files.
+ */
+typedef struct {
+    ExifMem *mem;
+    JPEGData *jpeg_data;
+#ifdef HAVE_TLS
+    egt_arena_t arena;
+#endif
+    /* path points to path_alloc bytes owned by the writer */
+    egt_job_t job;
+    size_t path_alloc;
+    int busy;
+} egt_writer_t;
+
+/* Files found in the tree wait in a ring of this size to be tagged */
+#define EGT_DIR_QUEUE_SIZE 1024
+
+typedef struct {
+    /* path relative to the root, as the file is looked up in the tree */
+    char *key;
+    egt_gps_t *values;
+    /* points to values, or to the plan of the previous entry with the same tags */
+    const egt_gps_t *plan;
+    int save;
+    int found;
+    enum egt_status status;
+    unsigned int exif_size;
+    int error;
+} egt_dir_entry_t;
+
+typedef struct {
+    char *path;
+    int err;
+} egt_dir_path_t;
+
+typedef struct {
+    egt_dir_path_t *items;
+    size_t count;
+    size_t alloc;
+} egt_dir_list_t;
+
+typedef struct {
+    egt_dir_entry_t *entry;
+    char *path;
+} egt_dir_file_t;
+
+typedef struct egt_dir_walk {
+    char *root;
+    size_t root_len;
+    unsigned int options;
+    GPSCache *cache;
+    int nthreads;
+    int canceled;
+    int nomem;
+    double seconds;
+
+    /* tags the file found in the tree, or indexes it, and takes its path */
+    void (*visit)(struct egt_dir_walk *walk, egt_writer_t *writer, egt_dir_file_t *file);
+    void *data;
+
+    /* the mapping, looked up by key in the table with open addressing; without it every file is visited */
+    egt_dir_entry_t *entries;
+    long count;
+    egt_dir_entry_t **table;
+    size_t table_mask;
+
+    /* directories to read, and the number of directories being read now */
+    egt_dir_list_t dirs;
+    int reading;
+    egt_dir_file_t *queue;
+    size_t queue_head;
+    size_t queued;
+
+    /* files, which are not in the mapping, and directories, which could not be read */
+    egt_dir_list_t skipped;
+    egt_dir_list_t errors;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} egt_dir_walk_t;
+
+/*
+ * ExifGeoTag::Track keeps the points of a GPS track log natively, in
+ * columns, so that millions of points cost no Ruby objects.
+ */
+typedef struct {
+    GPSTrack track;
+    /* the points are read without GVL while the track tags photos */
+    int busy;
+} egt_track_t;
+
+/* The photo, as little as is kept of it while the batch runs */
+typedef struct {
+    char *path;
+    GPSFix fix;
+    enum egt_status status;
+    unsigned int exif_size;
+    int error;
+} egt_photo_t;
+
+/*
+ * A batch of photos handed out to the workers of a pool one at a time. The
+ * workers store whatever they find in the fix of the photo: the position
+ * written by Track#write_tags, only the time for read_capture_times.
+ */
+typedef struct {
+    void *(*worker)(void *);
+    VALUE (*result)(egt_photo_t *);
+    egt_track_t *track;
+    egt_photo_t *photos;
+    long count;
+    long next;
+    int nthreads;
+    int canceled;
+    unsigned int options;
+    int64_t clock_offset;
+    int64_t max_gap;
+    GPSCache *cache;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+} egt_photo_batch_t;
+
+/* The headers are read, and the scan is passed through, in chunks of this size */
+#define EGT_STREAM_CHUNK 65536
+
+/* exif_geo_tag.c */
+void egt_gps_clear(egt_gps_t *gps);
+void egt_gps_reset(egt_gps_t *gps);
+void egt_parse_virtual_fields(VALUE values);
+void egt_gps_from_hash(egt_gps_t *gps, VALUE values);
+unsigned char *egt_read_app1(const char *path, unsigned int *size);
+int egt_gps_from_tiff(egt_gps_t *gps, const unsigned char *d, unsigned int size);
+int egt_gps_position(const egt_gps_t *gps, double *lat, double *lon);
+unsigned int egt_parse_options(VALUE options);
+enum egt_status egt_capture_time_from_tiff(const unsigned char *d, unsigned int size, int64_t *time);
+int egt_gps_store(egt_gps_t *gps, int idx, ExifFormat format, unsigned long components, const void *data);
+void egt_call_without_gvl(void *(*func)(void *), void *data, rb_unblock_function_t *ubf, void *ubf_data);
+char *egt_strdup(VALUE str);
+VALUE egt_job_error(egt_job_t *job);
+VALUE egt_stream_read(VALUE io);
+void egt_pool_run(void *(*worker)(void *), void *arg, int nthreads);
+int egt_batch_threads(VALUE options);
+VALUE egt_rescued(int state);
+void egt_writer_clear(egt_writer_t *writer);
+int egt_writer_open(egt_writer_t *writer);
+void *egt_writer_run(void *arg);
+
+/* egt-cache.c */
+GPSCache *egt_cache_get(VALUE cache);
+int egt_cache_key(const char *path, GPSCacheKey *key);
+size_t egt_gps_pack(const egt_gps_t *gps, unsigned char *data);
+int egt_gps_unpack(egt_gps_t *gps, const unsigned char *data, size_t size);
+void egt_init_cache(void);
+
+/* egt-dir.c */
+void egt_dir_lock(egt_dir_walk_t *walk);
+void egt_dir_unlock(egt_dir_walk_t *walk);
+void egt_dir_wake(egt_dir_walk_t *walk);
+void *egt_dir_run(void *arg);
+void egt_dir_cancel(void *arg);
+VALUE egt_dir_clear(VALUE arg);
+void egt_dir_walk_init(egt_dir_walk_t *walk, VALUE root, int nthreads, long mapping_size);
+void egt_init_dir(void);
+
+/* egt-track.c */
+int64_t egt_time_to_nanos(VALUE val);
+void egt_init_track(void);
+
+/* egt-photo.c */
+egt_photo_t *egt_photo_next(egt_photo_batch_t *batch);
+void egt_photo_batch_init(egt_photo_batch_t *batch, long count, int nthreads);
+VALUE egt_photo_batch_run(egt_photo_batch_t *batch, VALUE paths);
+void egt_init_photo(void);
+
+/* egt-index.c */
+void egt_init_index(void);
+
+#endif
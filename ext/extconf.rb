@@ -2,5 +2,27 @@ require 'mkmf'
 
 have_library('exif')
 have_header('libexif/exif-data.h')
+have_header('sys/mman.h')
+have_func('mmap', 'sys/mman.h')
+have_func('copy_file_range', 'unistd.h')
+have_header('sys/sendfile.h')
+have_func('sendfile', 'sys/sendfile.h')
+have_func('futimens', 'sys/stat.h')
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_header('pthread.h')
+have_func('flock', 'sys/file.h')
+have_func('sched_yield', 'sched.h')
+# ExifGeoTag::Writer keeps its EXIF memory arena in a thread-local variable
+if try_compile('static __thread int x; int main(void) { return x; }')
+  $defs.push('-DHAVE_TLS')
+end
+# ExifGeoTag::Cache locks the slots of its shared mapping with atomic operations
+if try_link('#include <stdint.h>
+uint64_t n; uint32_t s;
+int main(void) { uint32_t e = 0; __atomic_fetch_add(&n, 1, __ATOMIC_RELAXED);
+  return __atomic_compare_exchange_n(&s, &e, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED); }')
+  $defs.push('-DHAVE_ATOMIC_BUILTINS')
+end
 create_header('config.h')
 create_makefile('exif_geo_tag_ext')
@@ -0,0 +1,776 @@
+/* geo-index.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include "config.h"
+#include "geo-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#define GEO_INDEX_BYTE_ORDER 0x01020304
+
+/* Mean radius of the Earth in meters */
+#define GEO_INDEX_EARTH_RADIUS 6371008.8
+
+/* Runs of records this short are scanned instead of split further */
+#define GEO_INDEX_SCAN 32
+
+/* Records are written in chunks of this many */
+#define GEO_INDEX_CHUNK 1024
+
+#define GEO_INDEX_RAD(d) ((d) * (M_PI / 180.0))
+#define GEO_INDEX_DEG(r) ((r) * (180.0 / M_PI))
+
+static uint32_t
+geo_index_quantize (double v, double min, double span)
+{
+	double q = (v - min) / span * (double) (UINT32_C(1) << GEO_INDEX_ORDER);
+
+	if (!(q > 0))
+		return 0;
+	if (q >= (double) (UINT32_C(1) << GEO_INDEX_ORDER))
+		return (UINT32_C(1) << GEO_INDEX_ORDER) - 1;
+	return (uint32_t) q;
+}
+
+/* Distance along the Hilbert curve of GEO_INDEX_ORDER to the position */
+static uint64_t
+geo_index_hilbert (uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+	uint32_t s, rx, ry, t;
+
+	for (s = UINT32_C(1) << (GEO_INDEX_ORDER - 1); s; s >>= 1) {
+		rx = (x & s) != 0;
+		ry = (y & s) != 0;
+		d += (uint64_t) s * s * ((3 * rx) ^ ry);
+		if (!ry) {
+			/* only the lower bits matter from now on */
+			if (rx) {
+				x = ~x;
+				y = ~y;
+			}
+			t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
+
+uint64_t
+geo_index_cell (double lat, double lon)
+{
+	return geo_index_hilbert (geo_index_quantize (lon, -180.0, 360.0),
+				  geo_index_quantize (lat, -90.0, 180.0));
+}
+
+/* Returns 0 if it runs out of memory */
+static int
+geo_index_result_push (GeoIndexResult *result, uint32_t item)
+{
+	if (result->count == result->alloc) {
+		size_t alloc = result->alloc ? result->alloc * 2 : 256;
+		uint32_t *items = realloc (result->items, alloc * sizeof (uint32_t));
+
+		if (!items)
+			return 0;
+		result->items = items;
+		result->alloc = alloc;
+	}
+	result->items[result->count++] = item;
+	return 1;
+}
+
+void
+geo_index_result_clear (GeoIndexResult *result)
+{
+	if (!result) return;
+	free (result->items);
+	memset (result, 0, sizeof (GeoIndexResult));
+}
+
+/*
+ * Maps the index file, or reads it when mmap is not available, and checks
+ * that every offset in it stays inside. Returns 0 with errno set on
+ * failure, EINVAL when the file is not an index.
+ */
+int
+geo_index_open (GeoIndex *index, const char *path)
+{
+	const GeoIndexHeader *header;
+	struct stat st;
+	size_t i, size, strings;
+	ssize_t r;
+	int fd, err;
+
+	if (!index || !path) {
+		errno = EINVAL;
+		return 0;
+	}
+	memset (index, 0, sizeof (GeoIndex));
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (fstat (fd, &st) < 0) {
+		err = errno;
+		close (fd);
+		errno = err;
+		return 0;
+	}
+	if (st.st_size < (off_t) sizeof (GeoIndexHeader) ||
+	    (unsigned long long) st.st_size > SIZE_MAX) {
+		close (fd);
+		errno = EINVAL;
+		return 0;
+	}
+	size = (size_t) st.st_size;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	index->map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (index->map == MAP_FAILED)
+		index->map = NULL;
+	else
+		index->mapped = 1;
+#endif
+	if (!index->map) {
+		index->map = malloc (size);
+		for (i = 0; index->map && i < size; i += r) {
+			r = read (fd, index->map + i, size - i);
+			if (r <= 0) {
+				err = r < 0 ? errno : EINVAL;
+				free (index->map);
+				index->map = NULL;
+				close (fd);
+				errno = err;
+				return 0;
+			}
+		}
+		if (!index->map) {
+			close (fd);
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+	close (fd);
+	index->map_size = size;
+
+	header = (const GeoIndexHeader *) index->map;
+	size -= sizeof (GeoIndexHeader);
+	if (memcmp (header->magic, GEO_INDEX_MAGIC, 8) ||
+	    header->version != GEO_INDEX_VERSION ||
+	    header->byte_order != GEO_INDEX_BYTE_ORDER ||
+	    header->count > UINT32_MAX || header->timed > header->count ||
+	    header->count > size / (sizeof (GeoIndexRecord) + sizeof (uint32_t)))
+		goto invalid;
+	index->count = (size_t) header->count;
+	index->timed = (size_t) header->timed;
+	size -= index->count * (sizeof (GeoIndexRecord) + sizeof (uint32_t));
+	if (index->timed > size / sizeof (uint32_t))
+		goto invalid;
+	strings = size - index->timed * sizeof (uint32_t);
+	if (!strings || header->strings_size != strings ||
+	    header->root >= strings)
+		goto invalid;
+
+	index->records = (const GeoIndexRecord *) (header + 1);
+	index->times = (const uint32_t *) (index->records + index->count);
+	index->paths = index->times + index->timed;
+	index->strings = (const char *) (index->paths + index->count);
+	index->root = index->strings + header->root;
+	if (index->strings[strings - 1])
+		goto invalid;
+	for (i = 0; i < index->count; i++) {
+		if (index->records[i].path >= strings ||
+		    index->paths[i] >= index->count)
+			goto invalid;
+	}
+	for (i = 0; i < index->timed; i++) {
+		if (index->times[i] >= index->count)
+			goto invalid;
+	}
+	return 1;
+
+invalid:
+	geo_index_close (index);
+	errno = EINVAL;
+	return 0;
+}
+
+void
+geo_index_close (GeoIndex *index)
+{
+	if (!index) return;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	if (index->mapped) {
+		munmap (index->map, index->map_size);
+		memset (index, 0, sizeof (GeoIndex));
+		return;
+	}
+#endif
+	free (index->map);
+	memset (index, 0, sizeof (GeoIndex));
+}
+
+const char *
+geo_index_path (const GeoIndex *index, const GeoIndexRecord *record)
+{
+	return index->strings + record->path;
+}
+
+/* The record of the path relative to the root, or NULL */
+const GeoIndexRecord *
+geo_index_find (const GeoIndex *index, const char *path)
+{
+	size_t lo = 0, hi, mid;
+	const GeoIndexRecord *record;
+	int c;
+
+	if (!index || !path) return NULL;
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		record = &index->records[index->paths[mid]];
+		c = strcmp (path, index->strings + record->path);
+		if (!c)
+			return record;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+typedef struct _GeoIndexQuery GeoIndexQuery;
+struct _GeoIndexQuery
+{
+	const GeoIndex *index;
+	const GeoIndexTimes *times;
+	GeoIndexResult *result;
+
+	/* the box, west is never east of east */
+	double south, west, north, east;
+	uint32_t x0, y0, x1, y1;
+
+	/* for the distance from the point, in radians */
+	int near;
+	double lat, lon, radius;
+};
+
+static double
+geo_index_distance (double lat1, double lon1, double lat2, double lon2)
+{
+	double dlat = sin (GEO_INDEX_RAD (lat2 - lat1) / 2);
+	double dlon = sin (GEO_INDEX_RAD (lon2 - lon1) / 2);
+	double a = dlat * dlat + cos (GEO_INDEX_RAD (lat1)) *
+		cos (GEO_INDEX_RAD (lat2)) * dlon * dlon;
+
+	return 2 * asin (sqrt (a < 1 ? a : 1));
+}
+
+static int
+geo_index_match (const GeoIndexQuery *q, const GeoIndexRecord *record)
+{
+	if (q->times && (!(record->flags & GEO_INDEX_TIME) ||
+			 record->time < q->times->from ||
+			 record->time > q->times->to))
+		return 0;
+	if (record->lat < q->south || record->lat > q->north ||
+	    record->lon < q->west || record->lon > q->east)
+		return 0;
+	return !q->near || geo_index_distance (q->lat, q->lon, record->lat,
+					       record->lon) <= q->radius;
+}
+
+/* The first of the records from 'first' to 'last' with the cell not below */
+static size_t
+geo_index_lower_bound (const GeoIndex *index, size_t first, size_t last,
+		       uint64_t cell)
+{
+	size_t mid;
+
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (index->records[mid].cell < cell)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+	return first;
+}
+
+/*
+ * Looks for the records in the block of 2^k by 2^k positions at x, y,
+ * which takes the cells from lo to hi. The records of the block are only
+ * searched among the records of the parent block, from 'first' to 'last'.
+ */
+static int
+geo_index_descend (GeoIndexQuery *q, uint32_t x, uint32_t y, unsigned int k,
+		   size_t first, size_t last)
+{
+	uint32_t side = (UINT32_C(1) << k) - 1, half;
+	uint64_t lo, hi;
+	uint32_t cx[4], cy[4], t;
+	uint64_t clo[4], tlo;
+	size_t i, j;
+
+	if (x > q->x1 || x + side < q->x0 || y > q->y1 || y + side < q->y0)
+		return 1;
+	lo = geo_index_hilbert (x, y) & ~((UINT64_C(1) << (2 * k)) - 1);
+	hi = lo + ((UINT64_C(1) << (2 * k)) - 1);
+	first = geo_index_lower_bound (q->index, first, last, lo);
+	last = geo_index_lower_bound (q->index, first, last, hi + 1);
+	if (first == last)
+		return 1;
+
+	if (!k || last - first <= GEO_INDEX_SCAN ||
+	    (x >= q->x0 && x + side <= q->x1 &&
+	     y >= q->y0 && y + side <= q->y1)) {
+		for (i = first; i < last; i++) {
+			if (geo_index_match (q, &q->index->records[i]) &&
+			    !geo_index_result_push (q->result, (uint32_t) i))
+				return 0;
+		}
+		return 1;
+	}
+
+	/* the quarters in the order of the curve, so the result stays sorted */
+	half = UINT32_C(1) << (k - 1);
+	for (i = 0; i < 4; i++) {
+		cx[i] = x + (i & 1 ? half : 0);
+		cy[i] = y + (i & 2 ? half : 0);
+		clo[i] = geo_index_hilbert (cx[i], cy[i]);
+		for (j = i; j > 0 && clo[j - 1] > clo[j]; j--) {
+			tlo = clo[j]; clo[j] = clo[j - 1]; clo[j - 1] = tlo;
+			t = cx[j]; cx[j] = cx[j - 1]; cx[j - 1] = t;
+			t = cy[j]; cy[j] = cy[j - 1]; cy[j - 1] = t;
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		if (!geo_index_descend (q, cx[i], cy[i], k - 1, first, last))
+			return 0;
+	}
+	return 1;
+}
+
+/* The box must not cross the antimeridian */
+static int
+geo_index_box (GeoIndexQuery *q, double south, double west, double north,
+	       double east)
+{
+	q->south = south;
+	q->west = west;
+	q->north = north;
+	q->east = east;
+	q->x0 = geo_index_quantize (west, -180.0, 360.0);
+	q->x1 = geo_index_quantize (east, -180.0, 360.0);
+	q->y0 = geo_index_quantize (south, -90.0, 180.0);
+	q->y1 = geo_index_quantize (north, -90.0, 180.0);
+	return geo_index_descend (q, 0, 0, GEO_INDEX_ORDER, 0, q->index->count);
+}
+
+/* Splits the box at the antimeridian, when west is east of east */
+static int
+geo_index_boxes (GeoIndexQuery *q, double south, double west, double north,
+		 double east)
+{
+	if (south < -90.0)
+		south = -90.0;
+	if (north > 90.0)
+		north = 90.0;
+	if (south > north)
+		return 1;
+	if (west <= east)
+		return geo_index_box (q, south, west, north, east);
+	return geo_index_box (q, south, west, north, 180.0) &&
+		geo_index_box (q, south, -180.0, north, east);
+}
+
+/*
+ * Finds the records inside the box, which crosses the antimeridian when
+ * west is east of east. Returns 0 if it runs out of memory.
+ */
+int
+geo_index_within (const GeoIndex *index, double south, double west,
+		  double north, double east, const GeoIndexTimes *times,
+		  GeoIndexResult *result)
+{
+	GeoIndexQuery q;
+
+	if (!index || !result) return 0;
+	if (isnan (south) || isnan (west) || isnan (north) || isnan (east))
+		return 1;
+	memset (&q, 0, sizeof (q));
+	q.index = index;
+	q.times = times;
+	q.result = result;
+	return geo_index_boxes (&q, south, west, north, east);
+}
+
+/*
+ * Finds the records not farther than radius meters from the point, on
+ * a sphere. The search goes through the box around the circle. Returns 0
+ * if it runs out of memory.
+ */
+int
+geo_index_near (const GeoIndex *index, double lat, double lon, double radius,
+		const GeoIndexTimes *times, GeoIndexResult *result)
+{
+	GeoIndexQuery q;
+	double r, dlon, south, north, west, east;
+
+	if (!index || !result) return 0;
+	if (isnan (lat) || isnan (lon) || !(radius >= 0))
+		return 1;
+	memset (&q, 0, sizeof (q));
+	q.index = index;
+	q.times = times;
+	q.result = result;
+	q.near = 1;
+	q.lat = lat;
+	q.lon = lon;
+	q.radius = r = radius / GEO_INDEX_EARTH_RADIUS;
+
+	south = lat - GEO_INDEX_DEG (r);
+	north = lat + GEO_INDEX_DEG (r);
+	if (south <= -90.0 || north >= 90.0)
+		/* the circle takes a pole, and all the longitudes around it */
+		return geo_index_boxes (&q, south, -180.0, north, 180.0);
+	dlon = GEO_INDEX_DEG (asin (sin (r) / cos (GEO_INDEX_RAD (lat))));
+	west = lon - dlon;
+	east = lon + dlon;
+	if (west < -180.0)
+		west += 360.0;
+	if (east > 180.0)
+		east -= 360.0;
+	return geo_index_boxes (&q, south, west, north, east);
+}
+
+/* Finds the records taken within the times, in the order of time */
+int
+geo_index_between (const GeoIndex *index, const GeoIndexTimes *times,
+		   GeoIndexResult *result)
+{
+	size_t lo = 0, hi, mid;
+
+	if (!index || !times || !result) return 0;
+	hi = index->timed;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->records[index->times[mid]].time < times->from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < index->timed &&
+	       index->records[index->times[lo]].time <= times->to; lo++) {
+		if (!geo_index_result_push (result, index->times[lo]))
+			return 0;
+	}
+	return 1;
+}
+
+/* Returns 0 if it runs out of memory */
+int
+geo_index_builder_init (GeoIndexBuilder *builder, const char *root)
+{
+	size_t len;
+
+	if (!builder || !root) return 0;
+	memset (builder, 0, sizeof (GeoIndexBuilder));
+	len = strlen (root) + 1;
+	builder->strings_alloc = len > 65536 ? len : 65536;
+	builder->strings = malloc (builder->strings_alloc);
+	if (!builder->strings)
+		return 0;
+	memcpy (builder->strings, root, len);
+	builder->strings_size = len;
+	return 1;
+}
+
+void
+geo_index_builder_clear (GeoIndexBuilder *builder)
+{
+	if (!builder) return;
+	free (builder->records);
+	free (builder->strings);
+	memset (builder, 0, sizeof (GeoIndexBuilder));
+}
+
+/* Copies the record and the path into the builder, returns 0 on failure */
+int
+geo_index_builder_add (GeoIndexBuilder *builder, const GeoIndexRecord *record,
+		       const char *path)
+{
+	size_t len = strlen (path) + 1, alloc;
+
+	if (builder->count == builder->alloc) {
+		GeoIndexRecord *records;
+
+		alloc = builder->alloc ? builder->alloc * 2 : 1024;
+		if (alloc > (size_t) UINT32_MAX + 1)
+			return 0;
+		records = realloc (builder->records, alloc * sizeof (GeoIndexRecord));
+		if (!records)
+			return 0;
+		builder->records = records;
+		builder->alloc = alloc;
+	}
+	if (builder->strings_size + len > builder->strings_alloc) {
+		char *strings;
+
+		alloc = builder->strings_alloc * 2;
+		while (alloc < builder->strings_size + len)
+			alloc *= 2;
+		if (alloc > (size_t) UINT32_MAX + 1)
+			alloc = (size_t) UINT32_MAX + 1;
+		if (builder->strings_size + len > alloc)
+			return 0;
+		strings = realloc (builder->strings, alloc);
+		if (!strings)
+			return 0;
+		builder->strings = strings;
+		builder->strings_alloc = alloc;
+	}
+	builder->records[builder->count] = *record;
+	builder->records[builder->count].path = (uint32_t) builder->strings_size;
+	memcpy (builder->strings + builder->strings_size, path, len);
+	builder->strings_size += len;
+	builder->count++;
+	return 1;
+}
+
+typedef int (*GeoIndexCompare) (const GeoIndexBuilder *builder,
+				const uint32_t *rank, uint32_t a, uint32_t b);
+
+static int
+geo_index_by_path (const GeoIndexBuilder *builder, const uint32_t *rank,
+		   uint32_t a, uint32_t b)
+{
+	(void) rank;
+	return strcmp (builder->strings + builder->records[a].path,
+		       builder->strings + builder->records[b].path);
+}
+
+/* Ties are broken by the path, so that the file only depends on the tree */
+static int
+geo_index_by_cell (const GeoIndexBuilder *builder, const uint32_t *rank,
+		   uint32_t a, uint32_t b)
+{
+	const GeoIndexRecord *ra = &builder->records[a], *rb = &builder->records[b];
+
+	if (ra->cell != rb->cell)
+		return ra->cell < rb->cell ? -1 : 1;
+	return rank[a] < rank[b] ? -1 : rank[a] > rank[b];
+}
+
+static int
+geo_index_by_time (const GeoIndexBuilder *builder, const uint32_t *rank,
+		   uint32_t a, uint32_t b)
+{
+	const GeoIndexRecord *ra = &builder->records[a], *rb = &builder->records[b];
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	return rank[a] < rank[b] ? -1 : rank[a] > rank[b];
+}
+
+/* Sorts the record numbers by merging runs, with 'tmp' of the same size */
+static void
+geo_index_sort (uint32_t *items, uint32_t *tmp, size_t count,
+		GeoIndexCompare compare, const GeoIndexBuilder *builder,
+		const uint32_t *rank)
+{
+	uint32_t *from = items, *to = tmp, *t;
+	size_t width, lo, mid, hi, i, j, k;
+
+	for (width = 1; width < count; width *= 2) {
+		for (lo = 0; lo < count; lo += 2 * width) {
+			mid = lo + width < count ? lo + width : count;
+			hi = lo + 2 * width < count ? lo + 2 * width : count;
+			for (i = lo, j = mid, k = lo; k < hi; k++) {
+				if (i < mid && (j >= hi ||
+						compare (builder, rank, from[i], from[j]) <= 0))
+					to[k] = from[i++];
+				else
+					to[k] = from[j++];
+			}
+		}
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (from != items)
+		memcpy (items, from, count * sizeof (uint32_t));
+}
+
+static int
+geo_index_write (int fd, const void *d, size_t size)
+{
+	const unsigned char *p = d;
+	ssize_t w;
+
+	while (size) {
+		w = write (fd, p, size);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return 0;
+		p += w;
+		size -= w;
+	}
+	return 1;
+}
+
+static int
+geo_index_builder_save (GeoIndexBuilder *builder, int fd)
+{
+	GeoIndexHeader header;
+	GeoIndexRecord *chunk;
+	uint32_t *by_path, *by_cell, *rank, *pos, *times, *tmp;
+	size_t i, n = builder->count, size, timed = 0;
+	int ok = 0;
+
+	size = (n ? n : 1) * sizeof (uint32_t);
+	by_path = malloc (size);
+	by_cell = malloc (size);
+	rank = malloc (size);
+	pos = malloc (size);
+	times = malloc (size);
+	tmp = malloc (size);
+	chunk = malloc (GEO_INDEX_CHUNK * sizeof (GeoIndexRecord));
+	if (!by_path || !by_cell || !rank || !pos || !times || !tmp || !chunk) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	/* rank by path first, then sort the records by cell and by time */
+	for (i = 0; i < n; i++)
+		by_path[i] = by_cell[i] = (uint32_t) i;
+	geo_index_sort (by_path, tmp, n, geo_index_by_path, builder, NULL);
+	for (i = 0; i < n; i++)
+		rank[by_path[i]] = (uint32_t) i;
+	geo_index_sort (by_cell, tmp, n, geo_index_by_cell, builder, rank);
+	for (i = 0; i < n; i++) {
+		pos[by_cell[i]] = (uint32_t) i;
+		if (builder->records[i].flags & GEO_INDEX_TIME)
+			times[timed++] = (uint32_t) i;
+	}
+	geo_index_sort (times, tmp, timed, geo_index_by_time, builder, rank);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, GEO_INDEX_MAGIC, 8);
+	header.version = GEO_INDEX_VERSION;
+	header.byte_order = GEO_INDEX_BYTE_ORDER;
+	header.count = n;
+	header.timed = timed;
+	header.strings_size = builder->strings_size;
+	header.root = 0;
+	if (!geo_index_write (fd, &header, sizeof (header)))
+		goto out;
+	for (i = 0; i < n; i++) {
+		chunk[i % GEO_INDEX_CHUNK] = builder->records[by_cell[i]];
+		if (((i + 1) % GEO_INDEX_CHUNK == 0 || i + 1 == n) &&
+		    !geo_index_write (fd, chunk, (i % GEO_INDEX_CHUNK + 1) *
+				      sizeof (GeoIndexRecord)))
+			goto out;
+	}
+
+	/* the columns refer to the records in the order they are written */
+	for (i = 0; i < timed; i++)
+		times[i] = pos[times[i]];
+	for (i = 0; i < n; i++)
+		by_path[i] = pos[by_path[i]];
+	if (!geo_index_write (fd, times, timed * sizeof (uint32_t)) ||
+	    !geo_index_write (fd, by_path, n * sizeof (uint32_t)) ||
+	    !geo_index_write (fd, builder->strings, builder->strings_size))
+		goto out;
+	ok = 1;
+
+out:
+	free (by_path);
+	free (by_cell);
+	free (rank);
+	free (pos);
+	free (times);
+	free (tmp);
+	free (chunk);
+	return ok;
+}
+
+/*
+ * Writes the index to a new file next to 'path', which then replaces it,
+ * so that readers never see a partial index. Returns 0 with errno set on
+ * failure.
+ */
+int
+geo_index_builder_write (GeoIndexBuilder *builder, const char *path)
+{
+	static unsigned int counter;
+	const char *slash;
+	char *tmp;
+	size_t dir_len, len;
+	unsigned int n;
+	int fd = -1, i, ok, err;
+
+	if (!builder || !path) {
+		errno = EINVAL;
+		return 0;
+	}
+	/* A name of fixed length in the same directory, however long the name of the index */
+	slash = strrchr (path, '/');
+	dir_len = slash ? (size_t) (slash - path) + 1 : 0;
+	len = dir_len + 32;
+	tmp = malloc (len);
+	if (!tmp) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < 100; i++) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		n = __atomic_fetch_add (&counter, 1, __ATOMIC_RELAXED);
+#else
+		n = counter++;
+#endif
+		snprintf (tmp, len, "%.*s.%08lx%08x.tmp", (int) dir_len, path,
+			  (unsigned long) getpid () & 0xffffffffUL, n);
+		fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (fd < 0) {
+		err = errno;
+		free (tmp);
+		errno = err;
+		return 0;
+	}
+	ok = geo_index_builder_save (builder, fd);
+	err = errno;
+	if (close (fd) < 0 && ok) {
+		ok = 0;
+		err = errno;
+	}
+	if (ok && rename (tmp, path) < 0) {
+		ok = 0;
+		err = errno;
+	}
+	if (!ok)
+		remove (tmp);
+	free (tmp);
+	errno = err;
+	return ok;
+}
@@ -0,0 +1,146 @@
+/* geo-index.h
+ *
+ * Spatial index of photos kept in a file, which is mapped into memory as
+ * it is. The records are packed and sorted by the cell of the position on
+ * the Hilbert curve, so that the photos of any area lie in a few runs of
+ * the records. Two columns of record numbers keep them sorted by capture
+ * time and by path as well.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __GEO_INDEX_H__
+#define __GEO_INDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GEO_INDEX_MAGIC "EGTINDEX"
+#define GEO_INDEX_VERSION 2
+
+/* Bits of the position on each axis, the cell takes twice as many */
+#define GEO_INDEX_ORDER 31
+
+/* Cell of the records without a position, which sort last */
+#define GEO_INDEX_NO_CELL UINT64_MAX
+
+/* Flags of the record */
+#define GEO_INDEX_POSITION 1
+#define GEO_INDEX_TIME     2
+
+/*
+ * The file is the header, the records, the time column (the records with
+ * a capture time), the path column and the strings. Numbers are in the
+ * byte order of the machine, which wrote the file.
+ */
+typedef struct _GeoIndexHeader GeoIndexHeader;
+struct _GeoIndexHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t count;
+	uint64_t timed;
+	uint64_t strings_size;
+
+	/* Offset of the root of the tree in the strings */
+	uint64_t root;
+	uint64_t reserved[2];
+};
+
+typedef struct _GeoIndexRecord GeoIndexRecord;
+struct _GeoIndexRecord
+{
+	uint64_t cell;
+	double lat;
+	double lon;
+
+	/* Capture time, nanoseconds since the epoch */
+	int64_t time;
+
+	/* The file, as it was when it was read. A write, which keeps the
+	 * size and the modification time, still changes ctime */
+	int64_t mtime;
+	int64_t ctime;
+	uint64_t ino;
+	uint64_t size;
+
+	/* Offset of the path relative to the root in the strings */
+	uint32_t path;
+	uint32_t flags;
+};
+
+typedef struct _GeoIndex GeoIndex;
+struct _GeoIndex
+{
+	unsigned char *map;
+	size_t map_size;
+	int mapped;
+
+	const GeoIndexRecord *records;
+	const uint32_t *times;
+	const uint32_t *paths;
+	const char *strings;
+	size_t count;
+	size_t timed;
+	const char *root;
+};
+
+/* Record numbers found by a query */
+typedef struct _GeoIndexResult GeoIndexResult;
+struct _GeoIndexResult
+{
+	uint32_t *items;
+	size_t count;
+	size_t alloc;
+};
+
+/* Capture times a query is limited to, both ends included */
+typedef struct _GeoIndexTimes GeoIndexTimes;
+struct _GeoIndexTimes
+{
+	int64_t from;
+	int64_t to;
+};
+
+/* Records and strings of the index being built */
+typedef struct _GeoIndexBuilder GeoIndexBuilder;
+struct _GeoIndexBuilder
+{
+	GeoIndexRecord *records;
+	size_t count;
+	size_t alloc;
+	char *strings;
+	size_t strings_size;
+	size_t strings_alloc;
+};
+
+uint64_t geo_index_cell (double lat, double lon);
+
+int  geo_index_open    (GeoIndex *index, const char *path);
+void geo_index_close   (GeoIndex *index);
+const char *geo_index_path (const GeoIndex *index,
+			    const GeoIndexRecord *record);
+const GeoIndexRecord *geo_index_find (const GeoIndex *index,
+				      const char *path);
+
+int  geo_index_within  (const GeoIndex *index, double south, double west,
+			double north, double east,
+			const GeoIndexTimes *times, GeoIndexResult *result);
+int  geo_index_near    (const GeoIndex *index, double lat, double lon,
+			double radius, const GeoIndexTimes *times,
+			GeoIndexResult *result);
+int  geo_index_between (const GeoIndex *index, const GeoIndexTimes *times,
+			GeoIndexResult *result);
+void geo_index_result_clear (GeoIndexResult *result);
+
+int  geo_index_builder_init  (GeoIndexBuilder *builder, const char *root);
+int  geo_index_builder_add   (GeoIndexBuilder *builder,
+			      const GeoIndexRecord *record, const char *path);
+int  geo_index_builder_write (GeoIndexBuilder *builder, const char *path);
+void geo_index_builder_clear (GeoIndexBuilder *builder);
+
+#endif /* __GEO_INDEX_H__ */
@@ -0,0 +1,379 @@
+/* gps-cache.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include "config.h"
+#include "gps-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
+#ifdef HAVE_SCHED_YIELD
+#include <sched.h>
+#endif
+
+#define GPS_CACHE_BYTE_ORDER 0x01020304
+
+#define GPS_CACHE_BUCKET_SIZE (GPS_CACHE_SLOT_SIZE * GPS_CACHE_BUCKET_SLOTS)
+
+/* Buckets of the largest file, 64 GiB */
+#define GPS_CACHE_MAX_BUCKETS ((uint64_t) 1 << 24)
+
+/*
+ * Attempts to take a slot, which another thread is writing, before the
+ * writer is taken as dead, when its sequence has not moved meanwhile.
+ */
+#define GPS_CACHE_SPIN 1024
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_ATOMIC_BUILTINS)
+
+static uint64_t
+gps_cache_hash (const GPSCacheKey *key)
+{
+	uint64_t h;
+
+	h = key->ino * 0x9e3779b97f4a7c15ULL;
+	h ^= key->dev + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+	h ^= key->size + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= (uint64_t) key->mtime + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+	h ^= (uint64_t) key->ctime + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static GPSCacheSlot *
+gps_cache_bucket (GPSCache *cache, const GPSCacheKey *key)
+{
+	return cache->slots +
+		(gps_cache_hash (key) & (cache->buckets - 1)) * GPS_CACHE_BUCKET_SLOTS;
+}
+
+/*
+ * Takes the slot for writing, unless another thread holds it. The
+ * fence keeps the new contents from being seen before the odd sequence.
+ */
+static int
+gps_cache_lock (GPSCacheSlot *slot, uint32_t *seq)
+{
+	uint32_t s = __atomic_load_n (&slot->seq, __ATOMIC_RELAXED);
+
+	if ((s & 1) ||
+	    !__atomic_compare_exchange_n (&slot->seq, &s, s + 1, 0,
+					  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	*seq = s;
+	return 1;
+}
+
+static void
+gps_cache_unlock (GPSCacheSlot *slot, uint32_t seq)
+{
+	__atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Reads the slot for the key without taking it, the caller checks again */
+static int
+gps_cache_peek (GPSCacheSlot *slot, const GPSCacheKey *key)
+{
+	GPSCacheKey found;
+
+	memcpy (&found, &slot->key, sizeof (GPSCacheKey));
+	return __atomic_load_n (&slot->size, __ATOMIC_RELAXED) &&
+		!memcmp (&found, key, sizeof (GPSCacheKey));
+}
+
+static int
+gps_cache_valid (const GPSCacheHeader *header, off_t size)
+{
+	return !memcmp (header->magic, GPS_CACHE_MAGIC, 8) &&
+		header->version == GPS_CACHE_VERSION &&
+		header->byte_order == GPS_CACHE_BYTE_ORDER &&
+		header->slot_size == GPS_CACHE_SLOT_SIZE &&
+		header->bucket_slots == GPS_CACHE_BUCKET_SLOTS &&
+		header->buckets && header->buckets <= GPS_CACHE_MAX_BUCKETS &&
+		!(header->buckets & (header->buckets - 1)) &&
+		(unsigned long long) size ==
+		(header->buckets + 1) * GPS_CACHE_BUCKET_SIZE;
+}
+
+/*
+ * Maps the cache file, which is created for about the number of entries
+ * when it is empty or missing; an existing file keeps its size. Returns
+ * 0 with errno set on failure, EINVAL when the file is not a cache, and
+ * ENOTSUP when shared mappings or atomic operations are not available.
+ */
+int
+gps_cache_open (GPSCache *cache, const char *path, size_t entries)
+{
+	GPSCacheHeader header;
+	struct stat st;
+	uint64_t buckets;
+	size_t size;
+	void *map;
+	int fd, err;
+
+	if (!cache || !path) {
+		errno = EINVAL;
+		return 0;
+	}
+	memset (cache, 0, sizeof (GPSCache));
+	fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return 0;
+#ifdef HAVE_FLOCK
+	/* Only one process creates the file, the others wait and map it */
+	if (flock (fd, LOCK_EX) < 0)
+		goto fail;
+#endif
+	if (fstat (fd, &st) < 0)
+		goto fail;
+	if (st.st_size == 0) {
+		/* Half of the slots are left free, to keep the buckets from overflowing */
+		for (buckets = 1;
+		     buckets * GPS_CACHE_BUCKET_SLOTS / 2 < entries &&
+		     buckets < GPS_CACHE_MAX_BUCKETS;
+		     buckets <<= 1)
+			;
+		memset (&header, 0, sizeof (header));
+		memcpy (header.magic, GPS_CACHE_MAGIC, 8);
+		header.version = GPS_CACHE_VERSION;
+		header.byte_order = GPS_CACHE_BYTE_ORDER;
+		header.slot_size = GPS_CACHE_SLOT_SIZE;
+		header.bucket_slots = GPS_CACHE_BUCKET_SLOTS;
+		header.buckets = buckets;
+		/* The slots are left as holes of zeros, which are empty */
+		st.st_size = (off_t) ((buckets + 1) * GPS_CACHE_BUCKET_SIZE);
+		if (ftruncate (fd, st.st_size) < 0 ||
+		    pwrite (fd, &header, sizeof (header), 0) != sizeof (header))
+			goto fail;
+	} else if (pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+		   !gps_cache_valid (&header, st.st_size)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if ((unsigned long long) st.st_size > SIZE_MAX) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	size = (size_t) st.st_size;
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+#ifdef HAVE_FLOCK
+	/* The lock stays with the mapping, unless it is dropped */
+	flock (fd, LOCK_UN);
+#endif
+	close (fd);
+
+	cache->map = map;
+	cache->map_size = size;
+	cache->header = map;
+	cache->slots = (GPSCacheSlot *) (cache->map + GPS_CACHE_BUCKET_SIZE);
+	cache->buckets = header.buckets;
+	return 1;
+
+fail:
+	err = errno;
+	close (fd);
+	errno = err;
+	return 0;
+}
+
+void
+gps_cache_close (GPSCache *cache)
+{
+	if (!cache) return;
+	if (cache->map)
+		munmap (cache->map, cache->map_size);
+	memset (cache, 0, sizeof (GPSCache));
+}
+
+/*
+ * Copies the data of the key, up to GPS_CACHE_DATA_SIZE bytes, and sets
+ * its size. Returns 0 when there is none, or its slot is being written.
+ */
+int
+gps_cache_lookup (GPSCache *cache, const GPSCacheKey *key,
+		  void *data, size_t *size)
+{
+	GPSCacheSlot *slot = gps_cache_bucket (cache, key);
+	unsigned int i;
+
+	for (i = 0; i < GPS_CACHE_BUCKET_SLOTS; i++, slot++) {
+		uint32_t seq, n;
+
+		seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || !gps_cache_peek (slot, key))
+			continue;
+		n = __atomic_load_n (&slot->size, __ATOMIC_RELAXED);
+		if (!n || n > GPS_CACHE_DATA_SIZE)
+			continue;
+		memcpy (data, slot->data, n);
+		/* The copy is good only if no writer has taken the slot since */
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		*size = n;
+		__atomic_fetch_add (&cache->hits, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	__atomic_fetch_add (&cache->misses, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Stores the data of the key in its own slot, an empty one or the next
+ * one of the bucket. Returns 0 when the data does not fit, or the slot
+ * is being written, which the caller may ignore.
+ */
+int
+gps_cache_store (GPSCache *cache, const GPSCacheKey *key,
+		 const void *data, size_t size)
+{
+	GPSCacheSlot *bucket = gps_cache_bucket (cache, key), *slot = NULL;
+	unsigned int i;
+	uint32_t seq;
+
+	if (!size || size > GPS_CACHE_DATA_SIZE)
+		return 0;
+	for (i = 0; i < GPS_CACHE_BUCKET_SLOTS && !slot; i++) {
+		if (gps_cache_peek (&bucket[i], key))
+			slot = &bucket[i];
+	}
+	for (i = 0; i < GPS_CACHE_BUCKET_SLOTS && !slot; i++) {
+		if (!__atomic_load_n (&bucket[i].size, __ATOMIC_RELAXED))
+			slot = &bucket[i];
+	}
+	if (!slot) {
+		i = __atomic_fetch_add (&cache->header->clock, 1, __ATOMIC_RELAXED);
+		slot = &bucket[i % GPS_CACHE_BUCKET_SLOTS];
+	}
+	if (!gps_cache_lock (slot, &seq))
+		return 0;
+	memcpy (&slot->key, key, sizeof (GPSCacheKey));
+	memcpy (slot->data, data, size);
+	__atomic_store_n (&slot->size, (uint32_t) size, __ATOMIC_RELAXED);
+	gps_cache_unlock (slot, seq);
+	return 1;
+}
+
+/*
+ * Takes the slot for writing, waiting for the writer of it. A writer,
+ * which holds the slot all the time, has died in the middle of a store,
+ * then the slot is taken over, the sequence staying odd.
+ */
+static void
+gps_cache_wait (GPSCacheSlot *slot, uint32_t *seq)
+{
+	uint32_t s, last = 0;
+	unsigned int spin = 0;
+
+	while (!gps_cache_lock (slot, seq)) {
+		s = __atomic_load_n (&slot->seq, __ATOMIC_RELAXED);
+		if (s != last) {
+			last = s;
+			spin = 0;
+		} else if (++spin >= GPS_CACHE_SPIN && (s & 1) &&
+			   __atomic_compare_exchange_n (&slot->seq, &s, s + 2, 0,
+							__ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED)) {
+			__atomic_thread_fence (__ATOMIC_RELEASE);
+			/* Unlocked to s + 3, even */
+			*seq = s + 1;
+			return;
+		}
+#ifdef HAVE_SCHED_YIELD
+		sched_yield ();
+#endif
+	}
+}
+
+/*
+ * Empties every slot of the key, waiting for the writers of them, so that
+ * no data of the file stays under the key it had before it was written.
+ */
+void
+gps_cache_forget (GPSCache *cache, const GPSCacheKey *key)
+{
+	GPSCacheSlot *slot = gps_cache_bucket (cache, key);
+	unsigned int i;
+	uint32_t seq;
+
+	for (i = 0; i < GPS_CACHE_BUCKET_SLOTS; i++, slot++) {
+		if (!gps_cache_peek (slot, key))
+			continue;
+		gps_cache_wait (slot, &seq);
+		if (!memcmp (&slot->key, key, sizeof (GPSCacheKey))) {
+			__atomic_store_n (&slot->size, 0, __ATOMIC_RELAXED);
+			memset (&slot->key, 0, sizeof (GPSCacheKey));
+		}
+		gps_cache_unlock (slot, seq);
+	}
+}
+
+#else
+
+int
+gps_cache_open (GPSCache *cache, const char *path, size_t entries)
+{
+	(void) path;
+	(void) entries;
+	if (cache)
+		memset (cache, 0, sizeof (GPSCache));
+	errno = ENOTSUP;
+	return 0;
+}
+
+void
+gps_cache_close (GPSCache *cache)
+{
+	(void) cache;
+}
+
+int
+gps_cache_lookup (GPSCache *cache, const GPSCacheKey *key,
+		  void *data, size_t *size)
+{
+	(void) cache;
+	(void) key;
+	(void) data;
+	(void) size;
+	return 0;
+}
+
+int
+gps_cache_store (GPSCache *cache, const GPSCacheKey *key,
+		 const void *data, size_t size)
+{
+	(void) cache;
+	(void) key;
+	(void) data;
+	(void) size;
+	return 0;
+}
+
+void
+gps_cache_forget (GPSCache *cache, const GPSCacheKey *key)
+{
+	(void) cache;
+	(void) key;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* gps-cache.h
+ *
+ * Cache of decoded metadata kept in a file, which is mapped into memory
+ * shared by every process using it. Entries are keyed by the identity of
+ * the photo file (its device, inode, size, modification and change times),
+ * so that a changed file is missed rather than answered with stale data,
+ * even when its modification time has been put back. The
+ * table is set-associative: a key hashes to a bucket of slots, the size
+ * of a memory page, and each slot is guarded by a sequence lock, so that
+ * readers never block and never see a slot being written.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __GPS_CACHE_H__
+#define __GPS_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GPS_CACHE_MAGIC "EGTCACHE"
+#define GPS_CACHE_VERSION 2
+
+#define GPS_CACHE_SLOT_SIZE 512
+#define GPS_CACHE_BUCKET_SLOTS 8
+
+/* The identity of the file, as stat reports it */
+typedef struct _GPSCacheKey GPSCacheKey;
+struct _GPSCacheKey
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+
+	/* Modification time, nanoseconds since the epoch */
+	int64_t mtime;
+
+	/* Status change time, which no one can set back */
+	int64_t ctime;
+};
+
+/*
+ * A slot is empty while its size is 0. The sequence is odd while the
+ * slot is being written.
+ */
+typedef struct _GPSCacheSlot GPSCacheSlot;
+struct _GPSCacheSlot
+{
+	uint32_t seq;
+	uint32_t size;
+	GPSCacheKey key;
+	unsigned char data[GPS_CACHE_SLOT_SIZE - 8 - sizeof (GPSCacheKey)];
+};
+
+#define GPS_CACHE_DATA_SIZE (sizeof (((GPSCacheSlot *) 0)->data))
+
+/*
+ * The file is the header, padded to a bucket, and the buckets. Numbers
+ * are in the byte order of the machine, which created the file.
+ */
+typedef struct _GPSCacheHeader GPSCacheHeader;
+struct _GPSCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t slot_size;
+	uint32_t bucket_slots;
+	uint64_t buckets;
+
+	/* Bumped by every store, picks the slot to evict */
+	uint32_t clock;
+	uint32_t reserved[9];
+};
+
+typedef struct _GPSCache GPSCache;
+struct _GPSCache
+{
+	unsigned char *map;
+	size_t map_size;
+	GPSCacheHeader *header;
+	GPSCacheSlot *slots;
+	uint64_t buckets;
+
+	/* Lookups by this process, not kept in the file */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int  gps_cache_open   (GPSCache *cache, const char *path, size_t entries);
+void gps_cache_close  (GPSCache *cache);
+int  gps_cache_lookup (GPSCache *cache, const GPSCacheKey *key,
+		       void *data, size_t *size);
+int  gps_cache_store  (GPSCache *cache, const GPSCacheKey *key,
+		       const void *data, size_t size);
+void gps_cache_forget (GPSCache *cache, const GPSCacheKey *key);
+
+#endif /* __GPS_CACHE_H__ */
@@ -0,0 +1,749 @@
+/* gps-parse.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include "config.h"
+#include "gps-parse.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GPS_PARSE_DAY (86400 * GPS_TRACK_SECOND)
+
+/* States of the XML lexer */
+enum {
+	GPS_PARSE_TEXT = 0,
+	GPS_PARSE_TAG,
+	GPS_PARSE_COMMENT,
+	GPS_PARSE_CDATA
+};
+
+/* Elements, whose text is read */
+enum {
+	GPS_PARSE_NONE = 0,
+	GPS_PARSE_ELE,
+	GPS_PARSE_TIME,
+	GPS_PARSE_WHEN,
+	GPS_PARSE_COORD
+};
+
+static int
+gps_parse_space (char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int
+gps_parse_digits (const char *p, int n)
+{
+	int r = 0;
+
+	while (n--) {
+		if (*p < '0' || *p > '9')
+			return -1;
+		r = r * 10 + (*p++ - '0');
+	}
+	return r;
+}
+
+/* Days since 1970-01-01 of the date, returns 0 unless the date exists */
+static int
+gps_parse_date (int y, int m, int d, int64_t *days)
+{
+	static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int64_t era;
+	unsigned int yoe, doy;
+
+	if (y < 0 || m < 1 || m > 12 || d < 1 ||
+	    d > mdays[m - 1] + (m == 2 && y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)))
+		return 0;
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned int) (y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	*days = era * 146097 + (int64_t) (yoe * 365 + yoe / 4 - yoe / 100 + doy) - 719468;
+	return 1;
+}
+
+/* Nanoseconds of the digits after the decimal point */
+static int64_t
+gps_parse_fraction (const char **p)
+{
+	int64_t scale = GPS_TRACK_SECOND, r = 0;
+	const char *s = *p;
+
+	for (; *s >= '0' && *s <= '9'; s++) {
+		if (scale > 1) {
+			scale /= 10;
+			r += (*s - '0') * scale;
+		}
+	}
+	*p = s;
+	return r;
+}
+
+/*
+ * strtod() for the plain decimals of the logs. With at most 15 digits and
+ * 22 decimals both the digits and the power of ten are exact doubles, so
+ * one division rounds correctly. Anything else is left to strtod().
+ */
+static double
+gps_parse_double (const char *s, char **end)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *p = s;
+	int64_t digits = 0;
+	int n = 0, decimals = 0, negative = 0;
+
+	if (*p == '-' || *p == '+')
+		negative = *p++ == '-';
+	for (; *p >= '0' && *p <= '9'; p++, n++)
+		digits = digits * 10 + (*p - '0');
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, n++, decimals++)
+			digits = digits * 10 + (*p - '0');
+	}
+	if (n == 0 || n > 15 || decimals > 22 || *p == 'e' || *p == 'E')
+		return strtod (s, end);
+	*end = (char *) p;
+	return (negative ? -(double) digits : (double) digits) / pow10[decimals];
+}
+
+/* The whole string, save white space around it, is the number */
+static int
+gps_parse_number (const char *s, double *v)
+{
+	char *end;
+
+	*v = gps_parse_double (s, &end);
+	if (end == s)
+		return 0;
+	while (gps_parse_space (*end))
+		end++;
+	return !*end && isfinite (*v);
+}
+
+/*
+ * xsd:dateTime, as GPX and KML have it: "YYYY-MM-DDTHH:MM:SS", optionally
+ * with the fraction of the second and the time zone. Times without a zone
+ * are taken as UTC.
+ */
+static int
+gps_parse_iso_time (const char *p, int64_t *time)
+{
+	int y, mo, d, h, mi, s, zh, zm, sign;
+	int64_t days, t;
+
+	while (gps_parse_space (*p))
+		p++;
+	if ((y = gps_parse_digits (p, 4)) < 0 || p[4] != '-' ||
+	    (mo = gps_parse_digits (p + 5, 2)) < 0 || p[7] != '-' ||
+	    (d = gps_parse_digits (p + 8, 2)) < 0 || (p[10] != 'T' && p[10] != ' ') ||
+	    (h = gps_parse_digits (p + 11, 2)) < 0 || p[13] != ':' ||
+	    (mi = gps_parse_digits (p + 14, 2)) < 0 || p[16] != ':' ||
+	    (s = gps_parse_digits (p + 17, 2)) < 0)
+		return 0;
+	if (h > 23 || mi > 59 || s > 60 || !gps_parse_date (y, mo, d, &days))
+		return 0;
+	p += 19;
+	t = days * GPS_PARSE_DAY + (int64_t) (h * 3600 + mi * 60 + s) * GPS_TRACK_SECOND;
+	if (*p == '.' || *p == ',') {
+		p++;
+		t += gps_parse_fraction (&p);
+	}
+	if (*p == 'Z') {
+		p++;
+	} else if (*p == '+' || *p == '-') {
+		sign = *p == '-' ? -1 : 1;
+		if ((zh = gps_parse_digits (p + 1, 2)) < 0)
+			return 0;
+		p += 3;
+		if (*p == ':')
+			p++;
+		zm = gps_parse_digits (p, 2);
+		if (zm < 0)
+			zm = 0;
+		else
+			p += 2;
+		t -= sign * (int64_t) (zh * 3600 + zm * 60) * GPS_TRACK_SECOND;
+	}
+	while (gps_parse_space (*p))
+		p++;
+	if (*p)
+		return 0;
+	*time = t;
+	return 1;
+}
+
+static void
+gps_parse_append (GPSParser *parser, int64_t time, double lat, double lon,
+		  double alt)
+{
+	if (!gps_track_append (parser->track, time, lat, lon, alt))
+		parser->nomem = 1;
+}
+
+/* The last point of the log, if it has the given time */
+static int
+gps_parse_last (GPSParser *parser, int64_t time, size_t *i)
+{
+	GPSTrack *track = parser->track;
+
+	if (track->count <= parser->start || track->time[track->count - 1] != time)
+		return 0;
+	*i = track->count - 1;
+	return 1;
+}
+
+static void
+gps_parse_put (GPSParser *parser, char c)
+{
+	if (parser->len < GPS_PARSE_TOKEN_SIZE - 1)
+		parser->token[parser->len++] = c;
+}
+
+/* Name of the tag without the namespace prefix */
+static const char *
+gps_parse_name (const char *tag, size_t *len)
+{
+	const char *name = tag, *p;
+
+	for (p = tag; *p && *p != '/' && !gps_parse_space (*p); p++)
+		if (*p == ':')
+			name = p + 1;
+	*len = p - name;
+	return name;
+}
+
+static int
+gps_parse_is (const char *name, size_t len, const char *s)
+{
+	return strlen (s) == len && !memcmp (name, s, len);
+}
+
+/* Numeric attribute of the tag */
+static int
+gps_parse_attr (const char *tag, const char *attr, double *v)
+{
+	size_t n = strlen (attr);
+	const char *p = tag;
+	char *end, quote;
+
+	while ((p = strstr (p, attr)) != NULL) {
+		if (p == tag || !gps_parse_space (p[-1])) {
+			p += n;
+			continue;
+		}
+		p += n;
+		while (gps_parse_space (*p))
+			p++;
+		if (*p != '=')
+			continue;
+		p++;
+		while (gps_parse_space (*p))
+			p++;
+		if (*p != '"' && *p != '\'')
+			return 0;
+		quote = *p++;
+		*v = gps_parse_double (p, &end);
+		if (end == p)
+			return 0;
+		while (gps_parse_space (*end))
+			end++;
+		return *end == quote && isfinite (*v);
+	}
+	return 0;
+}
+
+/* A position on the globe. Points anywhere else are dropped */
+static int
+gps_parse_in_range (double lat, double lon)
+{
+	return fabs (lat) <= 90.0 && fabs (lon) <= 180.0;
+}
+
+/*
+ * Ends gx:Track, dropping the times without coordinates, and the points
+ * whose coordinates are out of range
+ */
+static void
+gps_parse_kml_end (GPSParser *parser)
+{
+	GPSTrack *track = parser->track;
+	size_t keep = parser->whens < parser->coords ? parser->whens : parser->coords;
+	size_t i, j;
+
+	if (parser->kml_bad)
+		keep = 0;
+	if (track->count > parser->kml_start + keep)
+		track->count = parser->kml_start + keep;
+	for (i = j = parser->kml_start; i < track->count; i++) {
+		if (isnan (track->lat[i]))
+			continue;
+		track->time[j] = track->time[i];
+		track->lat[j] = track->lat[i];
+		track->lon[j] = track->lon[i];
+		track->alt[j] = track->alt[i];
+		j++;
+	}
+	track->count = j;
+	parser->point_depth = 0;
+}
+
+static void
+gps_parse_text (GPSParser *parser)
+{
+	GPSTrack *track = parser->track;
+	const char *p = parser->token;
+	double lat, lon, alt;
+	char *end;
+	int64_t t;
+	size_t i;
+
+	parser->token[parser->len] = 0;
+	while (gps_parse_space (*p))
+		p++;
+	/* Blank text in front of a comment or CDATA is not the value yet */
+	if (!*p)
+		return;
+
+	switch (parser->text) {
+	case GPS_PARSE_ELE:
+		if (!gps_parse_number (p, &parser->alt))
+			parser->alt = NAN;
+		break;
+	case GPS_PARSE_TIME:
+		parser->has_time = gps_parse_iso_time (p, &parser->time);
+		break;
+	case GPS_PARSE_WHEN:
+		if (!gps_parse_iso_time (p, &t)) {
+			parser->kml_bad = 1;
+			break;
+		}
+		if (track->count == parser->kml_start + parser->whens)
+			gps_parse_append (parser, t, NAN, NAN, NAN);
+		parser->whens++;
+		break;
+	case GPS_PARSE_COORD:
+		/* "lon lat [alt]" */
+		lon = gps_parse_double (p, &end);
+		if (end == p || !gps_parse_space (*end) || !isfinite (lon)) {
+			parser->kml_bad = 1;
+			break;
+		}
+		p = end;
+		lat = gps_parse_double (p, &end);
+		if (end == p || !isfinite (lat)) {
+			parser->kml_bad = 1;
+			break;
+		}
+		alt = NAN;
+		while (gps_parse_space (*end))
+			end++;
+		if (*end && !gps_parse_number (end, &alt)) {
+			parser->kml_bad = 1;
+			break;
+		}
+		/* the point is dropped at the end of the track */
+		if (!gps_parse_in_range (lat, lon))
+			lat = lon = NAN;
+		i = parser->kml_start + parser->coords++;
+		if (i < track->count) {
+			track->lat[i] = lat;
+			track->lon[i] = lon;
+			track->alt[i] = alt;
+		}
+		break;
+	}
+	parser->text = GPS_PARSE_NONE;
+}
+
+static void
+gps_parse_start (GPSParser *parser, const char *name, size_t len, int empty)
+{
+	if (parser->format != GPS_PARSE_KML && gps_parse_is (name, len, "trkpt")) {
+		parser->point_depth = parser->depth + 1;
+		parser->point_kml = 0;
+		parser->has_time = 0;
+		parser->alt = NAN;
+		if (empty || !gps_parse_attr (parser->token, "lat", &parser->lat) ||
+		    !gps_parse_attr (parser->token, "lon", &parser->lon) ||
+		    !gps_parse_in_range (parser->lat, parser->lon))
+			parser->point_depth = 0;
+		return;
+	}
+	if (parser->format != GPS_PARSE_GPX && gps_parse_is (name, len, "Track")) {
+		if (parser->point_depth)
+			return;
+		parser->point_depth = empty ? 0 : parser->depth + 1;
+		parser->point_kml = 1;
+		parser->kml_start = parser->track->count;
+		parser->whens = 0;
+		parser->coords = 0;
+		parser->kml_bad = 0;
+		return;
+	}
+	if (!parser->point_depth || parser->depth != parser->point_depth || empty)
+		return;
+	if (!parser->point_kml && gps_parse_is (name, len, "ele"))
+		parser->text = GPS_PARSE_ELE;
+	else if (!parser->point_kml && gps_parse_is (name, len, "time"))
+		parser->text = GPS_PARSE_TIME;
+	else if (parser->point_kml && gps_parse_is (name, len, "when"))
+		parser->text = GPS_PARSE_WHEN;
+	else if (parser->point_kml && gps_parse_is (name, len, "coord"))
+		parser->text = GPS_PARSE_COORD;
+}
+
+/* Called with the depth of the parent of the element */
+static void
+gps_parse_end (GPSParser *parser)
+{
+	if (!parser->point_depth)
+		return;
+	if (parser->depth == parser->point_depth) {
+		/* an element without text */
+		parser->text = GPS_PARSE_NONE;
+		return;
+	}
+	if (parser->depth + 1 != parser->point_depth)
+		return;
+	if (parser->point_kml) {
+		gps_parse_kml_end (parser);
+		return;
+	}
+	if (parser->has_time)
+		gps_parse_append (parser, parser->time, parser->lat, parser->lon,
+				  parser->alt);
+	parser->point_depth = 0;
+}
+
+static void
+gps_parse_tag (GPSParser *parser)
+{
+	const char *name;
+	size_t len;
+	int empty;
+
+	parser->token[parser->len] = 0;
+	if (parser->token[0] == '?' || parser->token[0] == '!')
+		return;
+	if (parser->token[0] == '/') {
+		if (parser->depth)
+			parser->depth--;
+		gps_parse_end (parser);
+		return;
+	}
+	empty = parser->len > 0 && parser->token[parser->len - 1] == '/';
+	name = gps_parse_name (parser->token, &len);
+	gps_parse_start (parser, name, len, empty);
+	if (!empty)
+		parser->depth++;
+}
+
+static void
+gps_parse_xml (GPSParser *parser, const char *data, size_t size)
+{
+	const char *end = data + size, *p;
+	size_t n;
+	char c;
+
+	while (data < end) {
+		/* Text is copied, or skipped for other elements, in one go */
+		if (parser->state == GPS_PARSE_TEXT) {
+			p = memchr (data, '<', end - data);
+			if (!p)
+				p = end;
+			if (parser->text) {
+				n = (size_t) (p - data);
+				if (n > GPS_PARSE_TOKEN_SIZE - 1 - parser->len)
+					n = GPS_PARSE_TOKEN_SIZE - 1 - parser->len;
+				memcpy (parser->token + parser->len, data, n);
+				parser->len += n;
+			}
+			data = p;
+			if (data == end)
+				return;
+		}
+		c = *data++;
+		switch (parser->state) {
+		case GPS_PARSE_TEXT:
+			/* c is '<' */
+			if (parser->text)
+				gps_parse_text (parser);
+			parser->state = GPS_PARSE_TAG;
+			parser->quote = 0;
+			parser->len = 0;
+			break;
+		case GPS_PARSE_TAG:
+			/* Once the tag is known not to start a comment or CDATA, it is copied in runs */
+			if (parser->len && parser->token[0] != '!' && c != '>' && c != '"' && c != '\'') {
+				p = data - 1;
+				while (data < end && (parser->quote ? *data != parser->quote :
+						      *data != '>' && *data != '"' && *data != '\''))
+					data++;
+				n = (size_t) (data - p);
+				if (n > GPS_PARSE_TOKEN_SIZE - 1 - parser->len)
+					n = GPS_PARSE_TOKEN_SIZE - 1 - parser->len;
+				memcpy (parser->token + parser->len, p, n);
+				parser->len += n;
+				break;
+			}
+			if (parser->quote) {
+				if (c == parser->quote)
+					parser->quote = 0;
+			} else if (c == '"' || c == '\'') {
+				parser->quote = c;
+			} else if (c == '>') {
+				gps_parse_tag (parser);
+				parser->state = GPS_PARSE_TEXT;
+				parser->len = 0;
+				break;
+			}
+			gps_parse_put (parser, c);
+			if (parser->len == 3 && !memcmp (parser->token, "!--", 3)) {
+				parser->state = GPS_PARSE_COMMENT;
+				parser->brackets = 0;
+			} else if (parser->len == 8 && !memcmp (parser->token, "![CDATA[", 8)) {
+				parser->state = GPS_PARSE_CDATA;
+				parser->brackets = 0;
+				parser->len = 0;
+			}
+			break;
+		case GPS_PARSE_COMMENT:
+			if (c == '>' && parser->brackets >= 2) {
+				parser->state = GPS_PARSE_TEXT;
+				parser->len = 0;
+			}
+			parser->brackets = c == '-' ? parser->brackets + 1 : 0;
+			break;
+		case GPS_PARSE_CDATA:
+			if (c == '>' && parser->brackets >= 2) {
+				/* the text goes on after "]]>" */
+				parser->state = GPS_PARSE_TEXT;
+				parser->len = parser->len >= 2 ? parser->len - 2 : 0;
+				break;
+			}
+			parser->brackets = c == ']' ? parser->brackets + 1 : 0;
+			gps_parse_put (parser, c);
+			break;
+		}
+	}
+}
+
+/* "hhmmss" with the fraction of the second, if any */
+static int
+gps_parse_tod (const char *s, int64_t *tod)
+{
+	int h = gps_parse_digits (s, 2), m, sec;
+
+	if (h < 0 || (m = gps_parse_digits (s + 2, 2)) < 0 ||
+	    (sec = gps_parse_digits (s + 4, 2)) < 0 || h > 23 || m > 59 || sec > 60)
+		return 0;
+	s += 6;
+	*tod = (int64_t) (h * 3600 + m * 60 + sec) * GPS_TRACK_SECOND;
+	if (*s == '.') {
+		s++;
+		*tod += gps_parse_fraction (&s);
+	}
+	return !*s;
+}
+
+/* "ddmm.mmmm" (or "dddmm.mmmm") and the hemisphere */
+static int
+gps_parse_nmea_coord (const char *s, const char *hemisphere, double *v)
+{
+	double x, deg, limit;
+
+	if (!gps_parse_number (s, &x) || x < 0.0)
+		return 0;
+	deg = floor (x / 100.0);
+	x = deg + (x - deg * 100.0) / 60.0;
+	switch (hemisphere[0]) {
+	case 'S':
+		x = -x;
+		/* fall through */
+	case 'N':
+		limit = 90.0;
+		break;
+	case 'W':
+		x = -x;
+		/* fall through */
+	case 'E':
+		limit = 180.0;
+		break;
+	default:
+		return 0;
+	}
+	if (fabs (x) > limit)
+		return 0;
+	*v = x;
+	return 1;
+}
+
+static int
+gps_parse_hex (char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * RMC gives the date and the position, GGA the position and the altitude
+ * at the time of day. Both are usually sent for every fix, and are merged
+ * into one point. GGA before the first RMC has no date, and is only kept
+ * for the RMC of the same fix.
+ */
+static void
+gps_parse_sentence (GPSParser *parser)
+{
+	char *s = parser->token, *star, *fields[16];
+	unsigned int sum = 0, n = 0;
+	int64_t tod, t, days;
+	double lat, lon, alt;
+	int d, m, y;
+	size_t i;
+
+	parser->token[parser->len] = 0;
+	s = strchr (s, '$');
+	if (!s)
+		return;
+	star = strchr (s, '*');
+	if (star) {
+		for (i = 1; s + i < star; i++)
+			sum ^= (unsigned char) s[i];
+		if (gps_parse_hex (star[1]) < 0 || gps_parse_hex (star[2]) < 0 ||
+		    (unsigned int) (gps_parse_hex (star[1]) << 4 | gps_parse_hex (star[2])) != sum)
+			return;
+		*star = 0;
+	}
+	while (n < sizeof (fields) / sizeof (fields[0])) {
+		fields[n++] = s;
+		s = strchr (s, ',');
+		if (!s)
+			break;
+		*s++ = 0;
+	}
+	if (strlen (fields[0]) != 6 || n < 10 || !gps_parse_tod (fields[1], &tod))
+		return;
+
+	if (!strcmp (fields[0] + 3, "RMC")) {
+		if (fields[2][0] != 'A' || !gps_parse_nmea_coord (fields[3], fields[4], &lat) ||
+		    !gps_parse_nmea_coord (fields[5], fields[6], &lon) || strlen (fields[9]) != 6)
+			return;
+		d = gps_parse_digits (fields[9], 2);
+		m = gps_parse_digits (fields[9] + 2, 2);
+		y = gps_parse_digits (fields[9] + 4, 2);
+		if (y < 0 || !gps_parse_date (y + (y < 80 ? 2000 : 1900), m, d, &days))
+			return;
+		parser->day = days;
+		parser->has_day = 1;
+		t = days * GPS_PARSE_DAY + tod;
+		/* the GGA of the fix is there already */
+		if (gps_parse_last (parser, t, &i))
+			return;
+		alt = parser->has_gga && parser->gga_tod == tod ? parser->gga_alt : NAN;
+		gps_parse_append (parser, t, lat, lon, alt);
+	} else if (!strcmp (fields[0] + 3, "GGA")) {
+		if (!fields[6][0] || fields[6][0] == '0' ||
+		    !gps_parse_nmea_coord (fields[2], fields[3], &lat) ||
+		    !gps_parse_nmea_coord (fields[4], fields[5], &lon))
+			return;
+		if (!gps_parse_number (fields[9], &alt))
+			alt = NAN;
+		parser->gga_tod = tod;
+		parser->gga_lat = lat;
+		parser->gga_lon = lon;
+		parser->gga_alt = alt;
+		parser->has_gga = 1;
+		if (!parser->has_day)
+			return;
+		t = parser->day * GPS_PARSE_DAY + tod;
+		/* past midnight, before RMC brings the new date */
+		if (parser->track->count > parser->start &&
+		    t < parser->track->time[parser->track->count - 1] - GPS_PARSE_DAY / 2)
+			t += GPS_PARSE_DAY;
+		if (gps_parse_last (parser, t, &i)) {
+			parser->track->alt[i] = alt;
+			return;
+		}
+		gps_parse_append (parser, t, lat, lon, alt);
+	}
+}
+
+static void
+gps_parse_nmea (GPSParser *parser, const char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n' || data[i] == '\r') {
+			if (parser->len)
+				gps_parse_sentence (parser);
+			parser->len = 0;
+		} else {
+			gps_parse_put (parser, data[i]);
+		}
+	}
+}
+
+void
+gps_parser_init (GPSParser *parser, GPSParseFormat format, GPSTrack *track)
+{
+	if (!parser) return;
+	memset (parser, 0, sizeof (GPSParser));
+	parser->format = format;
+	parser->xml = format == GPS_PARSE_AUTO ? -1 : format != GPS_PARSE_NMEA;
+	parser->track = track;
+	parser->start = track ? track->count : 0;
+}
+
+/* Returns 0 if it runs out of memory */
+int
+gps_parser_feed (GPSParser *parser, const char *data, size_t size)
+{
+	if (!parser || !parser->track) return 0;
+
+	if (parser->xml < 0) {
+		/* White space and the byte order mark of UTF-8 */
+		while (size && (gps_parse_space (*data) || (unsigned char) *data >= 0x80)) {
+			data++;
+			size--;
+		}
+		if (!size)
+			return !parser->nomem;
+		parser->xml = *data == '<';
+	}
+	if (parser->xml)
+		gps_parse_xml (parser, data, size);
+	else
+		gps_parse_nmea (parser, data, size);
+	return !parser->nomem;
+}
+
+/* Takes the last sentence, which may lack the line break, and drops an unfinished gx:Track */
+int
+gps_parser_finish (GPSParser *parser)
+{
+	if (!parser || !parser->track) return 0;
+
+	if (parser->xml == 0 && parser->len)
+		gps_parse_sentence (parser);
+	if (parser->xml > 0 && parser->point_depth && parser->point_kml)
+		gps_parse_kml_end (parser);
+	parser->len = 0;
+	return !parser->nomem;
+}
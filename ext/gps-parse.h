@@ -0,0 +1,82 @@
+/* gps-parse.h
+ *
+ * Streaming parsers of GPS track logs: track points of GPX 1.1, gx:Track
+ * of KML and RMC/GGA sentences of NMEA 0183. The log is fed in chunks of
+ * any size, and the points are appended to a GPSTrack as they are found,
+ * so the parser itself takes constant memory.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __GPS_PARSE_H__
+#define __GPS_PARSE_H__
+
+#include "gps-track.h"
+
+#include <stddef.h>
+
+typedef enum {
+	GPS_PARSE_AUTO = 0,
+	GPS_PARSE_GPX,
+	GPS_PARSE_KML,
+	GPS_PARSE_NMEA
+} GPSParseFormat;
+
+/* Longer XML tags, texts and NMEA sentences are truncated */
+#define GPS_PARSE_TOKEN_SIZE 1024
+
+typedef struct _GPSParser GPSParser;
+struct _GPSParser
+{
+	/* With AUTO, xml is -1 until the first byte, which is not white
+	 * space, tells XML (GPX or KML) from NMEA */
+	GPSParseFormat format;
+	int xml;
+	GPSTrack *track;
+
+	/* Points before this one were in the track before the log */
+	size_t start;
+	int nomem;
+
+	/* The XML tag or text, or the NMEA sentence being read */
+	char token[GPS_PARSE_TOKEN_SIZE];
+	size_t len;
+
+	/* XML: the lexer, and the depth of the elements below the open point */
+	int state;
+	char quote;
+	int brackets;
+	unsigned int depth;
+	unsigned int point_depth;
+	int point_kml;
+	int text;
+
+	/* GPX: the track point being read */
+	int64_t time;
+	double lat, lon, alt;
+	int has_time;
+
+	/* KML: the times of gx:Track are appended first, the coordinates
+	 * are filled in later */
+	size_t kml_start;
+	size_t whens;
+	size_t coords;
+	int kml_bad;
+
+	/* NMEA: the date of the last RMC, and the last GGA */
+	int64_t day;
+	int has_day;
+	int64_t gga_tod;
+	double gga_lat, gga_lon, gga_alt;
+	int has_gga;
+};
+
+void gps_parser_init   (GPSParser *parser, GPSParseFormat format,
+			GPSTrack *track);
+int  gps_parser_feed   (GPSParser *parser, const char *data, size_t size);
+int  gps_parser_finish (GPSParser *parser);
+
+#endif /* __GPS_PARSE_H__ */
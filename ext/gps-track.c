@@ -0,0 +1,190 @@
+/* gps-track.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include "config.h"
+#include "gps-track.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _GPSTrackPoint GPSTrackPoint;
+struct _GPSTrackPoint
+{
+	int64_t time;
+	double lat;
+	double lon;
+	double alt;
+};
+
+void
+gps_track_init (GPSTrack *track)
+{
+	if (!track) return;
+	memset (track, 0, sizeof (GPSTrack));
+	track->sorted = 1;
+}
+
+void
+gps_track_clear (GPSTrack *track)
+{
+	if (!track) return;
+	free (track->time);
+	free (track->lat);
+	free (track->lon);
+	free (track->alt);
+	gps_track_init (track);
+}
+
+static int
+gps_track_grow (void **column, size_t size, size_t alloc)
+{
+	void *d = realloc (*column, size * alloc);
+
+	if (!d)
+		return 0;
+	*column = d;
+	return 1;
+}
+
+/* Returns 0 if it runs out of memory */
+int
+gps_track_append (GPSTrack *track, int64_t time, double lat, double lon,
+		  double alt)
+{
+	size_t alloc;
+
+	if (!track) return 0;
+	if (track->count == track->alloc) {
+		alloc = track->alloc ? track->alloc * 2 : 1024;
+		if (!gps_track_grow ((void **) &track->time, sizeof (int64_t), alloc) ||
+		    !gps_track_grow ((void **) &track->lat, sizeof (double), alloc) ||
+		    !gps_track_grow ((void **) &track->lon, sizeof (double), alloc) ||
+		    !gps_track_grow ((void **) &track->alt, sizeof (double), alloc))
+			return 0;
+		track->alloc = alloc;
+	}
+	if (track->count && time < track->time[track->count - 1])
+		track->sorted = 0;
+	track->time[track->count] = time;
+	track->lat[track->count] = lat;
+	track->lon[track->count] = lon;
+	track->alt[track->count] = alt;
+	track->count++;
+	return 1;
+}
+
+static int
+gps_track_point_cmp (const void *a, const void *b)
+{
+	int64_t ta = ((const GPSTrackPoint *) a)->time;
+	int64_t tb = ((const GPSTrackPoint *) b)->time;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* Sorts the points by time, unless they are sorted already. Returns 0
+ * if it runs out of memory. */
+int
+gps_track_sort (GPSTrack *track)
+{
+	GPSTrackPoint *points;
+	size_t i;
+
+	if (!track) return 0;
+	if (track->sorted)
+		return 1;
+	points = malloc (sizeof (GPSTrackPoint) * track->count);
+	if (!points)
+		return 0;
+	for (i = 0; i < track->count; i++) {
+		points[i].time = track->time[i];
+		points[i].lat = track->lat[i];
+		points[i].lon = track->lon[i];
+		points[i].alt = track->alt[i];
+	}
+	qsort (points, track->count, sizeof (GPSTrackPoint), gps_track_point_cmp);
+	for (i = 0; i < track->count; i++) {
+		track->time[i] = points[i].time;
+		track->lat[i] = points[i].lat;
+		track->lon[i] = points[i].lon;
+		track->alt[i] = points[i].alt;
+	}
+	free (points);
+	track->sorted = 1;
+	return 1;
+}
+
+static void
+gps_track_point (const GPSTrack *track, size_t i, GPSFix *fix)
+{
+	fix->lat = track->lat[i];
+	fix->lon = track->lon[i];
+	fix->alt = track->alt[i];
+}
+
+/*
+ * Finds the position at the given time in the sorted track. Between two
+ * points, which are at most max_gap apart, it is interpolated linearly
+ * (the shorter way around the antimeridian). Otherwise the nearest point
+ * is taken, if it is at most max_gap away. Returns 0 if the track does
+ * not cover the time.
+ */
+int
+gps_track_locate (const GPSTrack *track, int64_t time, int64_t max_gap,
+		  GPSFix *fix)
+{
+	size_t lo = 0, hi, i;
+	int64_t before, after;
+	double f, dlon;
+
+	if (!track || !fix || !track->count) return 0;
+
+	/* The first point, which is not earlier than the time */
+	hi = track->count;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (track->time[i] < time)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	i = lo;
+	fix->time = time;
+
+	if (i < track->count && track->time[i] == time) {
+		gps_track_point (track, i, fix);
+		return 1;
+	}
+	before = i > 0 ? time - track->time[i - 1] : INT64_MAX;
+	after = i < track->count ? track->time[i] - time : INT64_MAX;
+	if (i > 0 && i < track->count && before <= max_gap - after) {
+		f = (double) before / (double) (before + after);
+		dlon = track->lon[i] - track->lon[i - 1];
+		if (dlon > 180.0)
+			dlon -= 360.0;
+		else if (dlon < -180.0)
+			dlon += 360.0;
+		fix->lat = track->lat[i - 1] + f * (track->lat[i] - track->lat[i - 1]);
+		fix->lon = track->lon[i - 1] + f * dlon;
+		if (fix->lon > 180.0)
+			fix->lon -= 360.0;
+		else if (fix->lon < -180.0)
+			fix->lon += 360.0;
+		fix->alt = track->alt[i - 1] + f * (track->alt[i] - track->alt[i - 1]);
+		return 1;
+	}
+	if (before <= after && before <= max_gap) {
+		gps_track_point (track, i - 1, fix);
+		return 1;
+	}
+	if (after < before && after <= max_gap) {
+		gps_track_point (track, i, fix);
+		return 1;
+	}
+	return 0;
+}
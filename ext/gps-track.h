@@ -0,0 +1,56 @@
+/* gps-track.h
+ *
+ * GPS track log kept in columns: times, latitudes, longitudes and
+ * altitudes of the points, sorted by time. Positions of photos are
+ * interpolated between the points around their capture times.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __GPS_TRACK_H__
+#define __GPS_TRACK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Times are nanoseconds since the epoch, UTC */
+#define GPS_TRACK_SECOND INT64_C(1000000000)
+
+typedef struct _GPSTrack GPSTrack;
+struct _GPSTrack
+{
+	int64_t *time;
+	double *lat;
+	double *lon;
+
+	/* NaN where the altitude is unknown */
+	double *alt;
+
+	size_t count;
+	size_t alloc;
+
+	/* Cleared by appending a point out of order */
+	int sorted;
+};
+
+typedef struct _GPSFix GPSFix;
+struct _GPSFix
+{
+	int64_t time;
+	double lat;
+	double lon;
+	double alt;
+};
+
+void gps_track_init   (GPSTrack *track);
+void gps_track_clear  (GPSTrack *track);
+int  gps_track_append (GPSTrack *track, int64_t time, double lat,
+		       double lon, double alt);
+int  gps_track_sort   (GPSTrack *track);
+int  gps_track_locate (const GPSTrack *track, int64_t time,
+		       int64_t max_gap, GPSFix *fix);
+
+#endif /* __GPS_TRACK_H__ */
@@ -18,30 +18,79 @@
  * Boston, MA  02110-1301  USA.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 #include "jpeg-data.h"
+#include "jpeg-scan.h"
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 /* This refers to the exif-i18n.h file from the "exif" package and is
  * NOT to be confused with the libexif/i18n.h file.
  */
 #include "exif-i18n.h"
 
-/* realloc that cleans up on memory failure and returns to caller */
-#define CLEANUP_REALLOC(p,s) { \
-	unsigned char *cleanup_ptr = realloc((p),(s)); \
-	if (!cleanup_ptr) { free(p); (p) = NULL; return; } \
-	(p) = cleanup_ptr; \
-}
+/* The unchanged tail of a file, which is not read into memory, is copied
+ * in chunks of this size */
+#define JPEG_DATA_COPY_CHUNK 65536
+
+/* Output buffer, which grows geometrically */
+typedef struct _JPEGDataBuffer JPEGDataBuffer;
+struct _JPEGDataBuffer
+{
+	unsigned char *d;
+	size_t size;
+	size_t alloc;
+};
 
 struct _JPEGDataPrivate
 {
 	unsigned int ref_count;
 
 	ExifLog *log;
+
+	unsigned int options;
+
+	/* Capacity of the sections array */
+	unsigned int sections_alloc;
+
+	/* The headers of the file the data has been loaded from, up to
+	 * the end of SOS. Borrowed sections point into this buffer. */
+	unsigned char *head;
+	size_t head_size;
+	int data_borrowed;
+
+	/* Size of the buffer the sections have been borrowed from. */
+	size_t source_size;
+
+	/* Payload of the first APP1 section in that buffer, as loaded. */
+	const unsigned char *source_app1;
+	unsigned int source_app1_size;
+
+	/* Descriptor of the same file, used to copy the unchanged tail,
+	 * and the size of the file. */
+	int fd;
+	off_t file_size;
+
+	/* Allocator of EXIF data, NULL for the libexif default one. */
+	ExifMem *mem;
+
+	/* Output of jpeg_data_save_file, kept between files. */
+	JPEGDataBuffer out;
 };
 
 JPEGData *
@@ -60,6 +109,7 @@ jpeg_data_new (void)
 	}
 	memset (data->priv, 0, sizeof (JPEGDataPrivate));
 	data->priv->ref_count = 1;
+	data->priv->fd = -1;
 
 	return (data);
 }
@@ -68,59 +118,622 @@ void
 jpeg_data_append_section (JPEGData *data)
 {
 	JPEGSection *s;
+	unsigned int alloc;
 
 	if (!data) return;
 
-	if (!data->count)
-		s = malloc (sizeof (JPEGSection));
+	if (data->count == data->priv->sections_alloc) {
+		alloc = data->priv->sections_alloc ?
+			data->priv->sections_alloc * 2 : 8;
+		s = realloc (data->sections, sizeof (JPEGSection) * alloc);
+		if (!s) {
+			EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
+					sizeof (JPEGSection) * alloc);
+			return;
+		}
+		data->sections = s;
+		data->priv->sections_alloc = alloc;
+	}
+	memset (data->sections + data->count, 0, sizeof (JPEGSection));
+	data->count++;
+}
+
+static ExifData *
+jpeg_data_new_exif_data (JPEGData *data, const unsigned char *d,
+			 unsigned int size)
+{
+	ExifData *exif_data;
+
+	if (!data->priv->mem)
+		return exif_data_new_from_data (d, size);
+	exif_data = exif_data_new_mem (data->priv->mem);
+	if (exif_data)
+		exif_data_load_data (exif_data, d, size);
+	return exif_data;
+}
+
+/* Frees a blob made by exif_data_save_data of our EXIF data */
+static void
+jpeg_data_free_blob (JPEGData *data, unsigned char *d)
+{
+	if (data->priv->mem)
+		exif_mem_free (data->priv->mem, d);
 	else
-		s = realloc (data->sections,
-			     sizeof (JPEGSection) * (data->count + 1));
-	if (!s) {
+		free (d);
+}
+
+static void
+jpeg_data_clear_app1 (JPEGData *data, JPEGSection *s)
+{
+	if (s->flags & JPEG_SECTION_FLAG_SERIALIZED) {
+		jpeg_data_free_blob (data, s->content.generic.data);
+		s->flags &= ~JPEG_SECTION_FLAG_SERIALIZED;
+	} else
+		exif_data_unref (s->content.app1);
+	memset (&s->content, 0, sizeof (JPEGContent));
+}
+
+static int
+jpeg_data_buffer_reserve (JPEGDataBuffer *b, size_t n)
+{
+	size_t alloc;
+	unsigned char *d;
+
+	if (n <= b->alloc - b->size)
+		return 1;
+	if (n > SIZE_MAX - b->size)
+		return 0;
+	alloc = b->alloc ? b->alloc : 256;
+	while (alloc - b->size < n)
+		alloc = (alloc > SIZE_MAX / 2) ? b->size + n : alloc * 2;
+	d = realloc (b->d, alloc);
+	if (!d)
+		return 0;
+	b->d = d;
+	b->alloc = alloc;
+	return 1;
+}
+
+static int
+jpeg_data_buffer_append (JPEGDataBuffer *b, const unsigned char *d,
+			 size_t size)
+{
+	if (!jpeg_data_buffer_reserve (b, size))
+		return 0;
+	memcpy (b->d + b->size, d, size);
+	b->size += size;
+	return 1;
+}
+
+/* Writes the marker and, unless it is 0, the length of the segment */
+static int
+jpeg_data_buffer_marker (JPEGDataBuffer *b, JPEGMarker marker,
+			 unsigned int size)
+{
+	unsigned char h[4];
+
+	h[0] = 0xff;
+	h[1] = marker;
+	h[2] = (size + 2) >> 8;
+	h[3] = (size + 2) >> 0;
+	return jpeg_data_buffer_append (b, h, size ? 4 : 2);
+}
+
+/* Size of the section in the output, not counting ExifData payload */
+static size_t
+jpeg_data_section_size (JPEGData *data, const JPEGSection *s)
+{
+	switch (s->marker) {
+	case JPEG_MARKER_SOI:
+	case JPEG_MARKER_EOI:
+		return 2;
+	case JPEG_MARKER_APP1:
+		if (s->flags & JPEG_SECTION_FLAG_SERIALIZED)
+			return 4 + s->content.generic.size;
+		return 4;
+	case JPEG_MARKER_SOS:
+		return 4 + s->content.generic.size + data->size;
+	default:
+		return 4 + s->content.generic.size;
+	}
+}
+
+/*
+ * Generates given sections into the output buffer of the data, which is
+ * reused between calls. Returns 0 if it runs out of memory.
+ */
+static int
+jpeg_data_save_sections (JPEGData *data, unsigned int from, unsigned int to)
+{
+	unsigned int i, eds = 0;
+	size_t size = 0;
+	JPEGDataBuffer *b = &data->priv->out;
+	JPEGSection *s;
+	unsigned char *ed = NULL;
+	int ok = 1;
+
+	/* Presize the buffer, so that only EXIF data might need to grow it */
+	for (i = from; i < to; i++)
+		size += jpeg_data_section_size (data, &data->sections[i]);
+	b->size = 0;
+	if (!jpeg_data_buffer_reserve (b, size))
+		ok = 0;
+
+	for (i = from; ok && i < to; i++) {
+		s = &data->sections[i];
+
+		switch (s->marker) {
+		case JPEG_MARKER_SOI:
+		case JPEG_MARKER_EOI:
+			ok = jpeg_data_buffer_marker (b, s->marker, 0);
+			break;
+		case JPEG_MARKER_APP1:
+			if (s->flags & JPEG_SECTION_FLAG_SERIALIZED) {
+				ok = jpeg_data_buffer_marker (b, s->marker,
+							      s->content.generic.size) &&
+				     jpeg_data_buffer_append (b, s->content.generic.data,
+							      s->content.generic.size);
+				break;
+			}
+			exif_data_save_data (s->content.app1, &ed, &eds);
+			if (!ed) {
+				ok = jpeg_data_buffer_marker (b, s->marker, 0);
+				break;
+			}
+			ok = jpeg_data_buffer_marker (b, s->marker, eds) &&
+			     jpeg_data_buffer_append (b, ed, eds);
+			jpeg_data_free_blob (data, ed);
+			ed = NULL;
+			break;
+		default:
+			ok = jpeg_data_buffer_marker (b, s->marker,
+						      s->content.generic.size) &&
+			     jpeg_data_buffer_append (b, s->content.generic.data,
+						      s->content.generic.size);
+
+			/* In case of SOS, we need to write the data. */
+			if (ok && s->marker == JPEG_MARKER_SOS)
+				ok = jpeg_data_buffer_append (b, data->data,
+							      data->size);
+			break;
+		}
+	}
+
+	if (!ok) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", size);
+		b->size = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static int
+jpeg_data_write (int fd, const unsigned char *d, size_t size)
+{
+	ssize_t w;
+
+	while (size) {
+		w = write (fd, d, size);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return 0;
+		d += w;
+		size -= w;
+	}
+	return 1;
+}
+
+/*
+ * Copies the range of the source file to the output descriptor letting
+ * the kernel move the bytes where possible. Otherwise the range is
+ * written from the headers in memory, or read from the file in chunks,
+ * which reuse the output buffer.
+ */
+static int
+jpeg_data_copy_data (JPEGData *data, int out, off_t offset, off_t size)
+{
+	JPEGDataBuffer *b = &data->priv->out;
+	ssize_t r;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	off_t o;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	o = offset;
+	while (size) {
+		r = copy_file_range (data->priv->fd, &o, out, NULL,
+				     MIN (size, SSIZE_MAX), 0);
+		if (r <= 0)
+			break;
+		size -= r;
+	}
+	if (!size)
+		return 1;
+	offset = o;
+#endif
+#ifdef HAVE_SENDFILE
+	o = offset;
+	while (size) {
+		r = sendfile (out, data->priv->fd, &o, MIN (size, SSIZE_MAX));
+		if (r <= 0)
+			break;
+		size -= r;
+	}
+	if (!size)
+		return 1;
+	offset = o;
+#endif
+	if (offset + size <= (off_t) data->priv->head_size)
+		return jpeg_data_write (out, data->priv->head + offset, size);
+
+	b->size = 0;
+	if (!jpeg_data_buffer_reserve (b, JPEG_DATA_COPY_CHUNK)) {
 		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
-				sizeof (JPEGSection) * (data->count + 1));
+				    JPEG_DATA_COPY_CHUNK);
+		return 0;
+	}
+	while (size) {
+		r = pread (data->priv->fd, b->d, MIN (size, JPEG_DATA_COPY_CHUNK),
+			   offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0)
+			/* The file has been truncated meanwhile */
+			errno = EIO;
+		if (r <= 0 || !jpeg_data_write (out, b->d, r))
+			return 0;
+		offset += r;
+		size -= r;
+	}
+	return 1;
+}
+
+/*
+ * Copies the range like jpeg_data_copy_data, but only the data of a
+ * sparse source: the output is seeked over the holes, so that they stay
+ * holes instead of being written out as zeros.
+ */
+static int
+jpeg_data_copy_range (JPEGData *data, int out, off_t offset, off_t size)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t end = offset + size, d, h;
+
+	while (offset < end) {
+		d = lseek (data->priv->fd, offset, SEEK_DATA);
+		if (d < 0 && errno != ENXIO)
+			/* No holes to be found, copy everything */
+			break;
+		/* ENXIO means there is no data left before the end */
+		if (d < 0 || d > end)
+			d = end;
+		if (d > offset) {
+			if (lseek (out, d - offset, SEEK_CUR) < 0)
+				return 0;
+			offset = d;
+		}
+		if (offset == end)
+			/* Extends the output over the trailing hole */
+			return ftruncate (out, lseek (out, 0, SEEK_CUR)) == 0;
+		h = lseek (data->priv->fd, offset, SEEK_HOLE);
+		if (h < 0)
+			break;
+		if (h > end)
+			h = end;
+		if (!jpeg_data_copy_data (data, out, offset, h - offset))
+			return 0;
+		offset = h;
+	}
+	size = end - offset;
+#endif
+	return jpeg_data_copy_data (data, out, offset, size);
+}
+
+/*
+ * Returns index of the first section of the tail, which still matches
+ * the source file byte for byte and can be copied from it as is.
+ * APP1 is never a part of it, because EXIF data is changed in place.
+ */
+static unsigned int
+jpeg_data_get_tail (JPEGData *data)
+{
+	unsigned int i;
+
+	if (!data->priv->data_borrowed)
+		return data->count;
+	for (i = data->count; i > 0; i--) {
+		if (data->sections[i - 1].marker == JPEG_MARKER_APP1 ||
+		    !(data->sections[i - 1].flags & JPEG_SECTION_FLAG_SOURCE))
+			break;
+	}
+	return i;
+}
+
+/*
+ * Applies metadata of the original file and flushes the descriptor
+ * according to the options. Returns 1 on success, 0 on failure.
+ */
+static int
+jpeg_data_finish_file (JPEGData *data, int fd, const struct stat *orig)
+{
+	if (orig && (data->priv->options & JPEG_DATA_OPTION_KEEP_MODE) &&
+	    fchmod (fd, orig->st_mode & 07777) < 0)
+		return 0;
+#ifdef HAVE_FUTIMENS
+	if (orig && (data->priv->options & JPEG_DATA_OPTION_KEEP_MTIME)) {
+		struct timespec times[2];
+
+		times[0] = orig->st_atim;
+		times[1] = orig->st_mtim;
+		if (futimens (fd, times) < 0)
+			return 0;
+	}
+#endif
+	if ((data->priv->options & JPEG_DATA_OPTION_FSYNC) && fsync (fd) < 0)
+		return 0;
+	return 1;
+}
+
+static void
+jpeg_data_sync_dir (const char *path)
+{
+	char *dir, *slash;
+	int fd;
+
+	dir = strdup (path);
+	if (!dir)
 		return;
+	slash = strrchr (dir, '/');
+	if (!slash)
+		strcpy (dir, ".");
+	else if (slash == dir)
+		dir[1] = 0;
+	else
+		*slash = 0;
+	fd = open (dir, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync (fd);
+		close (fd);
 	}
-	memset(s + data->count, 0, sizeof (JPEGSection));
-	data->sections = s;
-	data->count++;
+	free (dir);
+}
+
+/*
+ * Creates a new file in the directory of 'path', so that it could be
+ * renamed over it later. The name is short and of a fixed length, so
+ * that it fits whatever the length of the name of the original. The
+ * name of the file is returned in 'tmp'.
+ */
+static int
+jpeg_data_open_temp (const char *path, char **tmp)
+{
+	static unsigned int counter;
+	const char *slash;
+	size_t dir_len, len;
+	unsigned int n;
+	int fd = -1, i;
+
+	slash = strrchr (path, '/');
+	dir_len = slash ? (size_t) (slash - path) + 1 : 0;
+	len = dir_len + 32;
+	*tmp = malloc (len);
+	if (!*tmp)
+		return -1;
+	for (i = 0; i < 100; i++) {
+#ifdef HAVE_ATOMIC_BUILTINS
+		n = __atomic_fetch_add (&counter, 1, __ATOMIC_RELAXED);
+#else
+		n = counter++;
+#endif
+		snprintf (*tmp, len, "%.*s.%08lx%08x.tmp", (int) dir_len, path,
+			  (unsigned long) getpid () & 0xffffffffUL, n);
+		fd = open (*tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (fd < 0) {
+		free (*tmp);
+		*tmp = NULL;
+	}
+	return fd;
+}
+
+/*
+ * Overwrites APP1 segment of the source file, when 'path' refers to it
+ * and the new EXIF data fits into the old segment. The rest of the
+ * segment is padded with zeros, so that the file keeps its layout.
+ * Returns 1 when the file has been patched, 0 if it has to be rewritten.
+ * A write, which fails part way, is undone as far as it goes, and the
+ * file is rewritten then.
+ */
+static int
+jpeg_data_patch_file (JPEGData *data, const char *path)
+{
+	struct stat src, dst;
+	unsigned int i, app1 = 0, count = 0, slot, seg, eds = 0, o, u;
+	unsigned char *ed = NULL, *d, *orig;
+	off_t offset;
+	ssize_t w, r;
+	int fd, ok;
+
+	if (data->priv->fd < 0)
+		return 0;
+	for (i = 0; i < data->count; i++) {
+		if (!(data->sections[i].flags & JPEG_SECTION_FLAG_SOURCE))
+			return 0;
+		if (data->sections[i].marker == JPEG_MARKER_APP1) {
+			app1 = i;
+			count++;
+		}
+	}
+	if (count != 1 || app1 + 1 >= data->count)
+		return 0;
+	if (fstat (data->priv->fd, &src) < 0 || stat (path, &dst) < 0 ||
+	    src.st_dev != dst.st_dev || src.st_ino != dst.st_ino)
+		return 0;
+
+	/*
+	 * Sections follow each other, so the slot is the segment and the
+	 * fill bytes in front of the next marker, if any. The segment
+	 * takes as much of it as its length allows, the rest stays fill.
+	 */
+	offset = data->sections[app1].offset;
+	slot = (unsigned int) (data->sections[app1 + 1].offset - offset);
+	seg = MIN (slot, 0xffff + 2);
+	if (data->sections[app1].flags & JPEG_SECTION_FLAG_SERIALIZED) {
+		ed = data->sections[app1].content.generic.data;
+		eds = data->sections[app1].content.generic.size;
+	} else {
+		exif_data_save_data (data->sections[app1].content.app1,
+				     &ed, &eds);
+		if (!ed)
+			return 0;
+	}
+	if (eds + 4 > seg) {
+		if (ed != data->sections[app1].content.generic.data)
+			jpeg_data_free_blob (data, ed);
+		return 0;
+	}
+
+	/* The new slot, followed by the old one */
+	data->priv->out.size = 0;
+	d = NULL;
+	if (jpeg_data_buffer_reserve (&data->priv->out, (size_t) slot * 2)) {
+		d = data->priv->out.d;
+		memset (d, 0, seg);
+		d[0] = 0xff;
+		d[1] = JPEG_MARKER_APP1;
+		d[2] = (seg - 2) >> 8;
+		d[3] = (seg - 2) >> 0;
+		memcpy (d + 4, ed, eds);
+		memset (d + seg, 0xff, slot - seg);
+	} else
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", slot * 2);
+	if (ed != data->sections[app1].content.generic.data)
+		jpeg_data_free_blob (data, ed);
+	if (!d)
+		return 0;
+	orig = d + slot;
+
+	fd = open (path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	for (o = 0; o < slot; o += r) {
+		r = pread (fd, orig + o, slot - o, offset + o);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0)
+			break;
+	}
+	if (o != slot) {
+		close (fd);
+		return 0;
+	}
+	for (o = 0; o < slot; o += w) {
+		w = pwrite (fd, d + o, slot - o, offset + o);
+		if (w < 0 && errno == EINTR) {
+			w = 0;
+			continue;
+		}
+		if (w <= 0)
+			break;
+	}
+	if (o != slot) {
+		for (u = 0; u < o; u += w) {
+			w = pwrite (fd, orig + u, o - u, offset + u);
+			if (w < 0 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w <= 0)
+				break;
+		}
+		close (fd);
+		return 0;
+	}
+	ok = jpeg_data_finish_file (data, fd, &dst);
+	if (close (fd) < 0)
+		ok = 0;
+	return ok;
 }
 
-/*! jpeg_data_save_file returns 1 on success, 0 on failure */
+/*! jpeg_data_save_file returns 1 on success, 0 with errno set on failure */
 int
 jpeg_data_save_file (JPEGData *data, const char *path)
 {
-	FILE *f;
+	struct stat orig;
+	char *tmp;
+	int fd;
 	unsigned char *d = NULL;
-	unsigned int size = 0, written;
+	size_t size = 0;
+	unsigned int tail;
+	off_t tail_offset = 0;
+	int ok, err;
 
-	jpeg_data_save_data (data, &d, &size);
-	if (!d)
+	if (!data) {
+		errno = EINVAL;
 		return 0;
+	}
 
-	remove (path);
-	f = fopen (path, "wb");
-	if (!f) {
-		free (d);
+	if ((data->priv->options & JPEG_DATA_OPTION_PATCH_IN_PLACE) &&
+	    jpeg_data_patch_file (data, path))
+		return 1;
+
+	/* Only the sections in front of the tail are generated in memory. */
+	tail = data->priv->fd >= 0 ? jpeg_data_get_tail (data) : data->count;
+	if (tail < data->count)
+		tail_offset = data->sections[tail].offset;
+	if (!jpeg_data_save_sections (data, 0, tail)) {
+		errno = ENOMEM;
+		return 0;
+	}
+	d = data->priv->out.d;
+	size = data->priv->out.size;
+	if (!size && tail == data->count) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/*
+	 * The new content goes to a temporary file, which then replaces
+	 * the original, so that the original is never seen truncated.
+	 */
+	fd = jpeg_data_open_temp (path, &tmp);
+	if (fd < 0)
 		return 0;
+	ok = jpeg_data_write (fd, d, size);
+	if (ok && tail < data->count)
+		ok = jpeg_data_copy_range (data, fd, tail_offset,
+					   data->priv->file_size - tail_offset);
+	if (ok)
+		ok = jpeg_data_finish_file (data, fd,
+					    stat (path, &orig) == 0 ? &orig : NULL);
+	err = ok ? 0 : errno;
+	if (close (fd) < 0 && ok) {
+		ok = 0;
+		err = errno;
 	}
-	written = fwrite (d, 1, size, f);
-	fclose (f);
-	free (d);
-	if (written == size)  {
+	if (ok && rename (tmp, path) == 0)  {
+		if (data->priv->options & JPEG_DATA_OPTION_FSYNC)
+			jpeg_data_sync_dir (path);
+		free (tmp);
 		return 1;
 	}
-	remove(path);
+	if (ok)
+		err = errno;
+	remove (tmp);
+	free (tmp);
+	/* A short write or copy leaves no errno of its own */
+	errno = err ? err : EIO;
 	return 0;
 }
 
 void
-jpeg_data_save_data (JPEGData *data, unsigned char **d, unsigned int *ds)
+jpeg_data_save_data (JPEGData *data, unsigned char **d, size_t *ds)
 {
-	unsigned int i, eds = 0;
-	JPEGSection s;
-	unsigned char *ed = NULL;
-
 	if (!data)
 		return;
 	if (!d)
@@ -128,55 +741,46 @@ jpeg_data_save_data (JPEGData *data, unsigned char **d, unsigned int *ds)
 	if (!ds)
 		return;
 
-	for (*ds = i = 0; i < data->count; i++) {
-		s = data->sections[i];
+	/* The caller owns the result, so the buffer is handed over. */
+	if (!jpeg_data_save_sections (data, 0, data->count)) {
+		*d = NULL;
+		*ds = 0;
+		return;
+	}
+	*d = data->priv->out.d;
+	*ds = data->priv->out.size;
+	memset (&data->priv->out, 0, sizeof (JPEGDataBuffer));
+}
 
-		/* Write the marker */
-		CLEANUP_REALLOC (*d, sizeof (char) * (*ds + 2));
-		(*d)[*ds + 0] = 0xff;
-		(*d)[*ds + 1] = s.marker;
-		*ds += 2;
+/*
+ * Like jpeg_data_save_data, but leaves out the unchanged sections at the
+ * end of the source, from *tail up to the end of the loaded data (or the
+ * file). *tail is the size of the source if nothing is left out. *d stays
+ * owned by data and is valid until the next save. Returns 0 if it runs out
+ * of memory.
+ */
+int
+jpeg_data_save_head (JPEGData *data, const unsigned char **d,
+		     size_t *ds, size_t *tail)
+{
+	unsigned int i;
 
-		switch (s.marker) {
-		case JPEG_MARKER_SOI:
-		case JPEG_MARKER_EOI:
-			break;
-		case JPEG_MARKER_APP1:
-			exif_data_save_data (s.content.app1, &ed, &eds);
-			if (!ed) break;
-			CLEANUP_REALLOC (*d, sizeof (char) * (*ds + 2));
-			(*d)[*ds + 0] = (eds + 2) >> 8;
-			(*d)[*ds + 1] = (eds + 2) >> 0;
-			*ds += 2;
-			CLEANUP_REALLOC (*d, sizeof (char) * (*ds + eds));
-			memcpy (*d + *ds, ed, eds);
-			*ds += eds;
-			free (ed);
-			break;
-		default:
-			CLEANUP_REALLOC (*d, sizeof (char) *
-					(*ds + s.content.generic.size + 2));
-			(*d)[*ds + 0] = (s.content.generic.size + 2) >> 8;
-			(*d)[*ds + 1] = (s.content.generic.size + 2) >> 0;
-			*ds += 2;
-			memcpy (*d + *ds, s.content.generic.data,
-				s.content.generic.size);
-			*ds += s.content.generic.size;
+	if (!data || !d || !ds || !tail)
+		return 0;
 
-			/* In case of SOS, we need to write the data. */
-			if (s.marker == JPEG_MARKER_SOS) {
-				CLEANUP_REALLOC (*d, *ds + data->size);
-				memcpy (*d + *ds, data->data, data->size);
-				*ds += data->size;
-			}
-			break;
-		}
-	}
+	i = jpeg_data_get_tail (data);
+	if (!jpeg_data_save_sections (data, 0, i))
+		return 0;
+	*d = data->priv->out.d;
+	*ds = data->priv->out.size;
+	*tail = i < data->count ? (size_t) data->sections[i].offset :
+				  data->priv->source_size;
+	return 1;
 }
 
 JPEGData *
 jpeg_data_new_from_data (const unsigned char *d,
-			 unsigned int size)
+			 size_t size)
 {
 	JPEGData *data;
 
@@ -185,16 +789,19 @@ jpeg_data_new_from_data (const unsigned char *d,
 	return (data);
 }
 
-void
-jpeg_data_load_data (JPEGData *data, const unsigned char *d,
-		     unsigned int size)
+static void
+jpeg_data_load (JPEGData *data, const unsigned char *d,
+		size_t size, int borrow)
 {
-	unsigned int i, o, len;
+	unsigned int i, len;
+	size_t o;
 	JPEGSection *s;
 	JPEGMarker marker;
 
 	if (!data) return;
 	if (!d) return;
+	if (borrow)
+		data->priv->source_size = size;
 
 	for (o = 0; o < size;) {
 
@@ -217,6 +824,10 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 		if (!data->count) return;
 		s = &data->sections[data->count - 1];
 		s->marker = marker;
+		if (borrow) {
+			s->flags |= JPEG_SECTION_FLAG_SOURCE;
+			s->offset = (off_t) o;
+		}
 		o += i + 1;
 
 		switch (s->marker) {
@@ -234,18 +845,27 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 
 			switch (s->marker) {
 			case JPEG_MARKER_APP1:
-				s->content.app1 = exif_data_new_from_data (
-							d + o - 4, len + 4);
+				s->content.app1 = jpeg_data_new_exif_data (
+							data, d + o - 4, len + 4);
+				if (borrow && !data->priv->source_app1) {
+					data->priv->source_app1 = d + o;
+					data->priv->source_app1_size = len;
+				}
 				break;
 			default:
-				s->content.generic.data =
-						malloc (sizeof (char) * len);
-				if (!s->content.generic.data) {
-					EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * len);
-					return;
+				if (borrow) {
+					s->content.generic.data = (unsigned char *) &d[o];
+					s->flags |= JPEG_SECTION_FLAG_BORROWED;
+				} else {
+					s->content.generic.data =
+							malloc (sizeof (char) * len);
+					if (!s->content.generic.data) {
+						EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * len);
+						return;
+					}
+					memcpy (s->content.generic.data, &d[o], len);
 				}
 				s->content.generic.size = len;
-				memcpy (s->content.generic.data, &d[o], len);
 
 				/* In case of SOS, image data will follow. */
 				if (s->marker == JPEG_MARKER_SOS) {
@@ -262,15 +882,20 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 							data->size += 2;
 						}
 					}
-					data->data = malloc (
-						sizeof (char) * data->size);
-					if (!data->data) {
-						EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * data->size);
-						data->size = 0;
-						return;
+					if (borrow) {
+						data->data = (unsigned char *) d + o + len;
+						data->priv->data_borrowed = 1;
+					} else {
+						data->data = malloc (
+							sizeof (char) * data->size);
+						if (!data->data) {
+							EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * data->size);
+							data->size = 0;
+							return;
+						}
+						memcpy (data->data, d + o + len,
+							data->size);
 					}
-					memcpy (data->data, d + o + len,
-						data->size);
 					o += data->size;
 				}
 				break;
@@ -281,6 +906,24 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 	}
 }
 
+void
+jpeg_data_load_data (JPEGData *data, const unsigned char *d,
+		     size_t size)
+{
+	jpeg_data_load (data, d, size, 0);
+}
+
+/*
+ * Loads the data without copying it: the sections and the scan point into
+ * d, which must stay unchanged until the data is reset or freed.
+ */
+void
+jpeg_data_borrow_data (JPEGData *data, const unsigned char *d,
+		       size_t size)
+{
+	jpeg_data_load (data, d, size, 1);
+}
+
 JPEGData *
 jpeg_data_new_from_file (const char *path)
 {
@@ -291,44 +934,109 @@ jpeg_data_new_from_file (const char *path)
 	return (data);
 }
 
+/*
+ * Reads the file from its beginning up to the end of the SOS header into
+ * a new buffer, so that the scan stays in the file and is never held in
+ * memory. Reads the whole file, if it has no SOS. Returns NULL on error.
+ */
+static unsigned char *
+jpeg_data_read_head (JPEGData *data, int fd, off_t file_size, size_t *size)
+{
+	const JPEGScanSegment *sos;
+	unsigned char *d;
+	JPEGScan scan;
+	off_t end = file_size;
+	size_t o;
+	ssize_t r;
+
+	jpeg_scan_init (&scan);
+	jpeg_scan_fd (&scan, fd);
+	sos = scan.complete ? &scan.segments[scan.count - 1] : NULL;
+	if (sos && JPEG_SCAN_SEGMENT_DATA (sos) + sos->size <= file_size)
+		end = JPEG_SCAN_SEGMENT_DATA (sos) + sos->size;
+	jpeg_scan_clear (&scan);
+	if ((unsigned long long) end > SIZE_MAX)
+		return NULL;
+
+	*size = (size_t) end;
+	d = malloc (*size);
+	if (!d) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", *size);
+		return NULL;
+	}
+	for (o = 0; o < *size; o += r) {
+		r = pread (fd, d + o, *size - o, (off_t) o);
+		if (r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0)
+			break;
+	}
+	if (o != *size) {
+		free (d);
+		return NULL;
+	}
+	return d;
+}
+
+/*
+ * Reads the headers of the file up to the end of SOS and keeps them for
+ * the lifetime of the data, so that the sections can borrow from them.
+ * The scan stays in the file and is copied from it when the data is
+ * saved. The file is never mapped: another process may truncate it
+ * meanwhile, which turns a read of the map into SIGBUS, while pread and
+ * the copy only come up short and fail.
+ */
 void
 jpeg_data_load_file (JPEGData *data, const char *path)
 {
-	FILE *f;
-	unsigned char *d;
-	unsigned int size;
+	int fd;
+	struct stat st;
+	unsigned char *d = NULL;
+	size_t size = 0;
 
 	if (!data) return;
 	if (!path) return;
 
-	f = fopen (path, "rb");
-	if (!f) {
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
 				_("Path '%s' invalid."), path);
 		return;
 	}
+	if (fstat (fd, &st) < 0 || st.st_size <= 0) {
+		close (fd);
+		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
+				_("Could not read '%s'."), path);
+		return;
+	}
 
-	/* For now, we read the data into memory. Patches welcome... */
-	fseek (f, 0, SEEK_END);
-	size = ftell (f);
-	fseek (f, 0, SEEK_SET);
-	d = malloc (size);
+	d = jpeg_data_read_head (data, fd, st.st_size, &size);
 	if (!d) {
-		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", size);
-		fclose (f);
+		close (fd);
+		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
+				_("Could not read '%s'."), path);
 		return;
 	}
-	if (fread (d, 1, size, f) != size) {
+
+	if (data->priv->head) {
+		/* Already backed by another file, fall back to copying. */
+		if ((off_t) size == st.st_size)
+			jpeg_data_load (data, d, size, 0);
+		else
+			exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
+					_("Could not read '%s'."), path);
+		close (fd);
 		free (d);
-		fclose (f);
-		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
-				_("Could not read '%s'."), path);
 		return;
 	}
-	fclose (f);
 
-	jpeg_data_load_data (data, d, size);
-	free (d);
+	data->priv->head = d;
+	data->priv->head_size = size;
+	data->priv->fd = fd;
+	data->priv->file_size = st.st_size;
+	jpeg_data_load (data, d, size, 1);
 }
 
 void
@@ -354,42 +1062,69 @@ jpeg_data_unref (JPEGData *data)
 }
 
 void
-jpeg_data_free (JPEGData *data)
+jpeg_data_reset (JPEGData *data)
 {
 	unsigned int i;
-	JPEGSection s;
+	JPEGSection *s;
 
-	if (!data)
+	if (!data || !data->priv)
 		return;
 
-	if (data->count) {
-		for (i = 0; i < data->count; i++) {
-			s = data->sections[i];
-			switch (s.marker) {
-			case JPEG_MARKER_SOI:
-			case JPEG_MARKER_EOI:
-				break;
-			case JPEG_MARKER_APP1:
-				exif_data_unref (s.content.app1);
-				break;
-			default:
-				free (s.content.generic.data);
-				break;
-			}
+	for (i = 0; i < data->count; i++) {
+		s = &data->sections[i];
+		switch (s->marker) {
+		case JPEG_MARKER_SOI:
+		case JPEG_MARKER_EOI:
+			break;
+		case JPEG_MARKER_APP1:
+			jpeg_data_clear_app1 (data, s);
+			break;
+		default:
+			if (!(s->flags & JPEG_SECTION_FLAG_BORROWED))
+				free (s->content.generic.data);
+			break;
 		}
-		free (data->sections);
 	}
+	data->count = 0;
 
-	if (data->data)
+	if (data->data && !data->priv->data_borrowed)
 		free (data->data);
+	data->data = NULL;
+	data->size = 0;
+	data->priv->data_borrowed = 0;
+	data->priv->source_size = 0;
+	data->priv->source_app1 = NULL;
+	data->priv->source_app1_size = 0;
+
+	free (data->priv->head);
+	data->priv->head = NULL;
+	data->priv->head_size = 0;
+	if (data->priv->fd >= 0)
+		close (data->priv->fd);
+	data->priv->fd = -1;
+	data->priv->file_size = 0;
+}
+
+void
+jpeg_data_free (JPEGData *data)
+{
+	if (!data)
+		return;
 
 	if (data->priv) {
+		jpeg_data_reset (data);
+		free (data->priv->out.d);
+		if (data->priv->mem) {
+			exif_mem_unref (data->priv->mem);
+			data->priv->mem = NULL;
+		}
 		if (data->priv->log) {
 			exif_log_unref (data->priv->log);
 			data->priv->log = NULL;
 		}
 		free (data->priv);
 	}
+	free (data->sections);
 
 	free (data);
 }
@@ -404,7 +1139,8 @@ jpeg_data_dump (JPEGData *data)
 	if (!data)
 		return;
 
-	printf ("Dumping JPEG data (%i bytes of data)...\n", data->size);
+	printf ("Dumping JPEG data (%lu bytes of data)...\n",
+		(unsigned long) data->size);
 	for (i = 0; i < data->count; i++) {
 		marker = data->sections[i].marker;
 		content = data->sections[i].content;
@@ -417,7 +1153,10 @@ jpeg_data_dump (JPEGData *data)
                 case JPEG_MARKER_EOI:
 			break;
                 case JPEG_MARKER_APP1:
-			exif_data_dump (content.app1);
+			if (data->sections[i].flags & JPEG_SECTION_FLAG_SERIALIZED)
+				printf ("  Size: %i\n", content.generic.size);
+			else
+				exif_data_dump (content.app1);
 			break;
                 default:
 			printf ("  Size: %i\n", content.generic.size);
@@ -451,6 +1190,10 @@ jpeg_data_get_exif_data (JPEGData *data)
 
 	section = jpeg_data_get_section (data, JPEG_MARKER_APP1);
 	if (section) {
+		if (section->flags & JPEG_SECTION_FLAG_SERIALIZED)
+			return jpeg_data_new_exif_data (data,
+				section->content.generic.data,
+				section->content.generic.size);
 		exif_data_ref (section->content.app1);
 		return (section->content.app1);
 	}
@@ -458,26 +1201,79 @@ jpeg_data_get_exif_data (JPEGData *data)
 	return (NULL);
 }
 
-void
-jpeg_data_set_exif_data (JPEGData *data, ExifData *exif_data)
+/* Returns APP1 section with its content released, adds one if needed */
+static JPEGSection *
+jpeg_data_reset_app1 (JPEGData *data)
 {
 	JPEGSection *section;
 
-	if (!data) return;
-
 	section = jpeg_data_get_section (data, JPEG_MARKER_APP1);
 	if (!section) {
 		jpeg_data_append_section (data);
-		if (data->count < 2) return;
+		if (data->count < 2) return NULL;
 		memmove (&data->sections[2], &data->sections[1],
 			 sizeof (JPEGSection) * (data->count - 2));
 		section = &data->sections[1];
+		memset (section, 0, sizeof (JPEGSection));
 	} else {
-		exif_data_unref (section->content.app1);
+		jpeg_data_clear_app1 (data, section);
 	}
 	section->marker = JPEG_MARKER_APP1;
-	section->content.app1 = exif_data;
+	return section;
+}
+
+void
+jpeg_data_set_exif_data (JPEGData *data, ExifData *exif_data)
+{
+	JPEGSection *section;
+
+	if (!data) return;
+
+	/* The section may hold the very same data */
 	exif_data_ref (exif_data);
+	section = jpeg_data_reset_app1 (data);
+	if (!section) {
+		exif_data_unref (exif_data);
+		return;
+	}
+	section->content.app1 = exif_data;
+}
+
+/*
+ * Returns the payload of the APP1 section, which jpeg_data_get_exif_data
+ * parses, as it is in the buffer the data has been borrowed from, so that
+ * tags libexif does not know can still be read. NULL when the data has
+ * been copied, or has no APP1.
+ */
+const unsigned char *
+jpeg_data_get_source_exif (JPEGData *data, unsigned int *size)
+{
+	if (!data || !data->priv || !data->priv->source_app1)
+		return NULL;
+	*size = data->priv->source_app1_size;
+	return data->priv->source_app1;
+}
+
+/*
+ * Stores serialized EXIF data (as produced by exif_data_save_data) in the
+ * APP1 section, so it is written out as is. Takes ownership of the buffer,
+ * which comes from the memory set with jpeg_data_set_mem.
+ */
+void
+jpeg_data_set_exif_blob (JPEGData *data, unsigned char *d, unsigned int size)
+{
+	JPEGSection *section;
+
+	if (!data || !d) return;
+
+	section = jpeg_data_reset_app1 (data);
+	if (!section) {
+		jpeg_data_free_blob (data, d);
+		return;
+	}
+	section->flags |= JPEG_SECTION_FLAG_SERIALIZED;
+	section->content.generic.data = d;
+	section->content.generic.size = size;
 }
 
 void
@@ -488,3 +1284,26 @@ jpeg_data_log (JPEGData *data, ExifLog *log)
 	data->priv->log = log;
 	exif_log_ref (log);
 }
+
+void
+jpeg_data_set_mem (JPEGData *data, ExifMem *mem)
+{
+	if (!data || !data->priv) return;
+	if (data->priv->mem) exif_mem_unref (data->priv->mem);
+	data->priv->mem = mem;
+	if (mem) exif_mem_ref (mem);
+}
+
+void
+jpeg_data_set_option (JPEGData *data, JPEGDataOption o)
+{
+	if (!data || !data->priv) return;
+	data->priv->options |= o;
+}
+
+void
+jpeg_data_unset_option (JPEGData *data, JPEGDataOption o)
+{
+	if (!data || !data->priv) return;
+	data->priv->options &= ~o;
+}
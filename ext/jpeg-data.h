@@ -23,8 +23,12 @@
 
 #include "jpeg-marker.h"
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #include <libexif/exif-data.h>
 #include <libexif/exif-log.h>
+#include <libexif/exif-mem.h>
 
 typedef ExifData * JPEGContentAPP1;
 
@@ -42,13 +46,42 @@ union _JPEGContent
 	JPEGContentAPP1    app1;
 };
 
+typedef enum {
+	/* Generic content points into the buffer the data was loaded from
+	 * and must not be freed along with the section. */
+	JPEG_SECTION_FLAG_BORROWED = 1 << 0,
+	/* The section is stored in the file the data has been loaded from
+	 * at 'offset' and has not been changed since. */
+	JPEG_SECTION_FLAG_SOURCE   = 1 << 1,
+	/* APP1 section holds already serialized EXIF data as generic
+	 * content instead of ExifData. */
+	JPEG_SECTION_FLAG_SERIALIZED = 1 << 2
+} JPEGSectionFlag;
+
 typedef struct _JPEGSection JPEGSection;
 struct _JPEGSection
 {
 	JPEGMarker marker;
 	JPEGContent content;
+	unsigned int flags;
+	off_t offset;
 };
 
+typedef enum {
+	/* Let jpeg_data_save_file patch APP1 of the source file in place
+	 * when the new EXIF data fits into the old segment. Unlike the
+	 * rename, a crash or a concurrent reader may see the segment half
+	 * written. */
+	JPEG_DATA_OPTION_PATCH_IN_PLACE = 1 << 0,
+	/* Flush the written file (and the directory entry) to the disk
+	 * before jpeg_data_save_file returns. */
+	JPEG_DATA_OPTION_FSYNC          = 1 << 1,
+	/* Keep permissions of the file being replaced. */
+	JPEG_DATA_OPTION_KEEP_MODE      = 1 << 2,
+	/* Keep access and modification times of the file being replaced. */
+	JPEG_DATA_OPTION_KEEP_MTIME     = 1 << 3
+} JPEGDataOption;
+
 typedef struct _JPEGData        JPEGData;
 typedef struct _JPEGDataPrivate JPEGDataPrivate;
 
@@ -58,7 +91,7 @@ struct _JPEGData
 	unsigned int count;
 
 	unsigned char *data;
-	unsigned int size;
+	size_t size;
 
 	JPEGDataPrivate *priv;
 };
@@ -66,22 +99,33 @@ struct _JPEGData
 JPEGData *jpeg_data_new           (void);
 JPEGData *jpeg_data_new_from_file (const char *path);
 JPEGData *jpeg_data_new_from_data (const unsigned char *data,
-				   unsigned int size);
+				   size_t size);
 
 void      jpeg_data_ref   (JPEGData *data);
 void      jpeg_data_unref (JPEGData *data);
 void      jpeg_data_free  (JPEGData *data);
 
+/* Releases the loaded file, but keeps the buffers for the next one */
+void      jpeg_data_reset (JPEGData *data);
+
 void      jpeg_data_load_data     (JPEGData *data, const unsigned char *d,
-				   unsigned int size);
+				   size_t size);
 void      jpeg_data_save_data     (JPEGData *data, unsigned char **d,
-				   unsigned int *size);
+				   size_t *size);
+void      jpeg_data_borrow_data   (JPEGData *data, const unsigned char *d,
+				   size_t size);
+int       jpeg_data_save_head     (JPEGData *data, const unsigned char **d,
+				   size_t *size, size_t *tail);
 
 void      jpeg_data_load_file     (JPEGData *data, const char *path);
 int       jpeg_data_save_file     (JPEGData *data, const char *path);
 
 void      jpeg_data_set_exif_data (JPEGData *data, ExifData *exif_data);
 ExifData *jpeg_data_get_exif_data (JPEGData *data);
+const unsigned char *jpeg_data_get_source_exif (JPEGData *data,
+						unsigned int *size);
+void      jpeg_data_set_exif_blob (JPEGData *data, unsigned char *d,
+				   unsigned int size);
 
 void      jpeg_data_dump (JPEGData *data);
 
@@ -89,4 +133,11 @@ void      jpeg_data_append_section (JPEGData *data);
 
 void      jpeg_data_log (JPEGData *data, ExifLog *log);
 
+/* EXIF data and serialized blobs are allocated from 'mem'. Set it
+ * before anything is loaded. */
+void      jpeg_data_set_mem (JPEGData *data, ExifMem *mem);
+
+void      jpeg_data_set_option   (JPEGData *data, JPEGDataOption o);
+void      jpeg_data_unset_option (JPEGData *data, JPEGDataOption o);
+
 #endif /* __JPEG_DATA_H__ */
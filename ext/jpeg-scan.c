@@ -0,0 +1,263 @@
+/* jpeg-scan.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "jpeg-scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Headers are small, so a few reads of this size usually cover them */
+#define JPEG_SCAN_CHUNK 4096
+
+typedef struct _JPEGScanReader JPEGScanReader;
+struct _JPEGScanReader
+{
+	int fd;
+
+	/* Data in memory, which is read instead of the file if set */
+	const unsigned char *data;
+	size_t size;
+
+	/* Offset of chunk[0] in the file (or data) */
+	off_t base;
+	size_t pos;
+	size_t len;
+	const unsigned char *chunk;
+	unsigned char buf[JPEG_SCAN_CHUNK];
+};
+
+static int
+jpeg_scan_fill (JPEGScanReader *r)
+{
+	ssize_t n;
+
+	r->base += r->len;
+	r->pos = r->len = 0;
+	if (r->data) {
+		if ((size_t) r->base >= r->size)
+			return 0;
+		r->chunk = r->data + r->base;
+		r->len = r->size - r->base;
+		return 1;
+	}
+	do {
+		n = pread (r->fd, r->buf, sizeof (r->buf), r->base);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return 0;
+	r->chunk = r->buf;
+	r->len = (size_t) n;
+	return 1;
+}
+
+static int
+jpeg_scan_getc (JPEGScanReader *r)
+{
+	if (r->pos >= r->len && !jpeg_scan_fill (r))
+		return -1;
+	return r->chunk[r->pos++];
+}
+
+static void
+jpeg_scan_skip (JPEGScanReader *r, unsigned int n)
+{
+	if (n <= r->len - r->pos) {
+		r->pos += n;
+		return;
+	}
+
+	/* Jump over the rest of the segment without reading it */
+	r->base += r->pos + n;
+	r->pos = r->len = 0;
+}
+
+static int
+jpeg_scan_append (JPEGScan *scan)
+{
+	JPEGScanSegment *s;
+
+	if (scan->count == scan->alloc) {
+		unsigned int alloc = scan->alloc ? scan->alloc * 2 : 16;
+
+		s = realloc (scan->segments, sizeof (JPEGScanSegment) * alloc);
+		if (!s)
+			return 0;
+		scan->segments = s;
+		scan->alloc = alloc;
+	}
+	memset (&scan->segments[scan->count], 0, sizeof (JPEGScanSegment));
+	scan->count++;
+	return 1;
+}
+
+void
+jpeg_scan_init (JPEGScan *scan)
+{
+	if (!scan) return;
+	memset (scan, 0, sizeof (JPEGScan));
+}
+
+void
+jpeg_scan_clear (JPEGScan *scan)
+{
+	if (!scan) return;
+	free (scan->segments);
+	memset (scan, 0, sizeof (JPEGScan));
+}
+
+/*
+ * Walks the markers the same way as jpeg_data_load does, but keeps only
+ * the offsets and sizes of the segments. Returns zero if the file is not
+ * a JPEG file.
+ */
+static int
+jpeg_scan_run (JPEGScan *scan, JPEGScanReader *r)
+{
+	JPEGScanSegment *s;
+	unsigned int i, len;
+	off_t o;
+	int c;
+
+	scan->count = 0;
+	scan->complete = 0;
+
+	for (;;) {
+		o = r->base + r->pos;
+
+		/*
+		 * JPEG sections start with 0xff. The first byte that is
+		 * not 0xff is a marker (hopefully).
+		 */
+		for (i = 0; i < 8; i++)
+			if ((c = jpeg_scan_getc (r)) != 0xff)
+				break;
+		if (c < 0 || !i || !JPEG_IS_MARKER (c))
+			break;
+		if (!scan->count && c != JPEG_MARKER_SOI)
+			break;
+
+		if (!jpeg_scan_append (scan))
+			break;
+		s = &scan->segments[scan->count - 1];
+		s->marker = c;
+		s->offset = o + i - 1;
+
+		if (c == JPEG_MARKER_SOI)
+			continue;
+		if (c == JPEG_MARKER_EOI)
+			break;
+
+		/* Read the length of the section */
+		if ((c = jpeg_scan_getc (r)) < 0)
+			break;
+		len = c << 8;
+		if ((c = jpeg_scan_getc (r)) < 0)
+			break;
+		len |= c;
+		if (len < 2)
+			break;
+		s->size = len - 2;
+
+		if (s->marker == JPEG_MARKER_SOS) {
+			scan->complete = 1;
+			break;
+		}
+		jpeg_scan_skip (r, s->size);
+	}
+
+	return scan->count > 0;
+}
+
+int
+jpeg_scan_fd (JPEGScan *scan, int fd)
+{
+	JPEGScanReader r;
+
+	if (!scan || fd < 0) return 0;
+	memset (&r, 0, sizeof (r));
+	r.fd = fd;
+	return jpeg_scan_run (scan, &r);
+}
+
+/* Scans JPEG data in memory. Offsets of the segments are relative to d. */
+int
+jpeg_scan_data (JPEGScan *scan, const unsigned char *d, size_t size)
+{
+	JPEGScanReader r;
+
+	if (!scan || !d) return 0;
+	memset (&r, 0, sizeof (r));
+	r.fd = -1;
+	r.data = d;
+	r.size = size;
+	return jpeg_scan_run (scan, &r);
+}
+
+int
+jpeg_scan_file (JPEGScan *scan, const char *path)
+{
+	int fd, r;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	r = jpeg_scan_fd (scan, fd);
+	close (fd);
+	return r;
+}
+
+/*
+ * Returns the first segment with given marker, which follows the segment
+ * 'after' (or starts from the beginning if it is NULL).
+ */
+const JPEGScanSegment *
+jpeg_scan_find (const JPEGScan *scan, JPEGMarker marker,
+		const JPEGScanSegment *after)
+{
+	unsigned int i;
+
+	if (!scan) return NULL;
+	i = after ? (unsigned int) (after - scan->segments) + 1 : 0;
+	for (; i < scan->count; i++)
+		if (scan->segments[i].marker == marker)
+			return &scan->segments[i];
+	return NULL;
+}
+
+/*
+ * Reads the payload of the segment. The caller should free the result.
+ */
+unsigned char *
+jpeg_scan_read (int fd, const JPEGScanSegment *segment)
+{
+	unsigned char *d;
+	unsigned int done = 0;
+	ssize_t n;
+
+	if (!segment) return NULL;
+	d = malloc (segment->size ? segment->size : 1);
+	if (!d)
+		return NULL;
+	while (done < segment->size) {
+		n = pread (fd, d + done, segment->size - done,
+			   JPEG_SCAN_SEGMENT_DATA (segment) + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free (d);
+			return NULL;
+		}
+		done += n;
+	}
+	return d;
+}
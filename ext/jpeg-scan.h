@@ -0,0 +1,60 @@
+/* jpeg-scan.h
+ *
+ * Early-exit scanner of JPEG headers. It reads the file in small chunks,
+ * records the segments in front of the image data and stops at the first
+ * SOS marker, so the compressed scan is never read. JPEG data already
+ * in memory is scanned in place.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef __JPEG_SCAN_H__
+#define __JPEG_SCAN_H__
+
+#include "jpeg-marker.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct _JPEGScanSegment JPEGScanSegment;
+struct _JPEGScanSegment
+{
+	JPEGMarker marker;
+
+	/* Offset of the 0xff byte in front of the marker */
+	off_t offset;
+
+	/* Size of the payload, which follows the 2 bytes of length */
+	unsigned int size;
+};
+
+typedef struct _JPEGScan JPEGScan;
+struct _JPEGScan
+{
+	JPEGScanSegment *segments;
+	unsigned int count;
+	unsigned int alloc;
+
+	/* Set if the scan stopped at SOS, which is the last segment then */
+	int complete;
+};
+
+#define JPEG_SCAN_SEGMENT_DATA(s) ((s)->offset + 4)
+
+void jpeg_scan_init  (JPEGScan *scan);
+void jpeg_scan_clear (JPEGScan *scan);
+
+int  jpeg_scan_fd    (JPEGScan *scan, int fd);
+int  jpeg_scan_file  (JPEGScan *scan, const char *path);
+int  jpeg_scan_data  (JPEGScan *scan, const unsigned char *d,
+		      size_t size);
+
+const JPEGScanSegment *jpeg_scan_find (const JPEGScan *scan,
+				       JPEGMarker marker,
+				       const JPEGScanSegment *after);
+unsigned char *jpeg_scan_read (int fd, const JPEGScanSegment *segment);
+
+#endif /* __JPEG_SCAN_H__ */
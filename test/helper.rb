@@ -0,0 +1,33 @@
+require 'minitest/autorun'
+require 'fileutils'
+require 'tmpdir'
+require 'exif_geo_tag'
+require_relative 'jpeg_factory'
+
+class ExifGeoTagTest < Minitest::Test
+  include JPEGFactory
+
+  TAGS = {
+    _latitude: 52.5708272,
+    _longitude: 23.8014078,
+    _altitude: 20,
+    _timestamp: Time.utc(2017, 5, 4, 10, 20, 30)
+  }.freeze
+
+  def setup
+    @dir = Dir.mktmpdir('exif_geo_tag')
+  end
+
+  def teardown
+    ExifGeoTag.cache = nil
+    FileUtils.remove_entry(@dir)
+  end
+
+  def path(name)
+    File.join(@dir, name)
+  end
+
+  def photo(name = 'photo.jpg', **options)
+    write_jpeg(path(name), **options)
+  end
+end
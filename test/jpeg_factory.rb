@@ -0,0 +1,90 @@
+# Builds small JPEG files with the EXIF fields the tests and benchmarks
+# need: IFD 0 pointing to the EXIF IFD (with the capture time) and,
+# optionally, to the GPS IFD. segments are [marker, payload] pairs put
+# in front of the frame. The scan is filler, nothing decodes it.
+module JPEGFactory
+  GPS = {
+    latitude: [52.5708272, 'N'],
+    longitude: [23.8014078, 'E'],
+    altitude: 20
+  }.freeze
+
+  module_function
+
+  def jpeg(order: :intel, gps: true, time: '2016:05:04 10:20:30', subsec: nil, offset: nil, scan: 4096, segments: [])
+    exif = "Exif\0\0".b + tiff(order, gps, time, subsec, offset)
+    out = "\xff\xd8".b
+    out << segment(0xe0, "JFIF\0\1\1\0\0\1\0\1\0\0".b)
+    out << segment(0xe1, exif)
+    out << segment(0xfe, 'exif_geo_tag test'.b)
+    segments.each { |marker, payload| out << segment(marker, payload) }
+    out << segment(0xdb, "\0".b * 65)
+    out << segment(0xc0, "\0".b * 15)
+    out << segment(0xda, "\0".b * 10)
+    out << Array.new(scan) { |i| (i * 7) & 0x7f }.pack('C*')
+    out << "\xff\xd9".b
+  end
+
+  def write_jpeg(path, **options)
+    File.binwrite(path, jpeg(**options))
+    path
+  end
+
+  def segment(marker, payload)
+    [0xff, marker, payload.bytesize + 2].pack('CCn') + payload
+  end
+
+  def tiff(order, gps, time, subsec, offset)
+    e = order == :intel ? '<' : '>'
+    ascii = ->(s) { s.b + "\0".b }
+    rational = ->(*pairs) { pairs.map { |n, d| [n, d].pack("L#{e}L#{e}") }.join }
+
+    exif_entries = []
+    exif_entries << [0x9003, 2, ascii[time]] if time
+    exif_entries << [0x9011, 2, ascii[offset]] if offset
+    exif_entries << [0x9291, 2, ascii[subsec]] if subsec
+    gps_entries = [
+      [0x0000, 1, [2, 2, 0, 0].pack('C*')],
+      [0x0001, 2, ascii['N']],
+      [0x0002, 5, rational[[52, 1], [34, 1], [14_978, 1000]]],
+      [0x0003, 2, ascii['E']],
+      [0x0004, 5, rational[[23, 1], [48, 1], [5068, 1000]]],
+      [0x0006, 5, rational[[20, 1]]]
+    ]
+
+    make = ascii['Canon']
+    ifd0_count = gps ? 3 : 2
+    exif_offset = 8 + ifd_size(ifd0_count, [make])
+    exif_ifd = ifd(e, exif_entries, exif_offset)
+    gps_offset = exif_offset + exif_ifd.bytesize
+    ifd0_entries = [[0x010f, 2, make], [0x8769, 4, [exif_offset].pack("L#{e}")]]
+    ifd0_entries << [0x8825, 4, [gps_offset].pack("L#{e}")] if gps
+
+    out = (order == :intel ? "II*\0" : "MM\0*").b + [8].pack("L#{e}")
+    out << ifd(e, ifd0_entries, 8) << exif_ifd
+    out << ifd(e, gps_entries, gps_offset) if gps
+    out
+  end
+
+  def ifd_size(count, values)
+    2 + 12 * count + 4 + values.sum { |v| v.bytesize > 4 ? v.bytesize + v.bytesize % 2 : 0 }
+  end
+
+  # entries are [tag, format, value bytes], the count is taken from the bytes
+  def ifd(e, entries, base)
+    data = ''.b
+    out = [entries.size].pack("S#{e}")
+    values = base + 2 + 12 * entries.size + 4
+    entries.each do |tag, format, value|
+      count = format == 5 ? value.bytesize / 8 : value.bytesize
+      if value.bytesize <= 4
+        out << [tag, format, count].pack("S#{e}S#{e}L#{e}") << value.ljust(4, "\0".b)
+      else
+        out << [tag, format, count, values + data.bytesize].pack("S#{e}S#{e}L#{e}L#{e}")
+        data << value
+        data << "\0".b if value.bytesize.odd?
+      end
+    end
+    out << [0].pack("L#{e}") << data
+  end
+end
@@ -0,0 +1,56 @@
+require_relative 'helper'
+
+class TestCache < ExifGeoTagTest
+  def setup
+    super
+    ExifGeoTag.cache = ExifGeoTag::Cache.new(path('gps.cache'), entries: 64)
+  end
+
+  def test_hits_and_misses
+    file = photo
+    first = ExifGeoTag.read_tag(file)
+    second = ExifGeoTag.read_tag(file)
+
+    assert_equal first, second
+    assert_equal 1, ExifGeoTag.cache.hits
+    assert_equal 1, ExifGeoTag.cache.misses
+  end
+
+  def test_shared_between_instances
+    file = photo
+    ExifGeoTag.read_tag(file)
+    ExifGeoTag.cache = ExifGeoTag::Cache.new(path('gps.cache'))
+
+    assert_in_delta 52.5708272, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+    assert_equal 1, ExifGeoTag.cache.hits
+  end
+
+  def test_written_files_are_read_again
+    file = photo
+    ExifGeoTag.read_tag(file)
+    ExifGeoTag.write_tag(file, { _latitude: 1.5 }, keep_mtime: true)
+
+    assert_in_delta 1.5, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+  end
+
+  def test_changed_behind_its_back
+    file = photo
+    stat = File.stat(file)
+    ExifGeoTag.read_tag(file)
+    cache = ExifGeoTag.cache
+    ExifGeoTag.cache = nil
+    ExifGeoTag.write_tag(file, _latitude: 2.5)
+    File.utime(stat.atime, stat.mtime, file)
+    ExifGeoTag.cache = cache
+
+    # the size and mtime are the same, the change time is not
+    assert_equal stat.size, File.size(file)
+    assert_in_delta 2.5, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+  end
+
+  def test_not_a_cache
+    File.write(path('other'), 'x' * 8192)
+
+    assert_raises(ArgumentError) { ExifGeoTag::Cache.new(path('other')) }
+  end
+end
@@ -0,0 +1,27 @@
+require_relative 'helper'
+require 'open3'
+require 'rbconfig'
+
+class TestCLI < ExifGeoTagTest
+  BIN = File.expand_path('../bin/exif_geo_tag', __dir__)
+
+  def run_cli(*args)
+    includes = $LOAD_PATH.flat_map { |dir| ['-I', dir] }
+    Open3.capture2e(RbConfig.ruby, *includes, BIN, *args)
+  end
+
+  def test_south_west_row
+    photo('a.jpg', gps: false)
+    photo('b.jpg', gps: false)
+    File.write(path('map.csv'), "path,latitude,longitude\na.jpg,-33.8688,-70.5\nb.jpg,52.5,23.75,120\n")
+    output, status = run_cli(@dir, path('map.csv'))
+
+    assert status.success?, output
+    assert_match(/^2 tagged, 0 failed/, output)
+    values = ExifGeoTag.read_tag(path('a.jpg'))
+    assert_equal %w[S W], values.values_at(:latitude_ref, :longitude_ref)
+    assert_in_delta 33.8688, values[:_latitude], 1e-9
+    assert_in_delta 70.5, values[:_longitude], 1e-9
+    assert_equal %w[N E], ExifGeoTag.read_tag(path('b.jpg')).values_at(:latitude_ref, :longitude_ref)
+  end
+end
@@ -0,0 +1,54 @@
+require_relative 'helper'
+
+# The triplets are built natively for Integer and Float values; these
+# compare them with the Ruby expressions they replaced.
+class TestCoordinates < ExifGeoTagTest
+  def setup
+    super
+    @jpeg = jpeg(gps: false)
+  end
+
+  def ruby_dms(v)
+    deg = v.truncate
+    min = ((v - deg) * 60.0).truncate
+    sec = (((v - deg) - min / 60.0) * 3600.0).round(3)
+    [deg, min, sec].map(&:rationalize)
+  end
+
+  def ruby_degrees(dms)
+    deg, min, sec = dms
+    (deg + (min / 60.0 + sec / 3600.0)).to_f
+  end
+
+  def assert_converts(lat, lon)
+    out, = ExifGeoTag.write_tag_to_string(@jpeg, _latitude: lat, _longitude: lon)
+    values = ExifGeoTag.read_tag_from_string(out)
+
+    [[lat, :latitude, 'N', 'S'], [lon, :longitude, 'E', 'W']].each do |v, key, positive, negative|
+      assert_equal ruby_dms(v.abs), values[key], "#{key} of #{v.inspect}"
+      assert_equal v.negative? ? negative : positive, values[:"#{key}_ref"], "#{key}_ref of #{v.inspect}"
+      assert_equal ruby_degrees(values[key]), values[:"_#{key}"], "_#{key} of #{v.inspect}"
+    end
+  end
+
+  def test_grid
+    (-180_000..180_000).step(7) do |i|
+      assert_converts(i / 2000.0, i / 1000.0)
+    end
+  end
+
+  def test_edges
+    [0, 0.0, -0.0, 1e-9, -1e-9, 0.5 / 3600, 0.0005 / 3600, 0.0015 / 3600, 59.9995 / 3600, 1 - 1e-9,
+     89.9999999, 90, 90.0, 179.9999999, 180, 180.0].each do |v|
+      assert_converts(v.clamp(-90, 90), v)
+      assert_converts(-v.clamp(-90, 90), -v)
+    end
+  end
+
+  def test_integers_and_rationals
+    (-180..180).each do |i|
+      assert_converts(i / 2, i)
+      assert_converts(Rational(i, 2), Rational(i * 7, 11))
+    end
+  end
+end
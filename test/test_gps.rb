@@ -0,0 +1,67 @@
+require_relative 'helper'
+
+class TestGPS < ExifGeoTagTest
+  KEYS = %i[version_id latitude_ref latitude longitude_ref longitude altitude_ref altitude time_stamp date_stamp
+            satellites status measure_mode _latitude _longitude _altitude _timestamp].freeze
+
+  def assert_same_values(hash, gps)
+    assert_instance_of ExifGeoTag::GPS, gps
+    assert_equal hash, gps.to_h
+    KEYS.each do |key|
+      expected = hash[key]
+      if expected.nil?
+        assert_nil gps[key], key
+        assert_nil gps.public_send(key), key
+      else
+        assert_equal expected, gps[key], key
+        assert_equal expected, gps.public_send(key), key
+      end
+    end
+  end
+
+  def test_read_tag
+    %i[intel motorola].each do |order|
+      file = photo(order: order)
+      gps = ExifGeoTag.read_tag(file, as: :gps)
+
+      assert_same_values ExifGeoTag.read_tag(file), gps
+      assert_equal [52, 34, Rational(14_978, 1000)], gps.latitude
+      assert_in_delta 52.5708272, gps._latitude, 1e-6
+      assert_in_delta 23.8014078, gps._longitude, 1e-6
+      assert_equal 20.0, gps._altitude
+      assert_nil gps._timestamp
+    end
+  end
+
+  def test_write_tag_returns_previous_values
+    file = photo
+    expected = ExifGeoTag.write_tag(photo('hash.jpg'), TAGS.dup)
+
+    assert_same_values expected, ExifGeoTag.write_tag(file, TAGS.dup, as: :gps)
+    assert_same_values ExifGeoTag.read_tag(file), ExifGeoTag.read_tag(file, as: :gps)
+    assert_equal TAGS[:_timestamp], ExifGeoTag.read_tag(file, as: :gps)._timestamp
+  end
+
+  def test_write_tags_and_string
+    files = [photo('a.jpg'), photo('b.jpg', gps: false)]
+    results = ExifGeoTag.write_tags(files.map { |f| [f, TAGS.dup] }, as: :gps)
+
+    assert_equal [ExifGeoTag::GPS], results.map(&:class).uniq
+    assert_equal 52.5708272.round(4), results[0]._latitude.round(4)
+    assert_same_values({}, results[1])
+
+    jpeg = File.binread(files[0])
+    _, gps = ExifGeoTag.write_tag_to_string(jpeg, { _altitude: 5 }, as: :gps)
+    assert_same_values ExifGeoTag.write_tag_to_string(jpeg, _altitude: 5)[1], gps
+  end
+
+  def test_unknown_keys_and_types
+    gps = ExifGeoTag.read_tag(photo, as: :gps)
+
+    assert_nil gps[:nope]
+    assert_nil gps['latitude']
+    assert_equal ExifGeoTag.read_tag(photo), ExifGeoTag.read_tag(photo, as: :hash)
+    assert_raises(ArgumentError) { ExifGeoTag.read_tag(photo, as: :array) }
+    assert_raises(TypeError) { ExifGeoTag::GPS.allocate }
+  end
+end
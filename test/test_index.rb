@@ -0,0 +1,88 @@
+require_relative 'helper'
+
+class TestIndex < ExifGeoTagTest
+  PLACES = {
+    'berlin.jpg' => [52.52, 13.405],
+    'warsaw.jpg' => [52.2297, 21.0122],
+    'fiji.jpg' => [-17.7, 179.9],
+    'samoa.jpg' => [-13.8, -172.1],
+    'near/bialystok.jpg' => [53.1325, 23.1688]
+  }.freeze
+
+  def setup
+    super
+    @root = path('photos')
+    FileUtils.mkdir_p(File.join(@root, 'near'))
+    PLACES.each_with_index do |(name, (lat, lon)), i|
+      file = write_jpeg(File.join(@root, name), time: format('2016:05:04 10:2%d:00', i))
+      ExifGeoTag.write_tag(file, _latitude: lat, _longitude: lon)
+    end
+    write_jpeg(File.join(@root, 'nogps.jpg'), gps: false)
+    File.write(File.join(@root, 'notes.txt'), 'not a photo')
+  end
+
+  def build
+    ExifGeoTag::Index.build(path('photos.idx'), @root, threads: 2)
+  end
+
+  # the queries return full paths
+  def names(paths)
+    paths.map { |p| p.delete_prefix(@root + '/') }
+  end
+
+  def test_near
+    index = build
+
+    assert_equal ['warsaw.jpg'], names(index.near(52.23, 21.01, 1000))
+    assert_equal %w[near/bialystok.jpg warsaw.jpg], names(index.near(52.7, 22.1, 200_000)).sort
+  end
+
+  def test_within
+    index = build
+
+    assert_equal %w[berlin.jpg near/bialystok.jpg warsaw.jpg], names(index.within(50, 10, 55, 25)).sort
+    # west greater than east crosses the antimeridian
+    assert_equal %w[fiji.jpg samoa.jpg], names(index.within(-20, 179, -10, -172)).sort
+    at = Time.utc(2016, 5, 4, 10, 21)
+    assert_equal ['warsaw.jpg'], names(index.within(50, 10, 55, 25, time: at..at))
+  end
+
+  def test_between
+    index = build
+    paths = names(index.between(Time.utc(2016, 5, 4, 10, 21), Time.utc(2016, 5, 4, 10, 23)))
+
+    assert_equal %w[warsaw.jpg fiji.jpg samoa.jpg], paths
+  end
+
+  def test_update_after_write_keeping_size_and_mtime
+    build
+    file = File.join(@root, 'warsaw.jpg')
+    size = File.size(file)
+    # let the change time tick on file systems with coarse timestamps
+    sleep 0.01
+    ExifGeoTag.write_tag(file, { _latitude: 10.5, _longitude: 20.5 }, in_place: true, keep_mtime: true)
+    index = ExifGeoTag::Index.new(path('photos.idx'))
+    report = index.update
+
+    assert_equal size, File.size(file)
+    assert_equal 1, report[:read]
+    assert_empty names(index.near(52.23, 21.01, 1000))
+    assert_equal ['warsaw.jpg'], names(index.near(10.5, 20.5, 1000))
+  end
+
+  def test_reopen_and_update
+    build
+    index = ExifGeoTag::Index.new(path('photos.idx'))
+    assert_equal ['warsaw.jpg'], names(index.near(52.23, 21.01, 1000))
+
+    File.unlink(File.join(@root, 'berlin.jpg'))
+    ExifGeoTag.write_tag(File.join(@root, 'warsaw.jpg'), _latitude: 50.0614, _longitude: 19.9366)
+    report = index.update
+
+    assert_equal 1, report[:read]
+    assert_equal 1, report[:removed]
+    assert_empty names(index.near(52.23, 21.01, 1000))
+    assert_equal ['warsaw.jpg'], names(index.near(50.06, 19.94, 1000))
+    assert_empty names(index.near(52.52, 13.405, 1000))
+  end
+end
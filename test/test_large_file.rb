@@ -0,0 +1,86 @@
+require_relative 'helper'
+
+# A photo over 4 GiB: the headers, a hole in the scan and EOI. Skipped
+# where the file system cannot store it sparse.
+class TestLargeFile < ExifGeoTagTest
+  HOLE = (4 << 30) + 4096
+  TAIL = ("\x55".b * 16) + "\xff\xd9".b
+
+  # Keeps the head and the tail of the stream instead of 4 GiB of it
+  class Sink
+    attr_reader :head, :tail, :size
+
+    def initialize
+      @head = ''.b
+      @tail = ''.b
+      @size = 0
+    end
+
+    def write(str)
+      @head << str.byteslice(0, 65_536 - @head.bytesize) if @head.bytesize < 65_536
+      @tail = (@tail + str).byteslice(-TAIL.bytesize, TAIL.bytesize) || @tail + str
+      @size += str.bytesize
+      str.bytesize
+    end
+  end
+
+  def large_photo(name = 'large.jpg', gps: true)
+    file = path(name)
+    File.open(file, 'wb') do |f|
+      f.write(jpeg(gps: gps).byteslice(0...-2))
+      f.seek(HOLE)
+      f.write(TAIL)
+    end
+    skip 'no sparse files here' if File.stat(file).blocks * 512 > (1 << 20)
+    file
+  rescue Errno::EFBIG, Errno::ENOSPC
+    skip 'no files over 4 GiB here'
+  end
+
+  def assert_tagged(file)
+    stat = File.stat(file)
+
+    assert_operator stat.size, :>, HOLE
+    assert_operator stat.blocks * 512, :<, 1 << 20
+    assert_equal TAIL, IO.binread(file, TAIL.bytesize, stat.size - TAIL.bytesize)
+    assert_in_delta 52.5708272, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+    stat.size
+  end
+
+  def test_write_tag_in_place
+    file = large_photo
+    stat = File.stat(file)
+    ExifGeoTag.write_tag(file, { _latitude: 52.5708272 }, in_place: true)
+
+    assert_equal stat.size, assert_tagged(file)
+    assert_equal stat.ino, File.stat(file).ino
+  end
+
+  def test_write_tag
+    file = large_photo(gps: false)
+    size = File.size(file)
+    ExifGeoTag.write_tag(file, TAGS.dup)
+
+    assert_operator assert_tagged(file), :>, size
+  end
+
+  def test_writer
+    writer = ExifGeoTag::Writer.new
+    in_place = ExifGeoTag::Writer.new(in_place: true)
+    files = [large_photo('a.jpg', gps: false), large_photo('b.jpg')]
+    writer.write_tag(files[0], TAGS.dup)
+    in_place.write_tag(files[1], _latitude: 52.5708272)
+
+    files.each { |file| assert_tagged(file) }
+  end
+
+  def test_write_tag_stream
+    file = large_photo(gps: false)
+    out = Sink.new
+    File.open(file, 'rb') { |input| ExifGeoTag.write_tag_stream(input, out, TAGS.dup) }
+
+    assert_operator out.size, :>, File.size(file)
+    assert_equal TAIL, out.tail
+    assert_in_delta 52.5708272, ExifGeoTag.read_tag_from_string(out.head)[:_latitude], 1e-6
+  end
+end
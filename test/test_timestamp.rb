@@ -0,0 +1,60 @@
+require_relative 'helper'
+
+# _timestamp is converted natively for plain Times and well-formed
+# stamps; these compare it with the Ruby expressions it replaced.
+class TestTimestamp < ExifGeoTagTest
+  def setup
+    super
+    @jpeg = jpeg(gps: false)
+  end
+
+  def ruby_stamps(time)
+    [time.strftime('%Y:%m:%d'), [time.hour, time.min, time.sec].map(&:rationalize)]
+  end
+
+  def ruby_time(date_stamp, time_stamp)
+    Time.utc(*date_stamp.split(':').map(&:to_i), *time_stamp.map(&:to_i))
+  end
+
+  def round_trip(tags)
+    out, = ExifGeoTag.write_tag_to_string(@jpeg, tags)
+    [ExifGeoTag.read_tag_from_string(out), ExifGeoTag.read_tag_from_string(out, as: :gps)]
+  end
+
+  def assert_round_trip(time)
+    values, gps = round_trip(_timestamp: time)
+    date_stamp, time_stamp = ruby_stamps(time)
+
+    assert_equal date_stamp, values[:date_stamp], time.inspect
+    assert_equal time_stamp, values[:time_stamp], time.inspect
+    assert_equal ruby_time(date_stamp, time_stamp), values[:_timestamp], time.inspect
+    assert_equal values[:_timestamp], gps._timestamp, time.inspect
+  end
+
+  def test_utc
+    t = Time.utc(1900, 1, 1)
+    while t.year < 2100
+      assert_round_trip(t)
+      t += 86_400 * 13 + 3_607
+    end
+  end
+
+  def test_zones
+    [Time.at(1_493_893_230), Time.at(-1), Time.at(0).localtime('+05:30'), Time.at(0).localtime('-09:45'),
+     Time.new(2016, 2, 29, 23, 59, 59, '+14:00'), Time.at(1_493_893_230, 999_999, :usec).localtime('-00:01'),
+     Time.utc(1, 1, 1), Time.utc(9999, 12, 31, 23, 59, 59, Rational(1, 2))].each do |time|
+      assert_round_trip(time)
+    end
+  end
+
+  def test_written_stamps
+    [['2016:02:29', [23, 59, 59]], ['2016:02:30', [0, 0, 0]], ['2017:12:31', [Rational(47, 2), 0, Rational(1, 3)]],
+     ['0001:01:01', [0, 0, 0]]].each do |date_stamp, time_stamp|
+      values, gps = round_trip(date_stamp: date_stamp, time_stamp: time_stamp)
+
+      assert_equal ruby_time(date_stamp, time_stamp), values[:_timestamp], date_stamp
+      assert_equal values[:_timestamp], gps._timestamp, date_stamp
+    end
+    assert_raises(ArgumentError) { round_trip(date_stamp: '2017:13:01', time_stamp: [0, 0, 0]) }
+  end
+end
@@ -0,0 +1,124 @@
+require_relative 'helper'
+
+class TestTrack < ExifGeoTagTest
+  T0 = Time.utc(2016, 5, 4, 10, 20, 0)
+
+  def track
+    ExifGeoTag::Track.new([[T0 + 60, 3.0, 4.0, 110.0], [T0, 1.0, 2.0, 100.0], [T0 + 600, 9.0, 9.0]])
+  end
+
+  def test_points_are_sorted
+    t = track
+
+    assert_equal 3, t.size
+    assert_equal [T0, 1.0, 2.0, 100.0], t[0]
+    assert_equal [T0 + 600, 9.0, 9.0, nil], t[-1]
+    assert_nil t[3]
+  end
+
+  def test_interpolates
+    fix = track.locate(T0 + 30)
+
+    assert_in_delta 2.0, fix[:_latitude], 1e-9
+    assert_in_delta 3.0, fix[:_longitude], 1e-9
+    assert_in_delta 105.0, fix[:_altitude], 1e-9
+    assert_equal T0 + 30, fix[:_timestamp]
+  end
+
+  def test_max_gap
+    t = track
+
+    # the points 9 minutes apart are not interpolated between
+    assert_nil t.locate(T0 + 300)
+    assert_in_delta 3.0, t.locate(T0 + 90)[:_latitude], 1e-9
+    assert_in_delta 3.0 + 6.0 * 240 / 540, t.locate(T0 + 300, max_gap: 600)[:_latitude], 1e-9
+    assert_nil t.locate(T0 - 61)
+  end
+
+  def test_write_tags
+    files = [
+      photo('a.jpg', time: '2016:05:04 10:20:30', subsec: '5'),
+      photo('b.jpg', time: '2016:05:04 12:20:30', offset: '+02:00'),
+      photo('c.jpg', time: nil),
+      photo('d.jpg', time: '2016:05:04 11:00:00')
+    ]
+    results = track.write_tags(files, threads: 2)
+
+    assert_in_delta 2.0166666, results[0][:_latitude], 1e-6
+    assert_equal T0 + 30.5, results[0][:_timestamp]
+    assert_in_delta 2.0, results[1][:_latitude], 1e-9
+    assert_kind_of ArgumentError, results[2]
+    assert_kind_of RangeError, results[3]
+    assert_in_delta 2.0166666, ExifGeoTag.read_tag(files[0])[:_latitude], 1e-6
+  end
+
+  def test_out_of_range_points
+    [[Float::NAN, 1], [90.5, 1], [1, -180.5], [1, 1e12], [1, Float::INFINITY]].each do |lat, lon|
+      assert_raises(ArgumentError) { ExifGeoTag::Track.new([[T0, lat, lon]]) }
+    end
+    t = ExifGeoTag::Track.new([[T0, -90, 180]])
+    assert_raises(ArgumentError) { t.add(T0 + 1, 0, Float::NAN) }
+
+    assert_equal 1, t.size
+    assert_equal [T0, -90.0, 180.0, nil], t[0]
+    file = photo(time: '2016:05:04 10:20:00')
+    assert_kind_of Hash, t.write_tags([file])[0]
+    values = ExifGeoTag.read_tag(file)
+    assert_equal ['S', [90, 0, 0]], values.values_at(:latitude_ref, :latitude)
+    assert_equal ['E', [180, 0, 0]], values.values_at(:longitude_ref, :longitude)
+  end
+
+  def test_clock_offset
+    file = photo(time: '2016:05:04 12:20:30')
+    result = track.write_tags([file], clock_offset: -7200)[0]
+
+    assert_equal T0 + 30, result[:_timestamp]
+  end
+
+  def test_read_capture_times
+    files = [photo('a.jpg', subsec: '25'), photo('b.jpg', offset: '-01:30', order: :motorola), photo('c.jpg', time: nil)]
+    times = ExifGeoTag.read_capture_times(files)
+
+    assert_equal (T0 + 30).to_i * 1_000_000_000 + 250_000_000, times[0]
+    assert_equal (T0 + 30 + 5400).to_i * 1_000_000_000, times[1]
+    assert_kind_of ArgumentError, times[2]
+  end
+
+  # reads the log one chunk at a time, and tries the track in between
+  class ProbingIO
+    attr_reader :errors
+
+    def initialize(data, track)
+      @data = data
+      @track = track
+      @errors = []
+    end
+
+    def read(length)
+      [-> { @track.size }, -> { @track[0] }, -> { @track.locate(T0) }, -> { @track.add(T0, 1, 2) }].each do |probe|
+        probe.call
+      rescue RuntimeError => e
+        @errors << e.message
+      end
+      chunk = @data.slice!(0, length)
+      chunk.empty? ? nil : chunk
+    end
+  end
+
+  def test_in_use_while_loading
+    t = ExifGeoTag::Track.new
+    io = ProbingIO.new(nmea_log(10), t)
+    t.load(io, format: :nmea)
+
+    assert_equal 10, t.size
+    refute_empty io.errors
+    assert_equal ['ExifGeoTag::Track is in use'], io.errors.uniq
+  end
+
+  def nmea_log(count)
+    Array.new(count) do |i|
+      body = format('GPRMC,1020%02d.00,A,5234.25,N,02348.08,E,0.0,0.0,040516,,', i)
+      format("$%s*%02X\r\n", body, body.bytes.reduce(0, :^))
+    end.join
+  end
+end
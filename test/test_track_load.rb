@@ -0,0 +1,117 @@
+require_relative 'helper'
+require 'stringio'
+
+class TestTrackLoad < ExifGeoTagTest
+  T0 = Time.utc(2016, 5, 4, 10, 20, 0)
+
+  GPX = <<~GPX.freeze
+    <?xml version="1.0" encoding="UTF-8"?>
+    <!-- a <trkpt> in a comment -->
+    <gpx version="1.1" creator="test" xmlns="http://www.topografix.com/GPX/1/1">
+      <metadata><time>2001-01-01T00:00:00Z</time></metadata>
+      <wpt lat="1" lon="2"><time>2001-01-01T00:00:00Z</time></wpt>
+      <trk><name>a &lt; b</name><trkseg>
+        <trkpt lat="52.5" lon="23.75"><ele>120.5</ele><time>2016-05-04T10:20:00Z</time></trkpt>
+        <trkpt lon="23.8" lat="52.6"><ele><![CDATA[121]]></ele><time>2016-05-04T12:20:30.5+02:00</time></trkpt>
+        <trkpt lat="52.7" lon="23.9"><time>2016-05-04T10:21:00</time></trkpt>
+      </trkseg></trk>
+    </gpx>
+  GPX
+
+  KML = <<~KML.freeze
+    <?xml version="1.0"?>
+    <kml xmlns="http://www.opengis.net/kml/2.2" xmlns:gx="http://www.google.com/kml/ext/2.2"><Document>
+      <Placemark><TimeStamp><when>2000-01-01T00:00:00Z</when></TimeStamp><Point><coordinates>1,2,3</coordinates></Point></Placemark>
+      <Placemark><gx:Track>
+        <when>2016-05-04T10:20:00Z</when><when>2016-05-04T10:20:30.5Z</when><when>2016-05-04T10:21:00Z</when>
+        <gx:coord>23.75 52.5 120.5</gx:coord><gx:coord>23.8 52.6 121</gx:coord><gx:coord>23.9 52.7</gx:coord>
+      </gx:Track></Placemark>
+    </Document></kml>
+  KML
+
+  def nmea(body)
+    format("$%s*%02X\r\n", body, body.bytes.reduce(0, :^))
+  end
+
+  def nmea_log
+    nmea('GPRMC,102000.00,A,5230.00,N,02345.00,E,0.0,0.0,040516,,,A') +
+      nmea('GPGGA,102000.00,5230.00,N,02345.00,E,1,08,0.9,120.5,M,40.0,M,,') +
+      nmea('GPGSV,3,1,12,01,40,083,46') +
+      "$GPRMC,102010.00,A,0000.00,N,00000.00,E,0.0,0.0,040516,,*00\r\n" +
+      nmea('GNRMC,102030.50,A,5236.00,N,02348.00,E,0.0,0.0,040516,,,A') +
+      nmea('GNGGA,102030.50,5236.00,N,02348.00,E,1,08,0.9,121.0,M,40.0,M,,') +
+      nmea('GPRMC,102100.00,A,5242.00,N,02354.00,E,0.0,0.0,040516,,,A')
+  end
+
+  def assert_points(track)
+    assert_equal 3, track.size
+    assert_equal [T0, 52.5, 23.75, 120.5], track[0]
+    time, lat, lon, alt = track[1]
+    assert_equal T0 + 30.5, time
+    assert_in_delta 52.6, lat, 1e-9
+    assert_in_delta 23.8, lon, 1e-9
+    assert_in_delta 121.0, alt, 1e-9
+    assert_equal T0 + 60, track[2][0]
+    assert_nil track[2][3]
+  end
+
+  def test_gpx
+    File.write(path('a.gpx'), GPX)
+
+    assert_points ExifGeoTag::Track.load(path('a.gpx'))
+  end
+
+  def test_kml
+    assert_points ExifGeoTag::Track.load(StringIO.new(KML.dup), format: :kml)
+  end
+
+  def test_nmea
+    File.binwrite(path('a.nmea'), nmea_log)
+
+    assert_points ExifGeoTag::Track.load(path('a.nmea'))
+  end
+
+  def test_chunked_io
+    # one byte at a time splits every token at every offset
+    io = Object.new
+    data = GPX.dup
+    io.define_singleton_method(:read) { |_| data.empty? ? nil : data.slice!(0, 1) }
+
+    assert_points ExifGeoTag::Track.load(io)
+  end
+
+  def test_appends
+    File.write(path('a.gpx'), GPX)
+    track = ExifGeoTag::Track.new([[T0 - 60, 1, 2]])
+    track.load(path('a.gpx'), format: :gpx)
+
+    assert_equal 4, track.size
+    assert_equal T0 - 60, track[0][0]
+  end
+
+  def test_out_of_range_points
+    gpx = GPX.sub('<trkpt lat="52.7"', '<trkpt lat="1" lon="180.5"><time>2016-05-04T10:20:10Z</time></trkpt>
+        <trkpt lat="-90.01" lon="1"><time>2016-05-04T10:20:20Z</time></trkpt>
+        <trkpt lat="52.7"')
+    kml = KML.sub('<when>2016-05-04T10:21:00Z</when>', '<when>2016-05-04T10:20:40Z</when><when>2016-05-04T10:21:00Z</when>')
+             .sub('<gx:coord>23.9 52.7</gx:coord>', '<gx:coord>-181 52 1</gx:coord><gx:coord>23.9 52.7</gx:coord>')
+    log = nmea_log + nmea('GPRMC,102200.00,A,9030.00,N,02345.00,E,0.0,0.0,040516,,,A') +
+          nmea('GPRMC,102300.00,A,5230.00,N,18030.00,W,0.0,0.0,040516,,,A')
+
+    assert_points ExifGeoTag::Track.load(StringIO.new(gpx), format: :gpx)
+    assert_points ExifGeoTag::Track.load(StringIO.new(kml), format: :kml)
+    assert_points ExifGeoTag::Track.load(StringIO.new(log), format: :nmea)
+  end
+
+  def test_failed_load_leaves_track
+    track = ExifGeoTag::Track.new([[T0, 1, 2]])
+    io = Object.new
+    chunks = [GPX[0, 400]]
+    io.define_singleton_method(:read) { |_| chunks.shift || raise(IOError, 'gone') }
+
+    assert_raises(IOError) { track.load(io) }
+    assert_equal 1, track.size
+    assert_raises(Errno::ENOENT) { track.load(path('none.gpx')) }
+    assert_raises(ArgumentError) { track.load(path('none.gpx'), format: :csv) }
+  end
+end
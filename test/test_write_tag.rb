@@ -0,0 +1,129 @@
+require_relative 'helper'
+require 'stringio'
+
+class TestWriteTag < ExifGeoTagTest
+  def test_round_trip
+    file = photo(gps: false)
+    ExifGeoTag.write_tag(file, TAGS.dup)
+    values = ExifGeoTag.read_tag(file)
+
+    assert_in_delta 52.5708272, values[:_latitude], 1e-6
+    assert_in_delta 23.8014078, values[:_longitude], 1e-6
+    assert_in_delta 20, values[:_altitude], 1e-6
+    assert_equal 'N', values[:latitude_ref]
+    assert_equal 'E', values[:longitude_ref]
+    assert_equal '2017:05:04', values[:date_stamp]
+  end
+
+  def test_south_west
+    file = photo(gps: false)
+    ExifGeoTag.write_tag(file, _latitude: -33.8688, _longitude: -70.5)
+    values = ExifGeoTag.read_tag(file)
+
+    assert_equal 'S', values[:latitude_ref]
+    assert_equal 'W', values[:longitude_ref]
+    assert_equal [33, 52, Rational(7680, 1000)], values[:latitude]
+    assert_equal [70, 30, 0], values[:longitude]
+    assert_in_delta 33.8688, values[:_latitude], 1e-9
+    assert_in_delta 70.5, values[:_longitude], 1e-9
+  end
+
+  def test_negative_integer_and_rational
+    file = photo(gps: false)
+    ExifGeoTag.write_tag(file, _latitude: -33, _longitude: Rational(-141, 2))
+    values = ExifGeoTag.read_tag(file)
+
+    assert_equal ['S', [33, 0, 0]], values.values_at(:latitude_ref, :latitude)
+    assert_equal ['W', [70, 30, 0]], values.values_at(:longitude_ref, :longitude)
+  end
+
+  def test_returns_previous_values
+    file = photo
+    previous = ExifGeoTag.write_tag(file, _latitude: 10.5)
+
+    assert_in_delta 52.5708272, previous[:_latitude], 1e-6
+    assert_in_delta 10.5, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+  end
+
+  def test_patches_in_place
+    file = photo
+    before = File.binread(file)
+    inode = File.stat(file).ino
+    ExifGeoTag.write_tag(file, { _latitude: 1.25 }, in_place: true)
+    after = File.binread(file)
+
+    assert_equal inode, File.stat(file).ino
+    assert_equal before.bytesize, after.bytesize
+    # only the APP1 segment has changed, the scan is the same
+    app1_end = 22 + before[22, 2].unpack1('n')
+    assert_equal before[app1_end..-1], after[app1_end..-1]
+    assert_in_delta 1.25, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+  end
+
+  def test_rewrites_by_default
+    file = photo
+    inode = File.stat(file).ino
+    ExifGeoTag.write_tag(file, TAGS.dup)
+
+    refute_equal inode, File.stat(file).ino
+    assert_in_delta 52.5708272, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+    assert_equal [File.basename(file)], Dir.children(@dir)
+  end
+
+  def test_keeps_mtime
+    file = photo
+    File.utime(Time.at(1_000_000), Time.at(1_000_000), file)
+    ExifGeoTag.write_tag(file, { _latitude: 3.5 }, keep_mtime: true)
+
+    assert_equal 1_000_000, File.mtime(file).to_i
+  end
+
+  def test_missing_file
+    assert_raises(ArgumentError) { ExifGeoTag.write_tag(path('none.jpg'), TAGS.dup) }
+  end
+
+  def test_no_exif
+    File.binwrite(path('plain.jpg'), "\xff\xd8\xff\xd9".b)
+    assert_raises(ArgumentError) { ExifGeoTag.read_tag(path('plain.jpg')) }
+  end
+
+  def test_wrong_type
+    assert_raises(TypeError) { ExifGeoTag.write_tag(photo, differential: 'x') }
+  end
+
+  def test_string_matches_file
+    file = photo
+    data = File.binread(file)
+    out, previous = ExifGeoTag.write_tag_to_string(data, TAGS.dup)
+    file_previous = ExifGeoTag.write_tag(file, TAGS.dup, in_place: false)
+
+    assert_equal File.binread(file), out
+    assert_equal file_previous, previous
+    assert_equal ExifGeoTag.read_tag(file), ExifGeoTag.read_tag_from_string(out)
+    assert_equal jpeg, data
+  end
+
+  def test_stream_matches_string
+    data = jpeg(scan: 200_000)
+    out = StringIO.new(''.b)
+    ExifGeoTag.write_tag_stream(StringIO.new(data), out, TAGS.dup)
+
+    assert_equal ExifGeoTag.write_tag_to_string(data, TAGS.dup)[0], out.string
+  end
+
+  def test_writer
+    writer = ExifGeoTag::Writer.new(in_place: false)
+    files = Array.new(3) { |i| photo("w#{i}.jpg") }
+    files.each_with_index { |file, i| writer.write_tag(file, _latitude: i + 0.5) }
+
+    files.each_with_index do |file, i|
+      assert_in_delta i + 0.5, ExifGeoTag.read_tag(file)[:_latitude], 1e-6
+    end
+  end
+
+  def test_scan_markers
+    markers = ExifGeoTag.scan_markers(photo).map { |m| m[:marker] }
+
+    assert_equal %i[SOI APP0 APP1 COM DQT SOF0 SOS], markers
+  end
+end
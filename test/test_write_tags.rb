@@ -0,0 +1,80 @@
+require_relative 'helper'
+
+class TestWriteTags < ExifGeoTagTest
+  class Raising
+    def rationalize
+      raise 'broken value'
+    end
+  end
+
+  class Throwing
+    def rationalize
+      throw :stop
+    end
+  end
+
+  def test_results_in_order
+    files = Array.new(4) { |i| photo("p#{i}.jpg") }
+    results = ExifGeoTag.write_tags(files.map.with_index { |f, i| [f, { _latitude: i + 0.25 }] }, threads: 2)
+
+    assert_equal 4, results.size
+    results.each { |r| assert_in_delta 52.5708272, r[:_latitude], 1e-6 }
+    files.each_with_index { |f, i| assert_in_delta i + 0.25, ExifGeoTag.read_tag(f)[:_latitude], 1e-6 }
+  end
+
+  def test_errors_per_file
+    good = photo
+    File.binwrite(path('plain.jpg'), "\xff\xd8\xff\xd9".b)
+    results = ExifGeoTag.write_tags([
+                                      [good, TAGS.dup],
+                                      [path('none.jpg'), TAGS.dup],
+                                      [path('plain.jpg'), TAGS.dup],
+                                      [good.dup, { differential: 'x' }],
+                                      [good.dup, { _altitude: Raising.new }],
+                                      [42, TAGS.dup]
+                                    ])
+
+    assert_kind_of Hash, results[0]
+    assert_kind_of ArgumentError, results[1]
+    assert_kind_of ArgumentError, results[2]
+    assert_kind_of TypeError, results[3]
+    assert_kind_of RuntimeError, results[4]
+    assert_kind_of TypeError, results[5]
+  end
+
+  def test_throw_is_not_swallowed
+    result = catch(:stop) do
+      ExifGeoTag.write_tags([[photo, TAGS.dup], [photo, { _altitude: Throwing.new }]])
+      :returned
+    end
+
+    assert_nil result
+  end
+
+  def test_in_dir
+    FileUtils.mkdir_p(path('2017/05'))
+    photo('2017/a.jpg')
+    photo('2017/05/b.jpg')
+    File.binwrite(path('2017/broken.jpg'), 'not a photo')
+    report = ExifGeoTag.write_tags_in_dir(@dir, {
+                                            '2017/a.jpg' => TAGS.dup,
+                                            '2017/broken.jpg' => TAGS.dup,
+                                            '2018/c.jpg' => TAGS.dup
+                                          }, threads: 2)
+
+    assert_equal 1, report[:tagged]
+    assert_equal ['2017/broken.jpg'], report[:failed].keys
+    assert_kind_of ArgumentError, report[:failed]['2017/broken.jpg']
+    assert_equal ['2017/05/b.jpg'], report[:skipped]
+    assert_equal ['2018/c.jpg'], report[:missing]
+    assert_in_delta 52.5708272, ExifGeoTag.read_tag(path('2017/a.jpg'))[:_latitude], 1e-6
+  end
+
+  def test_in_dir_conversion_errors
+    photo('a.jpg')
+    report = ExifGeoTag.write_tags_in_dir(@dir, { 'a.jpg' => { _altitude: Raising.new } })
+
+    assert_equal 0, report[:tagged]
+    assert_kind_of RuntimeError, report[:failed]['a.jpg']
+  end
+end